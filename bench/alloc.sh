@@ -0,0 +1,50 @@
+#!/bin/sh
+# Compares the slab pools of the heap (see slab.hpp) with new and delete for
+# every object: builds the VM without the JIT with and without
+# SLAB_ALLOCATION and reports the best of RUNS wall clock times of every
+# script.
+#
+#   bench/alloc.sh [script.lox ...]
+#
+# CXX, CXXFLAGS and RUNS (default 5) are taken from the environment.
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build=${BUILD_DIR:-$root/bench/build}
+runs=${RUNS:-5}
+cxx=${CXX:-c++}
+flags=${CXXFLAGS:--O2}
+if [ $# -eq 0 ]; then
+	set -- "$root/bench/alloc.lox"
+fi
+
+sources="chunk.cpp compiler.cpp debug.cpp memory.cpp object.cpp registers.cpp
+	runtime.cpp scanner.cpp utils.cpp value.cpp vm.cpp"
+mkdir -p "$build"
+for mode in SLAB_ALLOCATION NEW_DELETE; do
+	echo "Building $mode"
+	define=-D$mode
+	# The default of common.hpp.
+	[ $mode = NEW_DELETE ] && define=
+	(cd "$root/src" && $cxx -std=c++17 $flags -DLOX_AOT_RUNTIME $define \
+		"-D__declspec(x)=" -I. $sources "$root/bench/interpret.cpp" \
+		-o "$build/$mode")
+done
+
+printf '%-24s %16s %16s\n' script slabs new-delete
+for script in "$@"; do
+	line=$(printf '%-24s' "$(basename "$script")")
+	for mode in SLAB_ALLOCATION NEW_DELETE; do
+		best=
+		i=0
+		while [ $i -lt "$runs" ]; do
+			start=$(date +%s.%N)
+			"$build/$mode" "$script" > /dev/null
+			end=$(date +%s.%N)
+			best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+			i=$((i + 1))
+		done
+		line="$line $(printf '%15.3fs' "$best")"
+	done
+	echo "$line"
+done
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Compares the dispatch modes of the interpreter, and the register form of the
+# code (see common.hpp): builds the VM without the JIT once per mode and
+# reports the best of RUNS wall clock times of every script.
+#
+#   bench/dispatch.sh [script.lox ...]
+#
+# CXX, CXXFLAGS and RUNS (default 5) are taken from the environment.
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build=${BUILD_DIR:-$root/bench/build}
+runs=${RUNS:-5}
+cxx=${CXX:-c++}
+flags=${CXXFLAGS:--O2}
+if [ $# -eq 0 ]; then
+	set -- "$root/test/mandel.lox" "$root/test/test5.lox" "$root/test/fib2.lox"
+fi
+
+sources="chunk.cpp compiler.cpp debug.cpp memory.cpp object.cpp registers.cpp
+	runtime.cpp scanner.cpp utils.cpp value.cpp vm.cpp"
+mkdir -p "$build"
+for mode in SWITCH_DISPATCH COMPUTED_GOTO DIRECT_THREADING REGISTER_VM; do
+	echo "Building $mode"
+	define=-D$mode
+	# The default of common.hpp on GCC and Clang.
+	[ $mode = COMPUTED_GOTO ] && define=
+	(cd "$root/src" && $cxx -std=c++17 $flags -DLOX_AOT_RUNTIME $define \
+		"-D__declspec(x)=" -I. $sources "$root/bench/interpret.cpp" \
+		-o "$build/$mode")
+done
+
+printf '%-24s %16s %16s %16s %16s\n' script switch computed-goto direct-threaded registers
+for script in "$@"; do
+	line=$(printf '%-24s' "$(basename "$script")")
+	for mode in SWITCH_DISPATCH COMPUTED_GOTO DIRECT_THREADING REGISTER_VM; do
+		best=
+		i=0
+		while [ $i -lt "$runs" ]; do
+			start=$(date +%s.%N)
+			"$build/$mode" "$script" > /dev/null
+			end=$(date +%s.%N)
+			best=$(echo "$start $end $best" | awk '{ t = $2 - $1; if ($3 == "" || t < $3) print t; else print $3 }')
+			i=$((i + 1))
+		done
+		line="$line $(printf '%15.3fs' "$best")"
+	done
+	echo "$line"
+done
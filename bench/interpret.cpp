@@ -0,0 +1,37 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "vm.hpp"
+
+// Runs a script in the interpreter alone, without the JIT, so the time of
+// the run is the time of bytecode dispatch (see dispatch.sh).
+static VM vm; // NOLINT
+
+int main(int argc, const char **argv)
+{
+	if (argc != 2)
+	{
+		std::cerr << "Usage: interpret [path]" << std::endl;
+		return 64;
+	}
+	std::ifstream file(argv[1]);
+	if (!file)
+	{
+		std::cerr << "Could not open file \"" << argv[1] << "\"." << std::endl;
+		return 74;
+	}
+	std::stringstream source;
+	source << file.rdbuf();
+
+	auto result = vm.interpret(source.str(), argv[1]);
+	if (result == InterpretResult::COMPILE_ERROR)
+		return 65;
+	if (result == InterpretResult::RUNTIME_ERROR)
+		return 70;
+	return 0;
+}
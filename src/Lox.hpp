@@ -44,7 +44,7 @@ public:
 		std::stringstream ss;
 		ss << file.rdbuf();
 
-		InterpretResult result = m_vm.interpret(ss.str());
+		InterpretResult result = m_vm.interpret(ss.str(), path);
 		file.close();
 
 		if (result == InterpretResult::COMPILE_ERROR)
@@ -53,6 +53,46 @@ public:
 			exit(70);
 	}
 
+	// Compiles the script at path ahead of time into the object file output
+	// (see aot.hpp).
+	static void compileFile(const std::string &path, const std::string &output)
+	{
+		std::ifstream file;
+		file.open(path, std::ios::in | std::ios::binary);
+		if (!file.good())
+		{
+			std::cerr << "Could not open or read the file \"" << path << "\"." << std::endl;
+			exit(47);
+		}
+
+		std::stringstream ss;
+		ss << file.rdbuf();
+
+		InterpretResult result = m_vm.compileToObject(ss.str(), output);
+		file.close();
+
+		if (result == InterpretResult::COMPILE_ERROR)
+			exit(65);
+	}
+
+	// How the JIT optimizes the code of the scripts run afterwards.
+	static void setOptimization(OptimizationOptions options)
+	{
+		m_vm.setOptimization(std::move(options));
+	}
+
+	// What the JIT reports about its work (see diagnostics.hpp).
+	static void setDiagnostics(Diagnostics diagnostics)
+	{
+		m_vm.setDiagnostics(std::move(diagnostics));
+	}
+
+	// Longest the collector runs at a time, in milliseconds.
+	static void setGcPauseTarget(double milliseconds)
+	{
+		m_vm.setGcPauseTarget(milliseconds);
+	}
+
 private:
 	static VM m_vm;
 };
@@ -0,0 +1,259 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Target/TargetOptions.h>
+
+#include "aot.hpp"
+#include "jit.hpp"
+#include "llvm_jit_utils.hpp"
+#include "vm.hpp"
+#include "utils.hpp"
+
+namespace
+{
+
+// Serializes the image described in aot.hpp.
+class ImageWriter
+{
+public:
+	void u8(uint8_t value)
+	{
+		m_bytes.push_back(value);
+	}
+
+	void u32(uint32_t value)
+	{
+		bytes(&value, sizeof(value));
+	}
+
+	void string(const std::string& value)
+	{
+		u32(static_cast<uint32_t>(value.size()));
+		bytes(value.data(), value.size());
+	}
+
+	void bytes(const void* data, size_t size)
+	{
+		auto begin = static_cast<const uint8_t*>(data);
+		m_bytes.insert(m_bytes.end(), begin, begin + size);
+	}
+
+	const std::vector<uint8_t>& data() const
+	{
+		return m_bytes;
+	}
+
+private:
+	std::vector<uint8_t> m_bytes;
+};
+
+std::string objectSymbol(uint32_t index)
+{
+	return "lox.obj." + std::to_string(index);
+}
+
+std::string functionSymbol(uint32_t index)
+{
+	return "lox.fn." + std::to_string(index);
+}
+
+// The executable is meant to run on other hosts than the one compiling it, so
+// the code is generated for the generic CPU of the host architecture.
+std::unique_ptr<llvm::TargetMachine> createTargetMachine()
+{
+	auto triple = llvm::sys::getDefaultTargetTriple();
+	std::string error;
+	auto target = llvm::TargetRegistry::lookupTarget(triple, error);
+	if (!target)
+		DIE << "No target for " << triple << ": " << error;
+
+	return std::unique_ptr<llvm::TargetMachine>(
+		target->createTargetMachine(triple, "generic", "", llvm::TargetOptions(), llvm::Reloc::PIC_));
+}
+
+}
+
+void emitObjectFile(VM* vm, ObjFunction* script, const std::string& path)
+{
+	// Number the script (object 0) and every name, constant and function
+	// reachable from it.
+	std::vector<sObj*> objects;
+	std::unordered_map<sObj*, uint32_t> ids;
+	std::vector<ObjFunction*> worklist;
+	auto add = [&](sObj* object) {
+		if (object == nullptr || ids.count(object))
+			return;
+		ids[object] = static_cast<uint32_t>(objects.size());
+		objects.push_back(object);
+		if (object->type == ObjType::FUNCTION)
+			worklist.push_back(static_cast<ObjFunction*>(object));
+	};
+	add(script);
+	while (!worklist.empty())
+	{
+		auto function = worklist.back();
+		worklist.pop_back();
+		add(function->name);
+		for (size_t i = 0; i < function->chunk.constantsSize(); ++i)
+		{
+			auto &constant = function->chunk.constants()[i];
+			if (constant.isObj())
+				add(constant.asObj());
+		}
+	}
+
+	ImageWriter image;
+	image.u32(AOT_IMAGE_MAGIC);
+	image.u32(sizeof(Value));
+	image.u32(sizeof(ObjString));
+	image.u32(sizeof(ObjFunction));
+
+	image.u32(static_cast<uint32_t>(vm->globalNames().size()));
+	for (auto &name : vm->globalNames())
+		image.string(name);
+
+	image.u32(static_cast<uint32_t>(objects.size()));
+	for (auto object : objects)
+		image.u8(static_cast<uint8_t>(object->type));
+	for (auto object : objects)
+	{
+		if (object->type == ObjType::STRING)
+		{
+			image.string(static_cast<ObjString*>(object)->value);
+			continue;
+		}
+
+		auto function = static_cast<ObjFunction*>(object);
+		auto &chunk = function->chunk;
+		image.u32(function->arity);
+		image.u32(function->name != nullptr ? ids[function->name] : AOT_NO_OBJECT);
+		image.u32(static_cast<uint32_t>(chunk.size()));
+		image.bytes(chunk.code(), chunk.size());
+		for (size_t i = 0; i < chunk.size(); ++i)
+			image.u32(chunk.getLine(i));
+		image.u32(static_cast<uint32_t>(chunk.constantsSize()));
+		for (size_t i = 0; i < chunk.constantsSize(); ++i)
+		{
+			auto &constant = chunk.constants()[i];
+			if (constant.isNumber())
+			{
+				auto number = constant.asNumber();
+				image.u8(static_cast<uint8_t>(AotConstant::NUMBER));
+				image.bytes(&number, sizeof(number));
+			}
+			else
+			{
+				image.u8(static_cast<uint8_t>(AotConstant::OBJECT));
+				image.u32(ids[constant.asObj()]);
+			}
+		}
+	}
+
+	llvm::LLVMContext context;
+	auto machine = createTargetMachine();
+	auto module = std::make_unique<llvm::Module>("lox.aot", context);
+
+	llvm::Type* value_type = create_value_type(context);
+	llvm::PointerType* valutePtr_type = llvm::PointerType::get(value_type, 0);
+	llvm::Type* uint8_type = llvm::Type::getInt8Ty(context);
+	llvm::Type* uint32_type = llvm::Type::getInt32Ty(context);
+	llvm::PointerType* voidPtr_type = llvm::Type::getInt8PtrTy(context);
+
+	// The storage is defined first, the references of every function link
+	// against it.
+	std::vector<llvm::GlobalVariable*> storage(objects.size());
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		auto is_function = objects[i]->type == ObjType::FUNCTION;
+		auto storage_type = llvm::ArrayType::get(uint8_type, is_function ? sizeof(ObjFunction) : sizeof(ObjString));
+		storage[i] = new llvm::GlobalVariable(*module, storage_type, false, llvm::GlobalValue::ExternalLinkage,
+			llvm::ConstantAggregateZero::get(storage_type), objectSymbol(i));
+		storage[i]->setAlignment(llvm::MaybeAlign(is_function ? alignof(ObjFunction) : alignof(ObjString)));
+	}
+
+	// Each function is generated in its own module, like the JIT does, with
+	// its references renamed to the storage of the objects.
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		if (objects[i]->type != ObjType::FUNCTION)
+			continue;
+
+		auto function = static_cast<ObjFunction*>(objects[i]);
+		auto refs = codeReferences(vm, function);
+		auto function_module = std::make_unique<llvm::Module>(functionSymbol(i), context);
+		declareRuntime(function_module.get(), value_type, valutePtr_type);
+		llvm::Function* func = generade_code(function_module.get(), vm, function, refs, functionSymbol(i),
+			llvm::Function::ExternalLinkage, value_type, valutePtr_type);
+		if (llvm::verifyFunction(*func, &llvm::errs()))
+			DIE << "Error verifying function.";
+
+		for (size_t r = 0; r < refs.objects.size(); ++r)
+		{
+			auto id = ids.find(refs.objects[r]);
+			if (id == ids.end())
+				DIE << "Object " << refs.objects[r] << " is not part of the image";
+			if (auto ref = function_module->getNamedGlobal(referenceSymbol(r)))
+				ref->setName(objectSymbol(id->second));
+		}
+
+		if (llvm::Linker::linkModules(*module, std::move(function_module)))
+			DIE << "Error linking " << functionSymbol(i);
+	}
+
+	std::vector<llvm::Constant*> object_addrs(objects.size());
+	std::vector<llvm::Constant*> entry_addrs(objects.size());
+	for (size_t i = 0; i < objects.size(); ++i)
+	{
+		storage[i]->setLinkage(llvm::GlobalValue::InternalLinkage);
+		object_addrs[i] = llvm::ConstantExpr::getBitCast(storage[i], voidPtr_type);
+		entry_addrs[i] = llvm::ConstantPointerNull::get(voidPtr_type);
+		if (auto func = module->getFunction(functionSymbol(i)))
+		{
+			func->setLinkage(llvm::GlobalValue::InternalLinkage);
+			func->setDLLStorageClass(llvm::GlobalValue::DefaultStorageClass);
+			entry_addrs[i] = llvm::ConstantExpr::getBitCast(func, voidPtr_type);
+		}
+	}
+
+	auto table_type = llvm::ArrayType::get(voidPtr_type, objects.size());
+	new llvm::GlobalVariable(*module, table_type, true, llvm::GlobalValue::ExternalLinkage,
+		llvm::ConstantArray::get(table_type, object_addrs), "lox_objects");
+	new llvm::GlobalVariable(*module, table_type, true, llvm::GlobalValue::ExternalLinkage,
+		llvm::ConstantArray::get(table_type, entry_addrs), "lox_entries");
+
+	auto image_data = llvm::ConstantDataArray::get(context, llvm::makeArrayRef(image.data()));
+	new llvm::GlobalVariable(*module, image_data->getType(), true, llvm::GlobalValue::ExternalLinkage,
+		image_data, "lox_image");
+	new llvm::GlobalVariable(*module, uint32_type, true, llvm::GlobalValue::ExternalLinkage,
+		llvm::ConstantInt::get(uint32_type, image.data().size()), "lox_image_size");
+
+	optimizeModule(machine.get(), module.get(), vm->optimization());
+
+	std::error_code error;
+	llvm::raw_fd_ostream out(path, error, llvm::sys::fs::OF_None);
+	if (error)
+		DIE << "Could not open " << path << ": " << error.message();
+
+	llvm::legacy::PassManager passes;
+	if (machine->addPassesToEmitFile(passes, out, nullptr, llvm::CGFT_ObjectFile))
+		DIE << "Target does not support object file emission";
+	passes.run(*module);
+	out.flush();
+}
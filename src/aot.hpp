@@ -0,0 +1,54 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#ifndef CPPLOX_AOT_HPP
+#define CPPLOX_AOT_HPP
+
+#include <cstdint>
+#include <string>
+
+#include "object.hpp"
+
+class VM;
+
+// Ahead-of-time compilation. emitObjectFile lowers a compiled script and every
+// function nested in it into one object file, with the code generator of the
+// JIT. Linked with aotMain.cpp and the runtime library (the VM built with
+// LOX_AOT_RUNTIME, no LLVM in it) it makes an executable that runs the script
+// without compiling anything.
+//
+// The generated code refers to functions and strings by address, so the object
+// file reserves the storage of every object and describes the objects in an
+// image the runtime constructs them from before running the script:
+//
+//   header     AOT_IMAGE_MAGIC and the sizes of Value, ObjString, ObjFunction
+//   globals    count, then the name of each global
+//   objects    count, then the ObjType of each object
+//   payloads   for each object in order, the characters of a string or the
+//              arity, name, code, lines and constants of a function
+//
+// Integers are 32 bits, strings are a length and their bytes, references to
+// objects are their index. Object 0 is the script.
+extern "C"
+{
+	extern const uint8_t lox_image[];
+	extern const uint32_t lox_image_size;
+	// Storage of each object, at the addresses the generated code uses.
+	extern void* const lox_objects[];
+	// Native code of each object, nullptr for strings.
+	extern const JitFn lox_entries[];
+}
+
+constexpr uint32_t AOT_IMAGE_MAGIC = 0x4c4f5801;
+constexpr uint32_t AOT_NO_OBJECT = UINT32_MAX;
+
+enum class AotConstant : uint8_t
+{
+	NUMBER,
+	OBJECT,
+};
+
+void emitObjectFile(VM* vm, ObjFunction* script, const std::string& path);
+
+#endif //CPPLOX_AOT_HPP
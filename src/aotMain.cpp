@@ -0,0 +1,18 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include "aot.hpp"
+#include "vm.hpp"
+
+// Entry point of ahead-of-time compiled scripts, the object file emitted by
+// CppLox --emit-obj provides the lox_* symbols.
+static VM vm; // NOLINT
+
+int main()
+{
+	auto result = vm.runImage(lox_image, lox_image_size, lox_objects, lox_entries);
+	if (result == InterpretResult::RUNTIME_ERROR)
+		return 70;
+	return 0;
+}
@@ -0,0 +1,154 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "aot.hpp"
+#include "vm.hpp"
+#include "utils.hpp"
+
+namespace
+{
+
+// Reads the image described in aot.hpp.
+class ImageReader
+{
+public:
+	ImageReader(const uint8_t* data, uint32_t size) : m_data(data), m_end(data + size)
+	{}
+
+	uint8_t u8()
+	{
+		uint8_t value;
+		bytes(&value, sizeof(value));
+		return value;
+	}
+
+	uint32_t u32()
+	{
+		uint32_t value;
+		bytes(&value, sizeof(value));
+		return value;
+	}
+
+	std::string string()
+	{
+		std::string value(u32(), '\0');
+		bytes(value.data(), value.size());
+		return value;
+	}
+
+	void bytes(void* out, size_t size)
+	{
+		if (static_cast<size_t>(m_end - m_data) < size)
+			DIE << "Truncated Lox image";
+		std::memcpy(out, m_data, size);
+		m_data += size;
+	}
+
+private:
+	const uint8_t* m_data;
+	const uint8_t* m_end;
+};
+
+}
+
+// Rebuilds the objects of an ahead-of-time compiled script in the storage
+// its object file reserved and runs its native code. The objects are not
+// linked into m_objects, they live as long as the executable.
+InterpretResult VM::runImage(const uint8_t* image, uint32_t size, void* const* objects, const JitFn* entries)
+{
+	ImageReader reader(image, size);
+	if (reader.u32() != AOT_IMAGE_MAGIC || reader.u32() != sizeof(Value) ||
+		reader.u32() != sizeof(ObjString) || reader.u32() != sizeof(ObjFunction))
+		DIE << "The script was compiled for another configuration of the VM";
+
+	// The natives come first, this VM defined them already.
+	auto globals = reader.u32();
+	for (uint32_t i = 0; i < globals; ++i)
+	{
+		auto name = reader.string();
+		if (i < m_globalNames.size())
+			continue;
+		m_globalValues.emplace_back();
+		m_globalNames.push_back(name);
+		m_globalStores.push_back(0);
+		m_globals[name] = Value::Number(i);
+	}
+
+	// Every object is constructed before any is filled in, constants refer
+	// to objects further down the image.
+	std::vector<sObj*> objs(reader.u32());
+	for (size_t i = 0; i < objs.size(); ++i)
+	{
+		switch (static_cast<ObjType>(reader.u8()))
+		{
+			case ObjType::STRING:
+				objs[i] = new (objects[i]) ObjString(std::string());
+				break;
+			case ObjType::FUNCTION:
+				objs[i] = new (objects[i]) ObjFunction();
+				break;
+			default:
+				DIE << "Unexpected object in Lox image";
+		}
+	}
+	auto object = [&](uint32_t index) {
+		if (index >= objs.size())
+			DIE << "Bad object reference in Lox image";
+		return objs[index];
+	};
+
+	for (size_t i = 0; i < objs.size(); ++i)
+	{
+		if (objs[i]->type == ObjType::STRING)
+		{
+			auto string = static_cast<ObjString*>(objs[i]);
+			string->value = reader.string();
+			m_strings[string->value] = string;
+			continue;
+		}
+
+		auto function = static_cast<ObjFunction*>(objs[i]);
+		function->arity = reader.u32();
+		auto name = reader.u32();
+		if (name != AOT_NO_OBJECT)
+			function->name = static_cast<ObjString*>(object(name));
+
+		std::vector<uint8_t> code(reader.u32());
+		reader.bytes(code.data(), code.size());
+		for (auto byte : code)
+			function->chunk.write(byte, reader.u32());
+
+		auto constants = reader.u32();
+		for (uint32_t c = 0; c < constants; ++c)
+		{
+			if (static_cast<AotConstant>(reader.u8()) == AotConstant::NUMBER)
+			{
+				double number;
+				reader.bytes(&number, sizeof(number));
+				function->chunk.addConstant(Value::Number(number));
+			}
+			else
+			{
+				function->chunk.addConstant(Value::Object(object(reader.u32())));
+			}
+		}
+		function->function = entries[i];
+	}
+
+	auto script = static_cast<ObjFunction*>(object(0));
+	m_stack.push(Value::Object(script));
+	CallFrame* frame = &m_frames[m_frameCount++];
+	frame->function = script;
+	frame->ip = script->chunk.code();
+	frame->slots = m_stack.getTop() - 1;
+	m_frame = frame;
+
+	int32_t stack_top = 1;
+	auto result = script->function.load()(this, m_globalValues.data(), frame->slots, &stack_top);
+	return static_cast<InterpretResult>(result);
+}
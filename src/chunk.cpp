@@ -3,6 +3,7 @@
 //
 
 #include "chunk.hpp"
+#include "utils.hpp"
 
 Chunk::Chunk()
 {
@@ -30,6 +31,12 @@ void Chunk::write(uint8_t byte, uint32_t line)
 	m_lines.push_back(line);
 }
 
+void Chunk::replaceCode(std::vector<uint8_t> code, std::vector<uint32_t> lines)
+{
+	m_code = std::move(code);
+	m_lines = std::move(lines);
+}
+
 size_t Chunk::addConstant(const Value &value)
 {
 	auto index = m_constantMap[value];
@@ -39,4 +46,137 @@ size_t Chunk::addConstant(const Value &value)
 	auto newIndex = Value::Number(m_constants.size() - 1);
 	m_constantMap[value] = newIndex;
 	return m_constants.size() - 1;
-}
\ No newline at end of file
+}
+
+uint32_t instructionSize(uint8_t instruction)
+{
+	switch (instruction)
+	{
+		case OpCode::CONSTANT:
+		case OpCode::GET_LOCAL:
+		case OpCode::SET_LOCAL:
+		case OpCode::GET_GLOBAL:
+		case OpCode::DEFINE_GLOBAL:
+		case OpCode::SET_GLOBAL:
+		case OpCode::CALL:
+		case OpCode::SET_LOCAL_POP:
+			return 2;
+		case OpCode::GET_LOCAL_SHORT:
+		case OpCode::SET_LOCAL_SHORT:
+		case OpCode::JUMP:
+		case OpCode::JUMP_IF_FALSE:
+		case OpCode::JUMP_IF_TRUE:
+		case OpCode::JUMP_BACK:
+		case OpCode::ADD_LOCAL_LOCAL:
+		case OpCode::MULTIPLY_LOCAL_LOCAL:
+		case OpCode::INC_LOCAL_CONST:
+		case OpCode::LESS_JUMP_IF_FALSE:
+		case OpCode::GREATER_JUMP_IF_FALSE:
+			return 3;
+		case OpCode::CONSTANT_LONG:
+		case OpCode::GET_GLOBAL_LONG:
+		case OpCode::DEFINE_GLOBAL_LONG:
+		case OpCode::SET_GLOBAL_LONG:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+std::vector<int32_t> stackDepths(Chunk* chunk, int32_t entryDepth)
+{
+	auto size = chunk->size();
+	std::vector<int32_t> depths(size, -1);
+	std::vector<uint32_t> worklist;
+
+	auto reach = [&](uint32_t target, int32_t depth) {
+		if (target >= size)
+			DIE << "Jump out of the chunk to " << target;
+		if (depths[target] == -1)
+		{
+			depths[target] = depth;
+			worklist.push_back(target);
+		}
+		else if (depths[target] != depth)
+		{
+			DIE << "Stack depth mismatch at " << target << ": " << depths[target] << " != " << depth;
+		}
+	};
+
+	reach(0, entryDepth);
+	while (!worklist.empty())
+	{
+		auto offset = worklist.back();
+		worklist.pop_back();
+
+		auto depth = depths[offset];
+		auto instruction = chunk->get(offset);
+		auto next = offset + instructionSize(instruction);
+		uint16_t jump = 0;
+		if (instructionSize(instruction) == 3)
+			jump = chunk->get(offset + 1u) | static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
+
+		switch (instruction)
+		{
+			case OpCode::CONSTANT:
+			case OpCode::CONSTANT_LONG:
+			case OpCode::NIL:
+			case OpCode::TRUE:
+			case OpCode::FALSE:
+			case OpCode::DUP:
+			case OpCode::GET_LOCAL:
+			case OpCode::GET_LOCAL_SHORT:
+			case OpCode::GET_GLOBAL:
+			case OpCode::GET_GLOBAL_LONG:
+			case OpCode::ADD_LOCAL_LOCAL:
+			case OpCode::MULTIPLY_LOCAL_LOCAL:
+				reach(next, depth + 1);
+				break;
+			case OpCode::POP:
+			case OpCode::DEFINE_GLOBAL:
+			case OpCode::DEFINE_GLOBAL_LONG:
+			case OpCode::EQUAL:
+			case OpCode::GREATER:
+			case OpCode::LESS:
+			case OpCode::ADD:
+			case OpCode::SUBTRACT:
+			case OpCode::MULTIPLY:
+			case OpCode::DIVIDE:
+			case OpCode::MODULO:
+			case OpCode::PRINT:
+			case OpCode::NOT_EQUAL:
+			case OpCode::GREATER_EQUAL:
+			case OpCode::LESS_EQUAL:
+			case OpCode::SET_LOCAL_POP:
+				reach(next, depth - 1);
+				break;
+			case OpCode::JUMP:
+				reach(next + jump, depth);
+				break;
+			case OpCode::JUMP_IF_FALSE:
+			case OpCode::JUMP_IF_TRUE:
+				reach(next, depth);
+				reach(next + jump, depth);
+				break;
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+				// The comparison result stays on the stack on both edges.
+				reach(next, depth - 1);
+				reach(next + jump, depth - 1);
+				break;
+			case OpCode::JUMP_BACK:
+				reach(next - jump, depth);
+				break;
+			case OpCode::CALL:
+				reach(next, depth - chunk->get(offset + 1u));
+				break;
+			case OpCode::RETURN:
+				break;
+			default:
+				// SET_LOCAL(_SHORT), SET_GLOBAL(_LONG), NOT, NEGATE, INC_LOCAL_CONST
+				reach(next, depth);
+				break;
+		}
+	}
+	return depths;
+}
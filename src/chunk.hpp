@@ -18,6 +18,8 @@ namespace OpCode
 #define OPCODE(name) name,
 #include "op_codes.hpp"
 #undef OPCODE
+		// Number of opcodes, the size of the dispatch table of VM::run.
+		COUNT
 	};
 }
 
@@ -40,6 +42,9 @@ public:
 	inline size_t size() const;
 	inline size_t constantsSize() const;
 
+	// Replaces the code, and the line of every byte, keeping the constants.
+	void replaceCode(std::vector<uint8_t> code, std::vector<uint32_t> lines);
+
 
 private:
 	std::vector<uint8_t> m_code;
@@ -48,6 +53,15 @@ private:
 	HashTable<Value, Value> m_constantMap;
 };
 
+// Size in bytes of the instruction (opcode plus operands).
+uint32_t instructionSize(uint8_t instruction);
+
+// Abstract interpretation of the value stack: the depth (number of live
+// slots, locals included) before every instruction, or -1 for dead code.
+// The compiler only emits code whose depth is the same on every path, so a
+// single forward pass over the control flow graph is enough.
+std::vector<int32_t> stackDepths(Chunk* chunk, int32_t entryDepth);
+
 #include "chunk.inl"
 
 #endif //CPPLOX_CHUNK_HPP
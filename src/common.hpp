@@ -5,12 +5,96 @@
 #ifndef CPPLOX_COMMON_HPP
 #define CPPLOX_COMMON_HPP
 
-#ifndef _MSC_VER 
-//#define COMPUTED_GOTO
+// How VM::run dispatches bytecode. COMPUTED_GOTO jumps through a table of
+// label addresses (a GCC and Clang extension) instead of a single switch, so
+// every handler ends in its own indirect branch. DIRECT_THREADING also
+// translates every function, on its first run, into the handler address of
+// each instruction, which saves the load of the opcode and of the table.
+// Define SWITCH_DISPATCH or DIRECT_THREADING on the command line to pick a
+// mode without editing this file (see bench/dispatch.sh).
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SWITCH_DISPATCH)
+#define COMPUTED_GOTO
+//#define DIRECT_THREADING
 #endif
 
-#define DEBUG_PRINT_CODE
+#if defined(DIRECT_THREADING) && !defined(COMPUTED_GOTO)
+#error "DIRECT_THREADING needs COMPUTED_GOTO"
+#endif
+
+// Interpret functions in register form: the compiler also translates the
+// stack code of every function into three address code over the slots of its
+// frame (see registers.hpp), which VM::runRegisters runs. The stack code
+// stays for the JIT and for the functions that do not fit the operands.
+//#define REGISTER_VM
+
+// Pack every Value into a single NaN-boxed 64 bit word. Comment out to use the
+// 16 byte tagged union instead (both the VM and the JIT follow this switch).
+#define NAN_BOXING
+
+// Start every function in the interpreter and only hand it to the JIT once it
+// is called JIT_CALL_THRESHOLD times or loops JIT_BACKEDGE_THRESHOLD times.
+// Comment out to JIT the whole script before running it.
+#define TIERED_EXECUTION
+#define JIT_CALL_THRESHOLD 100
+#define JIT_BACKEDGE_THRESHOLD 10000
+
+// Optimize and generate the machine code of hot functions on background
+// threads. The interpreter keeps running them until the code is published and
+// checks a pending OSR variant again every JIT_OSR_POLL_INTERVAL back edges.
+// JIT_COMPILE_THREADS 0 uses one thread per hardware thread but this one.
+#define BACKGROUND_COMPILATION
+#define JIT_OSR_POLL_INTERVAL 1000
+#define JIT_COMPILE_THREADS 0
+
+// Compile arithmetic as if its operands were numbers, guarded by type checks
+// that fall back to the interpreter (deoptimize) when the guess is wrong.
+#define TYPE_SPECULATION
+
+// Keep the object code of JITed functions in a directory and link it again
+// when a later run compiles the same code. The LOX_JIT_CACHE environment
+// variable names the directory; defining JIT_OBJECT_CACHE to one caches there
+// when it is not set. Off by default, runs then touch no files.
+//#define JIT_OBJECT_CACHE ".loxcache"
+
+// LOX_AOT_RUNTIME is defined (-DLOX_AOT_RUNTIME) when building the runtime
+// library of ahead-of-time compiled scripts. That VM has no JIT, it only
+// interprets what a failed speculation guard hands back to it.
+#ifdef LOX_AOT_RUNTIME
+#undef TIERED_EXECUTION
+#undef JIT_OBJECT_CACHE
+#endif
+
+// Without the interpreter tier there is nothing to run while code compiles.
+#ifndef TIERED_EXECUTION
+#undef BACKGROUND_COMPILATION
+#endif
+
+// Objects are freed by a mark and sweep cycle that starts once the heap grows
+// to GC_HEAP_GROW_FACTOR times what the last one left alive, and at least to
+// GC_INITIAL_THRESHOLD bytes. The cycle runs in increments of at most
+// GC_PAUSE_TARGET milliseconds (see VM::setGcPauseTarget), one every
+// GC_STEP_SIZE bytes allocated and at back edges (see Memory::collectStep).
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_PAUSE_TARGET 1.0
+#define GC_STEP_SIZE (64 * 1024)
+// Strings made by concatenation start in a nursery of GC_NURSERY_SIZE bytes,
+// allocated by bumping a pointer. When it is full, or their characters take
+// as many bytes, the ones still reachable are moved to the heap and the
+// nursery starts over.
+#define GC_NURSERY_SIZE (256 * 1024)
+// Allocate the objects of the heap from pages of SLAB_PAGE_SIZE bytes, split
+// in slots of the size of one type of object (see slab.hpp), instead of with
+// one new and delete each. Off until bench/alloc.sh shows it pays for the
+// memory it keeps; define it on the command line to try it.
+//#define SLAB_ALLOCATION
+#define SLAB_PAGE_SIZE (256 * 1024)
+
+//#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
+// Collect before every allocation, and report every collection.
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
 
 #define MAX_LOCALS 2048
 
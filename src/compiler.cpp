@@ -2,8 +2,10 @@
 // Created by juanb on 30/09/2018.
 //
 
+#include <cassert>
 #include <iostream>
 #include <iomanip>
+#include <limits>
 #include "compiler.hpp"
 #include "vm.hpp"
 #include "scanner.hpp"
@@ -17,14 +19,10 @@
 #define MAX_CONSTANTS_BEFORE_LONG 256
 #define MAX_CASES 256
 
-Scope::Scope(VM* vm, Parser* parser, FunctionType type, Scope* enclosing) :
+Scope::Scope(VM* vm, FunctionType type, Scope* enclosing) :
 	enclosing(enclosing), type(type)
 {
 	function = Memory::createFunction(vm);
-	if (type != FunctionType::SCRIPT)
-	{
-		function->name = Memory::createString(vm, parser->previous.lexeme);
-	}
 
 	auto local = &locals[localCount++];
 	local->depth = 0;
@@ -34,7 +32,7 @@ Scope::Scope(VM* vm, Parser* parser, FunctionType type, Scope* enclosing) :
 ObjFunction* Compiler::compile(VM *vm, std::string_view source)
 {
 	init();
-	auto scope = Scope{vm, &m_parser, FunctionType::SCRIPT, nullptr};
+	auto scope = Scope{vm, FunctionType::SCRIPT, nullptr};
 	m_scanner = Scanner(source);
 	m_current = &scope;
 	m_vm = vm;
@@ -162,6 +160,8 @@ void Compiler::emitReturn()
 
 uint32_t Compiler::makeConstant(const Value &value)
 {
+	// Chunk constants are no roots of the nursery (see createYoungString).
+	assert(!value.isObj() || !Memory::isYoung(m_vm, value.asObj()));
 	return currentChunk()->addConstant(value);
 }
 
@@ -193,14 +193,135 @@ void Compiler::patchJump(uint32_t offset)
 	currentChunk()->get(offset + 1u) = (jump >> 8u) & 0xffu;
 }
 
+// Replaces the sequences listed in op_codes.hpp with their superinstruction,
+// so the interpreter dispatches fewer instructions. A sequence is not fused
+// if a jump lands inside it. The code only shrinks, jumps are shortened to
+// their new targets.
+static void fuseInstructions(Chunk* chunk)
+{
+	auto code = chunk->code();
+	auto size = static_cast<uint32_t>(chunk->size());
+
+	auto isJump = [](uint8_t instruction) {
+		return instruction == OpCode::JUMP || instruction == OpCode::JUMP_IF_FALSE ||
+			instruction == OpCode::JUMP_IF_TRUE || instruction == OpCode::JUMP_BACK;
+	};
+	auto jumpTarget = [&](uint32_t offset) {
+		uint16_t jump = code[offset + 1u] | static_cast<uint16_t>(code[offset + 2u] << 8u);
+		return code[offset] == OpCode::JUMP_BACK ? offset + 3u - jump : offset + 3u + jump;
+	};
+
+	std::vector<bool> targets(size + 1, false);
+	for (auto offset = 0u; offset < size; offset += instructionSize(code[offset]))
+	{
+		if (isJump(code[offset]))
+			targets[jumpTarget(offset)] = true;
+	}
+
+	// Whether the instructions starting at offset are ops, no jump landing
+	// after the first one.
+	auto matches = [&](uint32_t offset, std::initializer_list<uint8_t> ops) {
+		auto first = offset;
+		for (auto op : ops)
+		{
+			if (offset >= size || code[offset] != op || (offset != first && targets[offset]))
+				return false;
+			offset += instructionSize(op);
+		}
+		return true;
+	};
+
+	std::vector<uint8_t> fused;
+	std::vector<uint32_t> lines;
+	// Old offset of every instruction -> its new offset.
+	std::vector<uint32_t> moved(size + 1, 0);
+	// New offset of every jump -> its old target.
+	std::vector<std::pair<uint32_t, uint32_t>> jumps;
+	fused.reserve(size);
+	lines.reserve(size);
+
+	for (auto offset = 0u; offset < size;)
+	{
+		auto line = chunk->getLine(offset);
+		auto emit = [&](std::initializer_list<uint8_t> bytes) {
+			for (auto byte : bytes)
+			{
+				fused.push_back(byte);
+				lines.push_back(line);
+			}
+		};
+		moved[offset] = static_cast<uint32_t>(fused.size());
+
+		if (matches(offset, {OpCode::GET_LOCAL, OpCode::CONSTANT, OpCode::ADD, OpCode::SET_LOCAL, OpCode::POP}) &&
+			code[offset + 6u] == code[offset + 1u] && chunk->getConstant(code[offset + 3u]).isNumber())
+		{
+			emit({OpCode::INC_LOCAL_CONST, code[offset + 1u], code[offset + 3u]});
+			offset += 8;
+		}
+		else if (matches(offset, {OpCode::GET_LOCAL, OpCode::GET_LOCAL, OpCode::ADD}))
+		{
+			emit({OpCode::ADD_LOCAL_LOCAL, code[offset + 1u], code[offset + 3u]});
+			offset += 5;
+		}
+		else if (matches(offset, {OpCode::GET_LOCAL, OpCode::GET_LOCAL, OpCode::MULTIPLY}))
+		{
+			emit({OpCode::MULTIPLY_LOCAL_LOCAL, code[offset + 1u], code[offset + 3u]});
+			offset += 5;
+		}
+		else if (matches(offset, {OpCode::SET_LOCAL, OpCode::POP}))
+		{
+			emit({OpCode::SET_LOCAL_POP, code[offset + 1u]});
+			offset += 3;
+		}
+		else if (matches(offset, {OpCode::LESS, OpCode::JUMP_IF_FALSE}) ||
+			matches(offset, {OpCode::GREATER, OpCode::JUMP_IF_FALSE}))
+		{
+			jumps.emplace_back(static_cast<uint32_t>(fused.size()), jumpTarget(offset + 1u));
+			emit({code[offset] == OpCode::LESS ? OpCode::LESS_JUMP_IF_FALSE : OpCode::GREATER_JUMP_IF_FALSE, 0, 0});
+			offset += 4;
+		}
+		else
+		{
+			auto instruction = code[offset];
+			if (isJump(instruction))
+				jumps.emplace_back(static_cast<uint32_t>(fused.size()), jumpTarget(offset));
+			for (auto i = 0u; i < instructionSize(instruction); ++i)
+				emit({code[offset + i]});
+			offset += instructionSize(instruction);
+		}
+	}
+	moved[size] = static_cast<uint32_t>(fused.size());
+
+	for (auto &jump : jumps)
+	{
+		auto offset = jump.first;
+		auto target = moved[jump.second];
+		auto distance = fused[offset] == OpCode::JUMP_BACK ? offset + 3u - target : target - offset - 3u;
+		fused[offset + 1u] = distance & 0xffu;
+		fused[offset + 2u] = (distance >> 8u) & 0xffu;
+	}
+
+	chunk->replaceCode(std::move(fused), std::move(lines));
+}
+
 ObjFunction* Compiler::endCompiler()
 {
 	emitReturn();
 	auto function = m_current->function;
+	if (!m_parser.hadError)
+	{
+		fuseInstructions(currentChunk());
+#ifdef REGISTER_VM
+		translateToRegisters(currentChunk(), function->arity, &function->registers);
+#endif
+	}
 #ifdef DEBUG_PRINT_CODE
 	if (!m_parser.hadError)
 	{
 		disassembleChunk(*currentChunk(), function->name != nullptr ? function->name->value : "<script>");
+#ifdef REGISTER_VM
+		disassembleRegisters(function->registers, function->name != nullptr ? function->name->value : "<script>");
+#endif
 	}
 #endif
 	m_current = m_current->enclosing;
@@ -237,7 +358,7 @@ void Compiler::binary(bool)
 	switch (operatorType)
 	{
 		case TokenType::BANG_EQUAL:
-			emitBytes(OpCode::EQUAL, OpCode::NOT);
+			emitByte(OpCode::NOT_EQUAL);
 			break;
 		case TokenType::EQUAL_EQUAL:
 			emitByte(OpCode::EQUAL);
@@ -246,13 +367,13 @@ void Compiler::binary(bool)
 			emitByte(OpCode::GREATER);
 			break;
 		case TokenType::GREATER_EQUAL:
-			emitBytes(OpCode::LESS, OpCode::NOT);
+			emitByte(OpCode::GREATER_EQUAL);
 			break;
 		case TokenType::LESS:
 			emitByte(OpCode::LESS);
 			break;
 		case TokenType::LESS_EQUAL:
-			emitBytes(OpCode::GREATER, OpCode::NOT);
+			emitByte(OpCode::LESS_EQUAL);
 			break;
 		case TokenType::PLUS:
 			emitByte(OpCode::ADD);
@@ -443,6 +564,7 @@ void Compiler::namedVariable(const Token &name, bool canAssign)
 				default:
 					break;
 			}
+			m_vm->globalStores()[arg]++;
 			if (arg < MAX_CONSTANTS_BEFORE_LONG) {
 				emitBytes(OpCode::SET_GLOBAL, static_cast<uint8_t>(arg));
 			}
@@ -454,6 +576,7 @@ void Compiler::namedVariable(const Token &name, bool canAssign)
 		else if (canAssign && match(TokenType::EQUAL))
 		{
 			expression();
+			m_vm->globalStores()[arg]++;
 			if (arg < MAX_CONSTANTS_BEFORE_LONG) {
 				emitBytes(OpCode::SET_GLOBAL, static_cast<uint8_t>(arg));
 			}
@@ -539,6 +662,7 @@ uint32_t Compiler::identifierConstant(const Token &token)
 
 	m_vm->globalValues().emplace_back();
 	m_vm->globalNames().push_back(identifier);
+	m_vm->globalStores().push_back(0);
 	uint32_t newIndex = m_vm->globalValues().size() - 1;
 
 	m_vm->globalsMap()[identifier] = Value::Number(newIndex);
@@ -628,6 +752,7 @@ void Compiler::defineVariable(uint32_t global)
 		return;
 	}
 
+	m_vm->globalStores()[global]++;
 	if (global < MAX_CONSTANTS_BEFORE_LONG)
 	{
 		emitBytes(OpCode::DEFINE_GLOBAL, static_cast<uint8_t>(global));
@@ -679,8 +804,12 @@ void Compiler::block()
 
 void Compiler::function(FunctionType type)
 {
-	auto scope = Scope{m_vm, &m_parser, type, m_current};
+	auto scope = Scope{m_vm, type, m_current};
 	m_current = &scope;
+	// Named once the collector finds the function through m_current.
+	auto name = Memory::createString(m_vm, m_parser.previous.lexeme);
+	Memory::writeBarrier(m_vm, m_current->function->name);
+	m_current->function->name = name;
 	beginScope();
 
 	// Compile the parameter list.
@@ -46,7 +46,7 @@ struct Scope
 	int localCount{0};
 	int scopeDepth{0};
 
-	Scope(VM* vm, Parser* parser, FunctionType type, Scope* enclosing);
+	Scope(VM* vm, FunctionType type, Scope* enclosing);
 };
 
 enum class Precedence : uint8_t
@@ -78,6 +78,8 @@ class VM;
 class Compiler
 {
 	friend struct Scope;
+	// The functions being compiled are roots of the collector.
+	friend class Memory;
 public:
 	ObjFunction* compile(VM *vm, std::string_view source);
 	Chunk *currentChunk();
@@ -57,6 +57,23 @@ static size_t jumpInstruction(const std::string &name, int sign, const Chunk &ch
 	return offset + 3;
 }
 
+static size_t twoByteInstruction(const std::string &name, const Chunk &chunk, size_t offset) {
+	uint16_t a = chunk.get(offset + 1u);
+	uint16_t b = chunk.get(offset + 2u);
+	std::cout << std::setiosflags(std::ios::left) << std::setw(16) << std::setfill(' ') << name;
+	std::cout << std::resetiosflags(std::ios::left) << std::setw(4) << a << " " << std::setw(4) << b << "\n";
+	return offset + 3;
+}
+
+static size_t localConstantInstruction(const std::string &name, const Chunk &chunk, size_t offset) {
+	uint16_t slot = chunk.get(offset + 1u);
+	uint16_t constant = chunk.get(offset + 2u);
+	std::cout << std::setiosflags(std::ios::left) << std::setw(16) << std::setfill(' ') << name;
+	std::cout << std::resetiosflags(std::ios::left) << std::setw(4) << slot << " " << std::setw(4) << constant << " '";
+	std::cout << chunk.getConstant(constant) << "'" << "\n";
+	return offset + 3;
+}
+
 static size_t constantInstruction(const std::string &name, const Chunk &chunk, size_t offset)
 {
 	uint16_t constant = chunk.get(offset + 1u);
@@ -160,8 +177,105 @@ size_t disassembleInstruction(const Chunk &chunk, size_t offset)
 			return byteInstruction("OP_CALL", chunk, offset);
 		case OpCode::RETURN:
 			return simpleInstruction("OP_RETURN", offset);
+		case OpCode::NOT_EQUAL:
+			return simpleInstruction("OP_NOT_EQUAL", offset);
+		case OpCode::GREATER_EQUAL:
+			return simpleInstruction("OP_GREATER_EQUAL", offset);
+		case OpCode::LESS_EQUAL:
+			return simpleInstruction("OP_LESS_EQUAL", offset);
+		case OpCode::SET_LOCAL_POP:
+			return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+		case OpCode::ADD_LOCAL_LOCAL:
+			return twoByteInstruction("OP_ADD_LOCAL_LOCAL", chunk, offset);
+		case OpCode::MULTIPLY_LOCAL_LOCAL:
+			return twoByteInstruction("OP_MULTIPLY_LOCAL_LOCAL", chunk, offset);
+		case OpCode::INC_LOCAL_CONST:
+			return localConstantInstruction("OP_INC_LOCAL_CONST", chunk, offset);
+		case OpCode::LESS_JUMP_IF_FALSE:
+			return jumpInstruction("OP_LESS_JUMP_IF_FALSE", 1, chunk, offset);
+		case OpCode::GREATER_JUMP_IF_FALSE:
+			return jumpInstruction("OP_GREATER_JUMP_IF_FALSE", 1, chunk, offset);
 		default:
 			std::cout << "Unknown opcode " << instruction << "\n";
 			return offset + 1;
 	}
 }
+
+void disassembleRegisters(const RegisterChunk &chunk, std::string name)
+{
+	std::cout << "== " << name << " (registers) ==" << "\n";
+
+	for (size_t pc = 0u; pc < chunk.code.size(); pc++)
+	{
+		disassembleRegisterInstruction(chunk, pc);
+	}
+	std::cout.flush();
+}
+
+static void registerOperand(const RegisterChunk &chunk, uint16_t operand)
+{
+	if (operand & RK_CONSTANT)
+		std::cout << " '" << chunk.constants[operand & ~RK_CONSTANT] << "'";
+	else
+		std::cout << " r" << operand;
+}
+
+void disassembleRegisterInstruction(const RegisterChunk &chunk, size_t pc)
+{
+	static const char* names[] = {
+#define OPCODE(name) "R_" #name,
+#include "register_op_codes.hpp"
+#undef OPCODE
+	};
+
+	auto &instruction = chunk.code[pc];
+	std::cout << std::setw(4) << std::setfill('0') << pc << " ";
+	std::cout << std::setw(4) << std::setfill('0') << chunk.sites[pc].offset << " ";
+	std::cout << std::setiosflags(std::ios::left) << std::setw(24) << std::setfill(' ') << names[instruction.op];
+	std::cout << std::resetiosflags(std::ios::left);
+	switch (instruction.op)
+	{
+		case RegisterOp::GET_GLOBAL:
+			std::cout << " r" << instruction.a << " g" << instruction.b;
+			break;
+		case RegisterOp::DEFINE_GLOBAL:
+		case RegisterOp::SET_GLOBAL:
+			std::cout << " g" << instruction.a;
+			registerOperand(chunk, instruction.b);
+			break;
+		case RegisterOp::PRINT:
+		case RegisterOp::RETURN:
+			registerOperand(chunk, instruction.a);
+			break;
+		case RegisterOp::JUMP:
+		case RegisterOp::JUMP_BACK:
+			std::cout << " -> " << instruction.a;
+			break;
+		case RegisterOp::JUMP_IF_FALSE:
+		case RegisterOp::JUMP_IF_TRUE:
+			registerOperand(chunk, instruction.b);
+			std::cout << " -> " << instruction.a;
+			break;
+		case RegisterOp::LESS_JUMP_IF_FALSE:
+		case RegisterOp::GREATER_JUMP_IF_FALSE:
+			registerOperand(chunk, instruction.b);
+			registerOperand(chunk, instruction.c);
+			std::cout << " -> " << instruction.a;
+			break;
+		case RegisterOp::CALL:
+			std::cout << " r" << instruction.a << " " << instruction.b;
+			break;
+		case RegisterOp::MOVE:
+		case RegisterOp::NOT:
+		case RegisterOp::NEGATE:
+			std::cout << " r" << instruction.a;
+			registerOperand(chunk, instruction.b);
+			break;
+		default:
+			std::cout << " r" << instruction.a;
+			registerOperand(chunk, instruction.b);
+			registerOperand(chunk, instruction.c);
+			break;
+	}
+	std::cout << "\n";
+}
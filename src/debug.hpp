@@ -8,8 +8,11 @@
 #include <string>
 
 #include "chunk.hpp"
+#include "registers.hpp"
 
 void disassembleChunk(const Chunk &chunk, std::string name);
 size_t disassembleInstruction(const Chunk &chunk, size_t offset);
+void disassembleRegisters(const RegisterChunk &chunk, std::string name);
+void disassembleRegisterInstruction(const RegisterChunk &chunk, size_t pc);
 
 #endif //CPPLOX_DEBUG_HPP
@@ -0,0 +1,77 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include <cstdlib>
+#include <iostream>
+
+#include "diagnostics.hpp"
+
+bool Diagnostics::enable(const std::string& list)
+{
+	size_t begin = 0;
+	while (begin <= list.size())
+	{
+		auto end = list.find(',', begin);
+		if (end == std::string::npos)
+			end = list.size();
+		auto sink = list.substr(begin, end - begin);
+		begin = end + 1;
+
+		if (sink == "log")
+			sinks |= LOG;
+		else if (sink == "host")
+			sinks |= HOST;
+		else if (sink == "ir")
+			sinks |= IR;
+		else if (sink == "opt-ir")
+			sinks |= OPT_IR;
+		else if (sink == "obj")
+			sinks |= OBJECT;
+		else if (sink == "timing")
+			sinks |= TIMING;
+		else if (sink == "perf")
+			sinks |= PERF;
+		else if (sink == "gdb")
+			sinks |= GDB;
+		else if (sink == "all")
+			sinks |= ALL;
+		else if (!sink.empty())
+			return false;
+	}
+	return true;
+}
+
+std::string Diagnostics::path(const std::string& name) const
+{
+	if (directory.empty() || directory == ".")
+		return name;
+	return directory + "/" + name;
+}
+
+Diagnostics Diagnostics::fromEnvironment()
+{
+	Diagnostics diagnostics;
+	if (auto list = std::getenv("LOX_JIT_DUMP"))
+	{
+		if (!diagnostics.enable(list))
+			std::cerr << "Ignoring unknown sinks in LOX_JIT_DUMP=" << list << std::endl;
+	}
+	if (auto directory = std::getenv("LOX_JIT_DUMP_DIR"))
+		diagnostics.directory = directory;
+	return diagnostics;
+}
+
+bool parseDiagnosticsFlag(const std::string& flag, Diagnostics* diagnostics)
+{
+	static const std::string dump_flag = "--jit-dump=";
+	static const std::string dir_flag = "--jit-dump-dir=";
+	if (flag.compare(0, dump_flag.size(), dump_flag) == 0)
+		return diagnostics->enable(flag.substr(dump_flag.size()));
+	if (flag.compare(0, dir_flag.size(), dir_flag) == 0)
+	{
+		diagnostics->directory = flag.substr(dir_flag.size());
+		return true;
+	}
+	return false;
+}
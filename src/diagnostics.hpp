@@ -0,0 +1,73 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#ifndef CPPLOX_DIAGNOSTICS_HPP
+#define CPPLOX_DIAGNOSTICS_HPP
+
+#include <cstdint>
+#include <string>
+
+// What the JIT reports about its work. Every sink is off unless asked for
+// with --jit-dump=<list> or the LOX_JIT_DUMP environment variable, a comma
+// separated list of
+//
+//   log      the functions compiled, cached and released
+//   host     the host CPU, its features and the target machine of the JIT
+//   ir       the IR of every module before optimization (<name>.pre-opt.ll)
+//   opt-ir   the IR of every module after optimization (<name>.post-opt.ll)
+//   obj      the text section of every object generated (<name>.bin)
+//   timing   the time spent optimizing and generating code
+//   perf     the code loaded, for perf (a jitdump file, see perf-inject --jit)
+//   gdb      the code loaded, through GDB's JIT interface
+//   all      all of the above
+//
+// perf and gdb also add the source line of every bytecode instruction to the
+// code generated. Files are written to --jit-dump-dir=<dir> or
+// LOX_JIT_DUMP_DIR, the working directory by default; perf picks the place of
+// its jitdump itself. A disabled sink costs a test of sinks.
+struct Diagnostics
+{
+	enum Sink : uint32_t
+	{
+		LOG = 1u << 0u,
+		HOST = 1u << 1u,
+		IR = 1u << 2u,
+		OPT_IR = 1u << 3u,
+		OBJECT = 1u << 4u,
+		TIMING = 1u << 5u,
+		PERF = 1u << 6u,
+		GDB = 1u << 7u,
+		ALL = LOG | HOST | IR | OPT_IR | OBJECT | TIMING | PERF | GDB,
+	};
+
+	uint32_t sinks = 0;
+	std::string directory = ".";
+
+	bool enabled(uint32_t sink) const
+	{
+		return (sinks & sink) != 0;
+	}
+
+	// Whether generated code carries line info, for the profilers and
+	// debuggers JITed code is registered with.
+	bool lineInfo() const
+	{
+		return enabled(PERF | GDB);
+	}
+
+	// Enables the sinks named in list. Returns false if one is unknown.
+	bool enable(const std::string& list);
+
+	// Path of the dump file called name.
+	std::string path(const std::string& name) const;
+
+	// The sinks LOX_JIT_DUMP and LOX_JIT_DUMP_DIR select.
+	static Diagnostics fromEnvironment();
+};
+
+// Parses a command line flag (--jit-dump=<list> or --jit-dump-dir=<dir>) into
+// diagnostics. Returns false for any other flag or an unknown sink.
+bool parseDiagnosticsFlag(const std::string& flag, Diagnostics* diagnostics);
+
+#endif //CPPLOX_DIAGNOSTICS_HPP
@@ -219,6 +219,14 @@ public:
 		throw std::out_of_range("Key not found");
 	}
 
+	ForwardIterator<value_type> find(const Key &key)
+	{
+		auto &t_entry = findValue(key);
+		if (t_entry.status != Entry::Status::FULL)
+			return end();
+		return ForwardIterator<value_type>(&t_entry, m_entries.get() + m_capacity);
+	}
+
 	Value& operator[]( const Key& key )
 	{
 		return insert(std::make_pair(key, Value())).first->second;
@@ -238,10 +246,9 @@ public:
 		auto &t_entry = findValue(value.first);
 		if (t_entry.status != Entry::Status::FULL)
 		{
-			t_entry.status = Entry::Status::FULL;
+			occupy(t_entry);
 			t_entry.value.first = value.first;
 			t_entry.value.second = value.second;
-			m_count++;
 			return std::make_pair(ForwardIterator<value_type>(&t_entry, m_entries.get() + m_capacity), true);
 		}
 		return std::make_pair(ForwardIterator<value_type>(&t_entry, m_entries.get() + m_capacity), false);
@@ -256,10 +263,9 @@ public:
 		auto &t_entry = findValue(value.first);
 		if (t_entry.status != Entry::Status::FULL)
 		{
-			t_entry.status = Entry::Status::FULL;
+			occupy(t_entry);
 			t_entry.value.first = std::move(value.first);
 			t_entry.value.second = std::move(value.second);
-			m_count++;
 			return std::make_pair(ForwardIterator<value_type>(&t_entry, m_entries.get() + m_capacity), true);
 		}
 		return std::make_pair(ForwardIterator<value_type>(&t_entry, m_entries.get() + m_capacity), false);
@@ -268,7 +274,7 @@ public:
 	size_type erase(const Key &key)
 	{
 		auto &t_entry = findValue(key);
-		if (t_entry.status == Entry::Status::EMPTY)
+		if (t_entry.status != Entry::Status::FULL)
 			return 0;
 
 		t_entry.status = Entry::Status::DEATH;
@@ -283,6 +289,16 @@ public:
 	}
 
 private:
+	// m_count counts tombstones too, a tombstone taken again is not new.
+	void occupy(Entry &entry)
+	{
+		if (entry.status == Entry::Status::DEATH)
+			m_tombstones--;
+		else
+			m_count++;
+		entry.status = Entry::Status::FULL;
+	}
+
 	Entry& findValue(const Key &key) const
 	{
 		auto index = m_hash(key) & (m_capacity - 1); // Modulo
@@ -313,7 +329,9 @@ private:
 	void increaseCapacity()
 	{
 		auto o_capacity = m_capacity;
-		m_capacity *= 2;
+		// Mostly tombstones (strings the collector dropped), rehashing is enough.
+		if (size() >= m_capacity * m_maxLoad / 2)
+			m_capacity *= 2;
 		auto old_entries = m_entries.release();
 		m_entries.reset(new Entry[m_capacity]);
 		m_count = 0;
@@ -2,14 +2,20 @@
 // Created by juanb on 12/07/2019.
 //
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <vector>
 #include <iomanip>
 
+#include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/SHA1.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 
@@ -43,118 +49,554 @@ extern "C" void dump_memory(uint8_t* memory) {
 	std::cout << "\n";
 }
 
-extern "C" __declspec(dllexport) void callError(VM* vm, uint32_t pc)
-{
-	using namespace std::string_literals;
-	vm->runtimeError(pc, "Object is not callable."s);
-}
-
-extern "C" __declspec(dllexport) void numberError(VM* vm, uint32_t pc)
-{
-	using namespace std::string_literals;
-	vm->runtimeError(pc, "Operands must be numbers."s);
-}
-
-extern "C" __declspec(dllexport) void variableError(VM *vm, uint32_t pos, uint32_t pc)
+std::vector<uint32_t> jumpBlocks(Chunk* chunk)
 {
-	using namespace std::string_literals;
-	vm->runtimeError(pc, "Undefined variable "s, vm->m_globalNames[pos], "."s);
-}
+	auto size = chunk->size();
+	std::vector<uint32_t> labels;
 
-extern "C" __declspec(dllexport) void arityError(VM *vm, uint32_t arity, uint32_t arg_count, uint32_t pc)
-{
-	using namespace std::string_literals;
-	vm->runtimeError(pc, "Expected "s, std::to_string(arity), " arguments but got "s, std::to_string(arg_count), "."s);
+	for (auto offset = 0u; offset < size; offset += instructionSize(chunk->get(offset)))
+	{
+		labels.push_back(offset);
+	}
+	return labels;
 }
 
-extern "C" __declspec(dllexport) bool equal(Value *a, Value *b)
+// The function the CALL at offset always invokes, or nullptr. The callee has
+// to be pushed by a GET_GLOBAL that no jump skips, and the global has to be
+// stored exactly once in the program (a function declaration) and hold a
+// function of the right arity already. The generated code still compares
+// the callee with it, the REPL can redefine globals later.
+ObjFunction* directCallee(VM* vm, Chunk* chunk, const std::vector<int32_t>& depths, uint32_t offset)
 {
-	return *a == *b;
-}
+	auto arg_count = chunk->get(offset + 1u);
+	auto base = depths[offset] - arg_count - 1;
 
-extern "C" __declspec(dllexport) int concatenate(VM *vm, Value *out, Value *a, Value *b, uint32_t pc)
-{
-	if (a->isObjString() && b->isObjString())
-	{
-		*out = Value::Object(Memory::createString(vm, a->asObjString()->value + b->asObjString()->value));
-	}
-	else if(a->isNumber() && b->isObjString())
-	{
-		auto b_str = b->asObjString()->value;
-		auto a_num = a->asNumber();
-		char buff[1024];
-		std::sprintf(buff, "%g", a_num);
-		*out = Value::Object(Memory::createString(vm, std::string(buff) + b_str));
-	}
-	else if(a->isObjString() && b->isNumber())
+	// The last instruction before the call that starts at the callee depth
+	// is the one that pushed it.
+	auto push = offset;
+	for (auto o = 0u; o < offset; o += instructionSize(chunk->get(o)))
 	{
-		auto b_num = b->asNumber();
-		auto a_str = a->asObjString()->value;
-		char buff[1024];
-		std::sprintf(buff, "%g", b_num);
-		*out = Value::Object(Memory::createString(vm, a_str + std::string(buff)));
+		if (depths[o] == base)
+			push = o;
 	}
-	else
+	if (push == offset)
+		return nullptr;
+
+	auto instruction = chunk->get(push);
+	if (instruction != OpCode::GET_GLOBAL && instruction != OpCode::GET_GLOBAL_LONG)
+		return nullptr;
+	uint32_t index_ = chunk->get(push + 1u);
+	if (instruction == OpCode::GET_GLOBAL_LONG)
+		index_ |= static_cast<uint32_t>(chunk->get(push + 2u) << 8u) |
+				  static_cast<uint32_t>(chunk->get(push + 3u) << 16u);
+
+	// No path may enter the arguments without going through the push.
+	for (auto o = 0u; o < chunk->size(); o += instructionSize(chunk->get(o)))
 	{
-		vm->runtimeError(pc, "Operands must be numbers or strings.");
-		return (int)InterpretResult::RUNTIME_ERROR;
+		auto op = chunk->get(o);
+		if (op != OpCode::JUMP && op != OpCode::JUMP_IF_FALSE && op != OpCode::JUMP_IF_TRUE && op != OpCode::JUMP_BACK &&
+			op != OpCode::LESS_JUMP_IF_FALSE && op != OpCode::GREATER_JUMP_IF_FALSE)
+			continue;
+		uint16_t jump = chunk->get(o + 1u) | static_cast<uint16_t>(chunk->get(o + 2u) << 8u);
+		auto target = op == OpCode::JUMP_BACK ? o + 3 - jump : o + 3 + jump;
+		auto inside = o > push && o < offset;
+		if (!inside && target > push && target <= offset)
+			return nullptr;
 	}
-	return (int)InterpretResult::OK;
+
+	if (vm->globalStores()[index_] != 1)
+		return nullptr;
+	auto &global = vm->globalValues()[index_];
+	if (!global.isObjFunction() || global.asObjFunction()->arity != arg_count)
+		return nullptr;
+	return global.asObjFunction();
 }
 
-extern "C" __declspec(dllexport) void print(Value* val)
+#ifdef TYPE_SPECULATION
+// What the code generator knows about a stack slot before an instruction.
+enum class SlotType : uint8_t
 {
-	std::cout << *val << std::endl;
-}
+	ANY,
+	NUMBER,
+	OTHER // known not to be a number (string constants, booleans, nil)
+};
 
-extern "C" __declspec(dllexport) void callNative(NativeFn fun, uint32_t argCount, Value *args, Value *out)
+using SlotTypes = std::vector<SlotType>;
+
+// Whether the arithmetic instruction at offset is compiled for numbers only.
+// state holds the slot types before it (empty if unknown).
+bool isSpeculated(ObjFunction* function, uint32_t offset, const SlotTypes& state)
 {
-	*out = fun(argCount, args);
+	auto chunk = &function->chunk;
+	// The slots holding the operands, counted from the top of the stack
+	// unless they are locals.
+	size_t top = state.size();
+	size_t operands[2] = {top - 1, top - 2};
+	size_t count = 2;
+	switch (chunk->get(offset))
+	{
+		case OpCode::NEGATE:
+			count = 1;
+			break;
+		case OpCode::GREATER:
+		case OpCode::LESS:
+		case OpCode::ADD:
+		case OpCode::SUBTRACT:
+		case OpCode::MULTIPLY:
+		case OpCode::DIVIDE:
+		case OpCode::MODULO:
+		case OpCode::GREATER_EQUAL:
+		case OpCode::LESS_EQUAL:
+		case OpCode::LESS_JUMP_IF_FALSE:
+		case OpCode::GREATER_JUMP_IF_FALSE:
+			break;
+		case OpCode::ADD_LOCAL_LOCAL:
+		case OpCode::MULTIPLY_LOCAL_LOCAL:
+			operands[0] = chunk->get(offset + 1u);
+			operands[1] = chunk->get(offset + 2u);
+			break;
+		case OpCode::INC_LOCAL_CONST:
+			// The constant is a number.
+			operands[0] = chunk->get(offset + 1u);
+			count = 1;
+			break;
+		default:
+			return false;
+	}
+	if (function->isGeneric(offset))
+		return false;
+	for (auto i = 0u; i < count; ++i)
+	{
+		if (operands[i] < top && state[operands[i]] == SlotType::OTHER)
+			return false;
+	}
+	return true;
 }
 
-std::vector<uint32_t> jumpBlocks(Chunk* chunk)
+// Forward type inference over the slots, starting at entry with entryTypes.
+// A slot is NUMBER when every path stores a number constant or the result of
+// arithmetic in it, so its guards can be dropped and the value stays a double
+// across loop iterations. Offsets not reachable from entry are left empty.
+std::vector<SlotTypes> slotTypes(ObjFunction* function, const std::vector<int32_t>& depths, uint32_t entry, const SlotTypes& entryTypes)
 {
+	auto chunk = &function->chunk;
 	auto size = chunk->size();
-	std::vector<uint32_t> labels;
+	std::vector<SlotTypes> types(size);
+	std::vector<uint32_t> worklist;
 
-	for (auto offset = 0u; offset < size;)
+	auto reach = [&](uint32_t target, const SlotTypes& in) {
+		auto &current = types[target];
+		if (current.empty())
+		{
+			current = in;
+			worklist.push_back(target);
+			return;
+		}
+		auto changed = false;
+		for (size_t i = 0; i < current.size(); ++i)
+		{
+			if (current[i] != in[i] && current[i] != SlotType::ANY)
+			{
+				current[i] = SlotType::ANY;
+				changed = true;
+			}
+		}
+		if (changed)
+			worklist.push_back(target);
+	};
+
+	reach(entry, entryTypes);
+	while (!worklist.empty())
 	{
-		labels.push_back(offset);
+		auto offset = worklist.back();
+		worklist.pop_back();
+
+		auto state = types[offset];
 		auto instruction = chunk->get(offset);
+		auto next = offset + instructionSize(instruction);
+		uint16_t jump = 0;
+		if (instructionSize(instruction) == 3)
+			jump = chunk->get(offset + 1u) | static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
+
 		switch (instruction)
 		{
 			case OpCode::CONSTANT:
+			case OpCode::CONSTANT_LONG:
+			{
+				uint32_t index_ = chunk->get(offset + 1u);
+				if (instruction == OpCode::CONSTANT_LONG)
+					index_ |= static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
+							  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
+				state.push_back(chunk->constants()[index_].isNumber() ? SlotType::NUMBER : SlotType::OTHER);
+				break;
+			}
+			case OpCode::DUP:
+				state.push_back(state.back());
+				break;
 			case OpCode::GET_LOCAL:
+				state.push_back(state[chunk->get(offset + 1u)]);
+				break;
+			case OpCode::GET_LOCAL_SHORT:
+				state.push_back(state[chunk->get(offset + 1u) | static_cast<uint16_t>(chunk->get(offset + 2u) << 8u)]);
+				break;
 			case OpCode::SET_LOCAL:
+				state[chunk->get(offset + 1u)] = state.back();
+				break;
+			case OpCode::SET_LOCAL_SHORT:
+				state[chunk->get(offset + 1u) | static_cast<uint16_t>(chunk->get(offset + 2u) << 8u)] = state.back();
+				break;
+			case OpCode::SET_LOCAL_POP:
+				state[chunk->get(offset + 1u)] = state.back();
+				state.pop_back();
+				break;
+			case OpCode::ADD_LOCAL_LOCAL:
+				state.push_back(isSpeculated(function, offset, state) ? SlotType::NUMBER : SlotType::ANY);
+				break;
+			case OpCode::MULTIPLY_LOCAL_LOCAL:
+				state.push_back(SlotType::NUMBER);
+				break;
+			case OpCode::INC_LOCAL_CONST:
+				state[chunk->get(offset + 1u)] = isSpeculated(function, offset, state) ? SlotType::NUMBER : SlotType::ANY;
+				break;
+			case OpCode::NIL:
+			case OpCode::TRUE:
+			case OpCode::FALSE:
+				state.push_back(SlotType::OTHER);
+				break;
 			case OpCode::GET_GLOBAL:
+			case OpCode::GET_GLOBAL_LONG:
+				state.push_back(SlotType::ANY);
+				break;
+			case OpCode::POP:
 			case OpCode::DEFINE_GLOBAL:
-			case OpCode::SET_GLOBAL:
+			case OpCode::DEFINE_GLOBAL_LONG:
+			case OpCode::PRINT:
+				state.pop_back();
+				break;
+			case OpCode::EQUAL:
+			case OpCode::GREATER:
+			case OpCode::LESS:
+			case OpCode::NOT_EQUAL:
+			case OpCode::GREATER_EQUAL:
+			case OpCode::LESS_EQUAL:
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+				state.pop_back();
+				state.back() = SlotType::OTHER;
+				break;
+			case OpCode::ADD:
+			{
+				auto speculated = isSpeculated(function, offset, state);
+				state.pop_back();
+				state.back() = speculated ? SlotType::NUMBER : SlotType::ANY;
+				break;
+			}
+			case OpCode::SUBTRACT:
+			case OpCode::MULTIPLY:
+			case OpCode::DIVIDE:
+			case OpCode::MODULO:
+				// Anything else is a runtime error.
+				state.pop_back();
+				state.back() = SlotType::NUMBER;
+				break;
+			case OpCode::NEGATE:
+				state.back() = SlotType::NUMBER;
+				break;
+			case OpCode::NOT:
+				state.back() = SlotType::OTHER;
+				break;
 			case OpCode::CALL:
-				offset += 2;
+				state.resize(state.size() - chunk->get(offset + 1u));
+				state.back() = SlotType::ANY;
 				break;
-			case OpCode::GET_LOCAL_SHORT:
-			case OpCode::SET_LOCAL_SHORT:
+			default:
+				break;
+		}
+
+		switch (instruction)
+		{
 			case OpCode::JUMP:
+				reach(next + jump, state);
+				break;
 			case OpCode::JUMP_IF_FALSE:
 			case OpCode::JUMP_IF_TRUE:
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+				reach(next, state);
+				reach(next + jump, state);
+				break;
 			case OpCode::JUMP_BACK:
-				offset += 3;
+				reach(next - jump, state);
 				break;
-			case OpCode::CONSTANT_LONG:
-			case OpCode::GET_GLOBAL_LONG:
-			case OpCode::DEFINE_GLOBAL_LONG:
-			case OpCode::SET_GLOBAL_LONG:
-				offset += 4;
+			case OpCode::RETURN:
 				break;
 			default:
-				offset += 1;
+				reach(next, state);
 				break;
 		}
 	}
-	return labels;
+	return types;
+}
+
+// The entry types seeded by the values the activation holds while it is
+// being compiled (if any), a guard on the entry edge checks them later.
+SlotTypes entryTypes(ObjFunction* function, int32_t depth, uint32_t entry, const Value* entry_slots)
+{
+	SlotTypes types(depth, SlotType::ANY);
+	if (entry_slots != nullptr && !function->isGeneric(entry))
+	{
+		for (int32_t i = 0; i < depth; ++i)
+		{
+			if (entry_slots[i].isNumber())
+				types[i] = SlotType::NUMBER;
+		}
+	}
+	return types;
+}
+#endif
+
+std::string referenceSymbol(size_t index)
+{
+	return "lox.ref." + std::to_string(index);
+}
+
+// The references are the function itself (deoptimization hands it back to
+// the interpreter), its object constants and its direct callees, each object
+// once. The key hashes everything generade_code reads besides the addresses:
+// the build configuration, the bytecode, the constants, which references are
+// the same object and the speculation state.
+CodeReferences codeReferences(VM* vm, ObjFunction* function, uint32_t entry, const Value* entry_slots)
+{
+	CodeReferences refs;
+	Chunk* chunk = &function->chunk;
+	llvm::SHA1 hash;
+
+	auto add_bytes = [&](const void* data, size_t size) {
+		hash.update(llvm::ArrayRef<uint8_t>(static_cast<const uint8_t*>(data), size));
+	};
+	auto add_string = [&](const std::string& value) {
+		uint64_t size = value.size();
+		add_bytes(&size, sizeof(size));
+		add_bytes(value.data(), value.size());
+	};
+	// A reference is hashed as the index of the first one to the same object:
+	// the code may fold comparisons between them.
+	auto add_reference = [&](sObj* object) {
+		int64_t index = -1;
+		if (object != nullptr)
+		{
+			auto found = std::find(refs.objects.begin(), refs.objects.end(), object);
+			index = found - refs.objects.begin();
+			if (found == refs.objects.end())
+				refs.objects.push_back(object);
+		}
+		add_bytes(&index, sizeof(index));
+	};
+
+	// The version changes whenever the code calls into the runtime differently.
+	std::string config = "cpplox-jit 2";
+#ifdef NAN_BOXING
+	config += " nan-boxing";
+#endif
+#ifdef TIERED_EXECUTION
+	config += " tiered";
+#endif
+#ifdef TYPE_SPECULATION
+	config += " speculation";
+#endif
+	// So is the optimization pipeline the object code went through.
+	auto &optimization = vm->optimization();
+	config += " O" + std::to_string(optimization.level) + "." + std::to_string(optimization.size) + " " + optimization.pipeline;
+	// And the line info, which names the source file.
+	if (vm->diagnostics().lineInfo())
+		config += " lines " + vm->sourceName();
+	add_string(config);
+	add_string(function->name != nullptr ? function->name->value : std::string());
+	add_bytes(&function->arity, sizeof(function->arity));
+	add_bytes(&entry, sizeof(entry));
+	add_bytes(chunk->code(), chunk->size());
+
+	add_reference(function);
+	for (size_t i = 0; i < chunk->constantsSize(); ++i)
+	{
+		auto &constant = chunk->constants()[i];
+		if (constant.isNumber())
+		{
+			auto number = constant.asNumber();
+			add_bytes(&number, sizeof(number));
+			add_reference(nullptr);
+			continue;
+		}
+		auto object = constant.asObj();
+		add_bytes(&object->type, sizeof(object->type));
+		if (constant.isObjFunction())
+		{
+			auto callee = constant.asObjFunction();
+			add_string(callee->name != nullptr ? callee->name->value : std::string());
+			add_bytes(&callee->arity, sizeof(callee->arity));
+		}
+		else if (constant.isObjString())
+		{
+			add_string(constant.asObjString()->value);
+		}
+		add_reference(object);
+	}
+
+	auto depths = stackDepths(chunk, static_cast<int32_t>(function->arity) + 1);
+	for (auto offset = 0u; offset < chunk->size(); offset += instructionSize(chunk->get(offset)))
+	{
+		if (chunk->get(offset) == OpCode::CALL && depths[offset] >= 0)
+			add_reference(directCallee(vm, chunk, depths, offset));
+#ifdef TYPE_SPECULATION
+		uint8_t generic = function->isGeneric(offset);
+		add_bytes(&generic, sizeof(generic));
+#endif
+	}
+#ifdef TYPE_SPECULATION
+	if (depths[entry] >= 0)
+	{
+		auto entry_types = entryTypes(function, depths[entry], entry, entry_slots);
+		add_bytes(entry_types.data(), entry_types.size());
+	}
+#endif
+
+	refs.key = llvm::toHex(hash.final());
+	return refs;
+}
+
+llvm::Type* create_value_type(llvm::LLVMContext& context)
+{
+#ifdef NAN_BOXING
+	return llvm::Type::getInt64Ty(context);
+#else
+	return llvm::StructType::create(context, {llvm::Type::getInt8Ty(context), llvm::Type::getDoubleTy(context)}, "Value");
+#endif
+}
+
+// Helpers that read and write the fields of a Value through a Value*. Every
+// opcode goes through them so that the IR follows the layout picked in
+// common.hpp.
+
+static llvm::Value* emit_is_type(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr, ValueType type)
+{
+#ifdef NAN_BOXING
+	llvm::Value* bits = builder.CreateLoad(addr, "bits");
+	switch (type)
+	{
+		case ValueType::NUMBER:
+			return builder.CreateICmpNE(builder.CreateAnd(bits, NanBox::QNAN), builder.getInt64(NanBox::QNAN), "is_number");
+		case ValueType::OBJ:
+			return builder.CreateICmpEQ(builder.CreateAnd(bits, NanBox::OBJ_MASK), builder.getInt64(NanBox::OBJ_MASK), "is_obj");
+		case ValueType::BOOL:
+			return builder.CreateICmpEQ(builder.CreateOr(bits, 1u), builder.getInt64(NanBox::TRUE_VAL), "is_bool");
+		case ValueType::NIL:
+			return builder.CreateICmpEQ(bits, builder.getInt64(NanBox::NIL_VAL), "is_nil");
+		case ValueType::UNDEFINED:
+			return builder.CreateICmpEQ(bits, builder.getInt64(NanBox::UNDEFINED_VAL), "is_undefined");
+	}
+	return builder.getFalse();
+#else
+	llvm::Value* type_ptr = builder.CreateStructGEP(value_type, addr, 0, "type_ptr");
+	llvm::Value* val_type = builder.CreateLoad(type_ptr, false, "val_type");
+	return builder.CreateICmpEQ(val_type, builder.getInt8(static_cast<uint8_t>(type)), "is_type");
+#endif
+}
+
+static llvm::Value* emit_load_number(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr)
+{
+#ifdef NAN_BOXING
+	llvm::Value* bits = builder.CreateLoad(addr, "bits");
+	return builder.CreateBitCast(bits, builder.getDoubleTy(), "number");
+#else
+	llvm::Value* number_ptr = builder.CreateStructGEP(value_type, addr, 1, "number_ptr");
+	return builder.CreateLoad(number_ptr, "number");
+#endif
+}
+
+static void emit_store_number(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr, llvm::Value* number)
+{
+#ifdef NAN_BOXING
+	builder.CreateStore(builder.CreateBitCast(number, builder.getInt64Ty()), addr);
+#else
+	builder.CreateStore(builder.getInt8(static_cast<uint8_t>(ValueType::NUMBER)), builder.CreateStructGEP(value_type, addr, 0, "type_ptr"));
+	builder.CreateStore(number, builder.CreateStructGEP(value_type, addr, 1, "number_ptr"));
+#endif
+}
+
+static void emit_store_bool(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr, llvm::Value* boolean)
+{
+#ifdef NAN_BOXING
+	builder.CreateStore(builder.CreateSelect(boolean, builder.getInt64(NanBox::TRUE_VAL), builder.getInt64(NanBox::FALSE_VAL)), addr);
+#else
+	builder.CreateStore(builder.getInt8(static_cast<uint8_t>(ValueType::BOOL)), builder.CreateStructGEP(value_type, addr, 0, "type_ptr"));
+	llvm::Value* value_ptr = builder.CreateStructGEP(value_type, addr, 1, "value_ptr");
+	builder.CreateStore(boolean, builder.CreateBitCast(value_ptr, llvm::Type::getInt1PtrTy(builder.getContext()), "bool_ptr"));
+#endif
+}
+
+static llvm::Value* emit_load_bool(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr)
+{
+#ifdef NAN_BOXING
+	llvm::Value* bits = builder.CreateLoad(addr, "bits");
+	return builder.CreateICmpEQ(bits, builder.getInt64(NanBox::TRUE_VAL), "bool");
+#else
+	llvm::Value* value_ptr = builder.CreateStructGEP(value_type, addr, 1, "value_ptr");
+	llvm::Value* bool_ptr = builder.CreateBitCast(value_ptr, llvm::Type::getInt1PtrTy(builder.getContext()), "bool_ptr");
+	return builder.CreateLoad(bool_ptr, "bool");
+#endif
+}
+
+static llvm::Value* emit_load_obj(llvm::IRBuilder<>& builder, llvm::Type* value_type, llvm::Value* addr, llvm::PointerType* objPtr_type)
+{
+#ifdef NAN_BOXING
+	llvm::Value* bits = builder.CreateLoad(addr, "bits");
+	return builder.CreateIntToPtr(builder.CreateAnd(bits, ~NanBox::OBJ_MASK), objPtr_type, "obj");
+#else
+	llvm::Value* value_ptr = builder.CreateStructGEP(value_type, addr, 1, "value_ptr");
+	llvm::Value* obj_ptr = builder.CreateBitCast(value_ptr, llvm::PointerType::get(objPtr_type, 0), "obj_ptr");
+	return builder.CreateLoad(obj_ptr, "obj");
+#endif
+}
+
+// Builds the IR constant with the same bits as value. The address of an
+// object is not known when the code is built, object is its symbol.
+static llvm::Constant* value_constant(llvm::Type* value_type, const Value& value, llvm::Constant* object = nullptr)
+{
+	llvm::LLVMContext& context = value_type->getContext();
+#ifdef NAN_BOXING
+	if (value.isObj())
+		return llvm::ConstantExpr::getOr(llvm::ConstantExpr::getPtrToInt(object, value_type),
+			llvm::ConstantInt::get(value_type, NanBox::OBJ_MASK));
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(Value));
+	return llvm::ConstantInt::get(value_type, bits);
+#else
+	auto type = llvm::ConstantInt::get(llvm::Type::getInt8Ty(context), static_cast<uint8_t>(value.type()));
+	llvm::Constant* payload = nullptr;
+	switch (value.type())
+	{
+		case ValueType::NUMBER:
+			payload = llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), value.asNumber());
+			break;
+		case ValueType::BOOL:
+			payload = llvm::ConstantExpr::getBitCast(
+				llvm::ConstantInt::get(llvm::Type::getInt64Ty(context), value.asBool() ? 1u : 0u),
+				llvm::Type::getDoubleTy(context));
+			break;
+		case ValueType::OBJ:
+			payload = llvm::ConstantExpr::getBitCast(
+				llvm::ConstantExpr::getPtrToInt(object, llvm::Type::getInt64Ty(context)),
+				llvm::Type::getDoubleTy(context));
+			break;
+		default:
+			payload = llvm::ConstantFP::get(llvm::Type::getDoubleTy(context), 0.0);
+			break;
+	}
+	return llvm::ConstantStruct::get(llvm::cast<llvm::StructType>(value_type), {type, payload});
+#endif
 }
 
-llvm::Function* generate_equal(llvm::Module* module, llvm::StructType* value_type, llvm::PointerType* valutePtr_type)
+llvm::Function* generate_equal(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type)
 {
 	llvm::LLVMContext& context = module->getContext();
 
@@ -165,6 +607,8 @@ llvm::Function* generate_equal(llvm::Module* module, llvm::StructType* value_typ
 		llvm::FunctionType::get(bool_type, {valutePtr_type, valutePtr_type}, false);
 	llvm::Function* jit_func = llvm::Function::Create(
 		jit_func_type, llvm::Function::InternalLinkage, "_equal", module);
+	// The stack slots are passed by address, inlining keeps them promotable.
+	jit_func->addFnAttr(llvm::Attribute::AlwaysInline);
 
 	llvm::BasicBlock* entry_bb =
 		llvm::BasicBlock::Create(context, "entry", jit_func);
@@ -173,6 +617,25 @@ llvm::Function* generate_equal(llvm::Module* module, llvm::StructType* value_typ
 	llvm::Argument* a_ptr = jit_func->arg_begin();
 	llvm::Argument* b_ptr = jit_func->arg_begin() + 1;
 
+#ifdef NAN_BOXING
+	llvm::BasicBlock* numbers_bb = llvm::BasicBlock::Create(context, "numbers", jit_func);
+	llvm::BasicBlock* bits_bb = llvm::BasicBlock::Create(context, "bits", jit_func);
+
+	llvm::Value* a_is_number = emit_is_type(builder, value_type, a_ptr, ValueType::NUMBER);
+	llvm::Value* b_is_number = emit_is_type(builder, value_type, b_ptr, ValueType::NUMBER);
+	builder.CreateCondBr(builder.CreateAnd(a_is_number, b_is_number, "both_numbers"), numbers_bb, bits_bb);
+
+	// Numbers compare as doubles, everything else by identity of the bits.
+	builder.SetInsertPoint(numbers_bb);
+	llvm::Value* a_number = emit_load_number(builder, value_type, a_ptr);
+	llvm::Value* b_number = emit_load_number(builder, value_type, b_ptr);
+	builder.CreateRet(builder.CreateFCmpOEQ(a_number, b_number));
+
+	builder.SetInsertPoint(bits_bb);
+	llvm::Value* a_value = builder.CreateLoad(a_ptr, "a_value");
+	llvm::Value* b_value = builder.CreateLoad(b_ptr, "b_value");
+	builder.CreateRet(builder.CreateICmpEQ(a_value, b_value));
+#else
 	llvm::Value* a_type_ptr = builder.CreateStructGEP(value_type, a_ptr, 0, "type_ptr");
 	llvm::Value* a_type = builder.CreateLoad(a_type_ptr, false, "val_type");
 
@@ -196,54 +659,52 @@ llvm::Function* generate_equal(llvm::Module* module, llvm::StructType* value_typ
 	llvm::Value* b_value = builder.CreateLoad(b_int_ptr, "b_value");
 
 	builder.CreateRet(builder.CreateICmpEQ(a_value, b_value));
+#endif
 
 	return jit_func;
 }
 
-llvm::Function* generate_falsey(llvm::Module* module, llvm::StructType* value_type, llvm::PointerType* valutePtr_type)
+llvm::Function* generate_falsey(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type)
 {
 	llvm::LLVMContext& context = module->getContext();
 
 	llvm::Type* bool_type = llvm::Type::getInt1Ty(context);
-	llvm::PointerType* boolPtr_type = llvm::Type::getInt1PtrTy(context);
 
 	llvm::FunctionType* jit_func_type =
 		llvm::FunctionType::get(bool_type, {valutePtr_type}, false);
 	llvm::Function* jit_func = llvm::Function::Create(
 		jit_func_type, llvm::Function::InternalLinkage, "_is_falsey", module);
+	jit_func->addFnAttr(llvm::Attribute::AlwaysInline);
 
 	llvm::BasicBlock* entry_bb =
 		llvm::BasicBlock::Create(context, "entry", jit_func);
 	llvm::IRBuilder<> builder(entry_bb);
 
-	auto type_bool = builder.getInt8(static_cast<uint8_t>(ValueType::BOOL));
-	auto type_nil = builder.getInt8(static_cast<uint8_t>(ValueType::NIL));
-
 	llvm::Argument* val_ptr = jit_func->arg_begin();
 
-	llvm::Value* val_type_ptr = builder.CreateStructGEP(value_type, val_ptr, 0, "type_ptr");
-	llvm::Value* val_type = builder.CreateLoad(val_type_ptr, false, "val_type");
-
-
+#ifdef NAN_BOXING
+	// Only nil and false are falsey, and both are single bit patterns.
+	llvm::Value* bits = builder.CreateLoad(val_ptr, "bits");
+	llvm::Value* is_nil = builder.CreateICmpEQ(bits, builder.getInt64(NanBox::NIL_VAL), "is_nil");
+	llvm::Value* is_false = builder.CreateICmpEQ(bits, builder.getInt64(NanBox::FALSE_VAL), "is_false");
+	builder.CreateRet(builder.CreateOr(is_nil, is_false));
+#else
 	llvm::BasicBlock* true_bb = llvm::BasicBlock::Create(context, "true", jit_func);
 	llvm::BasicBlock* false_bb = llvm::BasicBlock::Create(context, "false", jit_func);
 	llvm::BasicBlock* not_nil_bb = llvm::BasicBlock::Create(context, "not_nil", jit_func);
 	llvm::BasicBlock* bool_bb = llvm::BasicBlock::Create(context, "bool", jit_func);
 
-	llvm::Value* is_nil = builder.CreateICmpEQ(val_type, type_nil, "is_nil");
+	llvm::Value* is_nil = emit_is_type(builder, value_type, val_ptr, ValueType::NIL);
 	builder.CreateCondBr(is_nil, true_bb, not_nil_bb);
 
 	builder.SetInsertPoint(not_nil_bb);
 
-	llvm::Value* is_bool = builder.CreateICmpEQ(val_type, type_bool, "is_bool");
+	llvm::Value* is_bool = emit_is_type(builder, value_type, val_ptr, ValueType::BOOL);
 	builder.CreateCondBr(is_bool, bool_bb, false_bb);
 
 	builder.SetInsertPoint(bool_bb);
 
-	llvm::Value* val_value_ptr = builder.CreateStructGEP(value_type, val_ptr, 1, "value_ptr");
-	llvm::Value* val_bool_ptr = builder.CreateBitCast(val_value_ptr, boolPtr_type, "bool_ptr");
-
-	llvm::Value* val_bool = builder.CreateLoad(val_bool_ptr, false, "val_value");
+	llvm::Value* val_bool = emit_load_bool(builder, value_type, val_ptr);
 
 	builder.CreateCondBr(val_bool, false_bb, true_bb);
 
@@ -254,36 +715,12 @@ llvm::Function* generate_falsey(llvm::Module* module, llvm::StructType* value_ty
 	// return false
 	builder.SetInsertPoint(false_bb);
 	builder.CreateRet(builder.getFalse());
+#endif
 
 	return jit_func;
 }
 
-void gen_if_else_jmp(llvm::Value* cmp, llvm::AllocaInst* pc, int then_off, int else_off, llvm::IRBuilder<>& builder, 
-	llvm::LLVMContext& context, llvm::Function* jit_func, llvm::BasicBlock* rtn)
-{
-	llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then_jmp", jit_func);
-	llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else_jmp", jit_func);
-	llvm::BasicBlock* end_bb = llvm::BasicBlock::Create(context, "end_jmp", jit_func);
-
-	builder.CreateCondBr(cmp, then_bb, else_bb);
-
-	builder.SetInsertPoint(then_bb);
-	llvm::Value* pc_ = builder.CreateLoad(pc, "pc_jmp");
-	llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(then_off), "inc_pc_jmp");
-	builder.CreateStore(inc_pc, pc);
-	builder.CreateBr(end_bb);
-	
-	builder.SetInsertPoint(else_bb);
-	pc_ = builder.CreateLoad(pc, "pc_jmp");
-	inc_pc = builder.CreateAdd(pc_, builder.getInt32(else_off), "inc_pc_jmp");
-	builder.CreateStore(inc_pc, pc);
-	builder.CreateBr(end_bb);
-
-	builder.SetInsertPoint(end_bb);
-	builder.CreateBr(rtn);
-}
-
-llvm::Function* generate_main(llvm::Module* module, const std::string& name, llvm::StructType* value_type, llvm::PointerType* valutePtr_type)
+llvm::Function* generate_main(llvm::Module* module, const std::string& name, llvm::Type* value_type, llvm::PointerType* valutePtr_type)
 {
 	llvm::LLVMContext& context = module->getContext();
 
@@ -300,14 +737,13 @@ llvm::Function* generate_main(llvm::Module* module, const std::string& name, llv
 
 	llvm::Argument* vm_ = main_func->arg_begin();
 	llvm::Argument* globals = main_func->arg_begin() + 1;
-	//llvm::Argument* stack = main_func->arg_begin() + 2;
+	// The VM stack, with the script in its first slot. The collector scans it.
+	llvm::Argument* stack = main_func->arg_begin() + 2;
 
 	llvm::BasicBlock* entry_bb =
 		llvm::BasicBlock::Create(context, "main_entry", main_func);
 	llvm::IRBuilder<> builder(entry_bb);
 
-	llvm::AllocaInst* stack =
-		builder.CreateAlloca(value_type, builder.getInt32(12500), "stack");
 	llvm::AllocaInst* stack_top =
 		builder.CreateAlloca(int32_type, nullptr, "stack_top");
 	builder.CreateStore(builder.getInt32(1), stack_top);
@@ -320,28 +756,23 @@ llvm::Function* generate_main(llvm::Module* module, const std::string& name, llv
 	return main_func;
 }
 
-llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::string& name, llvm::GlobalValue::LinkageTypes linkage, llvm::StructType* value_type, llvm::PointerType* valutePtr_type)
+llvm::Function* generade_code(llvm::Module* module, VM* vm, ObjFunction* function, const CodeReferences& refs, const std::string& name, llvm::GlobalValue::LinkageTypes linkage, llvm::Type* value_type, llvm::PointerType* valutePtr_type, uint32_t entry, const Value* entry_slots)
 {
 	llvm::LLVMContext& context = module->getContext();
+	Chunk* chunk = &function->chunk;
 
 	// Add a declaration for external functions used in the JITed code. We use
 	llvm::Type* uint64_type = llvm::Type::getInt64Ty(context);
 	llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
-	llvm::Type* void_type = llvm::Type::getVoidTy(context);
 	llvm::Type* uint8_type = llvm::Type::getInt8Ty(context);
-	llvm::Type* double_type = llvm::Type::getDoubleTy(context);
-	llvm::Type* bool_type = llvm::Type::getInt1Ty(context);
 	llvm::ArrayType* chunk_type = llvm::ArrayType::get(uint8_type, sizeof(Chunk));
 
 	llvm::PointerType* voidPtr_type = llvm::Type::getInt8PtrTy(context);
-	llvm::PointerType* in64Ptr_type = llvm::Type::getInt64PtrTy(context);
 	llvm::PointerType* in32Ptr_type = llvm::Type::getInt32PtrTy(context);
 	llvm::Type* uint8Ptr_type = llvm::Type::getInt8PtrTy(context);
-	llvm::PointerType* boolPtr_type = llvm::Type::getInt1PtrTy(context);
 
 	llvm::StructType* obj_type = llvm::StructType::create(context, {uint8Ptr_type, uint64_type, uint8_type}, "Obj");
 	llvm::PointerType* objPtr_type = llvm::PointerType::get(obj_type, 0);
-	llvm::PointerType* objPtrPtr_type = llvm::PointerType::get(objPtr_type, 0);
 
 	llvm::StructType* objFunction_type = llvm::StructType::create(context,{uint8Ptr_type, uint64_type, uint8_type, int32_type, uint8Ptr_type, uint8Ptr_type, chunk_type}, "objFunction");
 	llvm::PointerType* objFunctionPtr_type = llvm::PointerType::get(objFunction_type, 0);
@@ -354,8 +785,11 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 	llvm::Function* variableError_func = module->getFunction("variableError");
 	llvm::Function* arityError_func = module->getFunction("arityError");
 	llvm::Function* concatenate_func = module->getFunction("concatenate");
+	llvm::Function* safepoint_func = module->getFunction("safepoint");
+	llvm::Function* safepointFlag_func = module->getFunction("safepointFlag");
 	llvm::Function* print_func = module->getFunction("print");
 	llvm::Function* callNative_func = module->getFunction("callNative");
+	llvm::Function* callInterpreted_func = module->getFunction("callInterpreted");
 
 	llvm::Function* is_falsey = module->getFunction("_is_falsey");
 
@@ -371,7 +805,7 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 
 	llvm::Argument* vm_ = jit_func->arg_begin();
 	llvm::Argument* globals = jit_func->arg_begin() + 1;
-	llvm::Argument* stack_ = jit_func->arg_begin() + 2;
+	llvm::Argument* stack = jit_func->arg_begin() + 2;
 	llvm::Argument* stack_top = jit_func->arg_begin() + 3;
 
 	llvm::BasicBlock* entry_bb =
@@ -380,61 +814,212 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 		llvm::BasicBlock::Create(context, "return", jit_func);
 	llvm::IRBuilder<> builder(entry_bb);
 
-	auto const_0 = builder.getInt32(0);
-	auto const_1 = builder.getInt32(1);
-	auto const_2 = builder.getInt32(2);
+	// Line info for profilers and debuggers: the code of every instruction is
+	// attributed to its source line.
+	std::unique_ptr<llvm::DIBuilder> di_builder;
+	llvm::DISubprogram* subprogram = nullptr;
+	if (vm->diagnostics().lineInfo())
+	{
+		if (!module->getModuleFlag("Debug Info Version"))
+			module->addModuleFlag(llvm::Module::Warning, "Debug Info Version", llvm::DEBUG_METADATA_VERSION);
+		di_builder = std::make_unique<llvm::DIBuilder>(*module);
+		auto file = di_builder->createFile(vm->sourceName(), ".");
+		di_builder->createCompileUnit(llvm::dwarf::DW_LANG_C, file, "cpplox", true, "", 0);
+		auto line = chunk->size() > 0 ? chunk->getLine(entry) : 0;
+		auto type = di_builder->createSubroutineType(di_builder->getOrCreateTypeArray({}));
+		subprogram = di_builder->createFunction(file, name, name, file, line, type, line,
+			llvm::DINode::FlagZero, llvm::DISubprogram::SPFlagDefinition | llvm::DISubprogram::SPFlagOptimized);
+		jit_func->setSubprogram(subprogram);
+		builder.SetCurrentDebugLocation(llvm::DILocation::get(context, line, 0, subprogram));
+	}
 
-	auto type_number = builder.getInt8(static_cast<uint8_t>(ValueType::NUMBER));
-	auto type_bool = builder.getInt8(static_cast<uint8_t>(ValueType::BOOL));
-	auto type_obj = builder.getInt8(static_cast<uint8_t>(ValueType::OBJ));
-	auto type_nil = builder.getInt8(static_cast<uint8_t>(ValueType::NIL));
-	auto type_undefined = builder.getInt8(static_cast<uint8_t>(ValueType::UNDEFINED));
+	auto const_1 = builder.getInt32(1);
 
 	auto type_obj_function = builder.getInt8(static_cast<uint8_t>(ObjType::FUNCTION));
 	auto type_obj_native = builder.getInt8(static_cast<uint8_t>(ObjType::NATIVE));
-	auto type_obj_string = builder.getInt8(static_cast<uint8_t>(ObjType::STRING));
 
-	llvm::AllocaInst* constants =
-		builder.CreateAlloca(value_type, builder.getInt32(chunk->constantsSize()), "constants");
+	// Objects are referenced through the symbols listed in refs, the linker
+	// fills in their addresses.
+	auto object_ref = [&](sObj* object) {
+		auto found = std::find(refs.objects.begin(), refs.objects.end(), object);
+		if (found == refs.objects.end())
+			DIE << "Object " << object << " is not a reference of " << name;
+		auto symbol = referenceSymbol(found - refs.objects.begin());
+		return llvm::cast<llvm::Constant>(module->getOrInsertGlobal(symbol, uint8_type));
+	};
+
+	// Constants are folded into the instructions that push them (numbers as
+	// their bits, objects as their symbol), nothing is set up per call.
+	std::vector<llvm::Constant*> constants(chunk->constantsSize());
 	for (size_t i = 0; i < chunk->constantsSize(); ++i)
 	{
 		auto &constant = chunk->constants()[i];
-		llvm::Value* elem_addr = builder.CreateInBoundsGEP(constants, {builder.getInt32(i)}, "elem_addr");
 		switch (constant.type())
 		{
 			default:
 				DIE << "Cant happen\n";
 				break;
-			case ValueType::NUMBER: {
-				builder.CreateStore(llvm::ConstantStruct::get(value_type,
-															  {type_number, llvm::ConstantFP::get(double_type,
-															  	constant.asNumber())}), elem_addr);
+			case ValueType::NUMBER:
+				constants[i] = value_constant(value_type, constant);
 				break;
-			}
-			case ValueType::OBJ: {
-				auto ptr = builder.getInt64(reinterpret_cast<size_t>(constant.asObj()));
-				llvm::Value* elem_type_ptr = builder.CreateStructGEP(value_type, elem_addr, 0, "type_ptr");
-				builder.CreateStore(type_obj, elem_type_ptr);
-				llvm::Value* elem_value_ptr = builder.CreateStructGEP(value_type, elem_addr, 1, "value_ptr");
-				llvm::Value* elem_ptr = builder.CreateBitCast(elem_value_ptr, in64Ptr_type, "elem_ptr");
-				builder.CreateStore(ptr, elem_ptr);
+			case ValueType::OBJ:
+				constants[i] = value_constant(value_type, constant, object_ref(constant.asObj()));
 				break;
-			}
 		}
 	}
-	builder.CreateInvariantStart(constants, builder.getInt64(sizeof(Value) * chunk->constantsSize()));
-
-	llvm::AllocaInst* pc = builder.CreateAlloca(int32_type, nullptr, "pc");
-	builder.CreateStore(const_0, pc);
 
-	llvm::AllocaInst* stack_ptr = builder.CreateAlloca(valutePtr_type, nullptr, "stack_ptr");
-	builder.CreateStore(stack_, stack_ptr);
-	llvm::Value* stack = builder.CreateLoad(stack_ptr, "stack");
+	// The stack depth before every instruction is known at compile time, so
+	// each stack slot (locals included) gets its own alloca. mem2reg/SROA turn
+	// them into SSA values with phis at the block labels; the memory stack is
+	// only touched on entry, for the arguments of a call and for the result.
+	auto depths = stackDepths(chunk, static_cast<int32_t>(function->arity) + 1);
+	if (depths[entry] < 0)
+		DIE << "Entry " << entry << " is not reachable";
+	auto max_depth = *std::max_element(depths.begin(), depths.end()) + 1;
+
+	std::vector<llvm::AllocaInst*> regs(max_depth);
+	for (int32_t i = 0; i < max_depth; ++i)
+	{
+		regs[i] = builder.CreateAlloca(value_type, nullptr, "r" + std::to_string(i));
+	}
+	// Stores the slots below depth to the memory stack, or loads them back.
+	auto spill_slots = [&](int32_t depth) {
+		for (int32_t i = 0; i < depth; ++i)
+		{
+			llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {builder.getInt32(i)}, "slot_addr");
+			builder.CreateStore(builder.CreateLoad(regs[i], "slot"), slot_addr);
+		}
+	};
+	auto reload_slots = [&](int32_t depth) {
+		for (int32_t i = 0; i < depth; ++i)
+		{
+			llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {builder.getInt32(i)}, "slot_addr");
+			builder.CreateStore(builder.CreateLoad(slot_addr, "slot"), regs[i]);
+		}
+	};
+	reload_slots(depths[entry]);
+
+	// Safepoints, where the collector may run: calls, string concatenation
+	// and back edges. The slots live there are spilled to the memory stack,
+	// which is the stack map of the frame (the collector scans the VM stack
+	// up to the end of the innermost frame), and reloaded after it in case
+	// what they refer to moved. Back edges only stop when the VM asks, its
+	// flag is polled through a pointer fetched on entry.
+	llvm::Value* safepoint_flag = nullptr;
+	for (auto offset = 0u; offset < chunk->size(); offset += instructionSize(chunk->get(offset)))
+	{
+		if (chunk->get(offset) == OpCode::JUMP_BACK && depths[offset] >= 0)
+		{
+			safepoint_flag = builder.CreateCall(safepointFlag_func, {vm_}, "safepoint_flag");
+			break;
+		}
+	}
+	llvm::MDNode* unlikely_safepoint = llvm::MDBuilder(context).createBranchWeights(1u, 1u << 20u);
+
+#ifdef TYPE_SPECULATION
+	auto entry_types = entryTypes(function, depths[entry], entry, entry_slots);
+	auto types = slotTypes(function, depths, entry, entry_types);
+
+	llvm::Function* deoptimize_func = module->getFunction("deoptimize");
+	llvm::Value* function_addr = object_ref(function);
+	llvm::MDNode* unlikely_deopt = llvm::MDBuilder(context).createBranchWeights(1u << 20u, 1u);
+
+	// Exit taken when a speculation fails before the instruction at offset:
+	// hands the live slots to the interpreter, which finishes the call.
+	auto deopt_exit = [&](uint32_t offset, int32_t depth) {
+		auto insert_bb = builder.GetInsertBlock();
+		llvm::BasicBlock* deopt_bb = llvm::BasicBlock::Create(context, "deopt", jit_func);
+		builder.SetInsertPoint(deopt_bb);
+		spill_slots(depth);
+		llvm::Value* status = builder.CreateCall(deoptimize_func,
+			{vm_, function_addr, stack, builder.getInt32(depth), builder.getInt32(offset), stack_top}, "status");
+		builder.CreateRet(status);
+		builder.SetInsertPoint(insert_bb);
+		return deopt_bb;
+	};
+
+	// Conjunction of the number checks for the slots not known to be numbers,
+	// or nullptr when there is nothing to check.
+	auto check_numbers = [&](const SlotTypes& known, std::initializer_list<int32_t> slots_) {
+		llvm::Value* is_number = nullptr;
+		for (auto slot : slots_)
+		{
+			if (!known.empty() && known[slot] == SlotType::NUMBER)
+				continue;
+			auto check = emit_is_type(builder, value_type, regs[slot], ValueType::NUMBER);
+			is_number = is_number ? builder.CreateAnd(is_number, check, "is_number") : check;
+		}
+		return is_number;
+	};
+#endif
 
+	llvm::AllocaInst* call_top = builder.CreateAlloca(int32_type, nullptr, "call_top");
 	llvm::AllocaInst* alloc_temp_1 = builder.CreateAlloca(value_type, nullptr, "alloc_temp_1");
 	llvm::AllocaInst* alloc_temp_2 = builder.CreateAlloca(value_type, nullptr, "alloc_temp_2");
 	llvm::AllocaInst* alloc_temp_3 = builder.CreateAlloca(value_type, nullptr, "alloc_temp_3");
 
+	// Reports a runtime error at pc unless the values at addrs are numbers. The
+	// code emitted after it only runs for numbers.
+	auto check_number_operands = [&](std::initializer_list<llvm::Value*> addrs, llvm::Value* pc) {
+		llvm::Value* not_number = nullptr;
+		for (auto addr : addrs)
+		{
+			auto check = builder.CreateNot(emit_is_type(builder, value_type, addr, ValueType::NUMBER), "not_number");
+			not_number = not_number ? builder.CreateOr(not_number, check, "not_number") : check;
+		}
+
+		llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
+		llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
+
+		builder.CreateCondBr(not_number, then_bb, else_bb);
+
+		builder.SetInsertPoint(then_bb);
+		builder.CreateCall(numberError_func, {vm_, pc});
+		// return error code
+		builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
+
+		builder.SetInsertPoint(else_bb);
+	};
+
+	// Unless the values at a_addr and b_addr are both numbers, adds them
+	// through the runtime (string concatenation or a runtime error at pc) into
+	// result_addr and continues at next. The slots below depth are live. The
+	// code emitted after it only runs for numbers.
+	auto add_objects = [&](llvm::Value* a_addr, llvm::Value* b_addr, llvm::Value* result_addr, int32_t depth, llvm::Value* pc, llvm::BasicBlock* next) {
+		auto comp_1 = builder.CreateNot(emit_is_type(builder, value_type, a_addr, ValueType::NUMBER), "comp_1");
+		auto comp_2 = builder.CreateNot(emit_is_type(builder, value_type, b_addr, ValueType::NUMBER), "comp_2");
+		auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
+
+		llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
+		llvm::BasicBlock* error_bb = llvm::BasicBlock::Create(context, "error", jit_func);
+		llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
+
+		builder.CreateCondBr(comp_3, then_bb, else_bb);
+
+		// string concatenation goes through the runtime, the operands
+		// are copied out so the slots themselves never escape
+		builder.SetInsertPoint(then_bb);
+		builder.CreateStore(builder.CreateLoad(a_addr), alloc_temp_1);
+		builder.CreateStore(builder.CreateLoad(b_addr), alloc_temp_2);
+		// A safepoint, the operands are read before anything is allocated.
+		spill_slots(depth);
+		llvm::Value* top = builder.CreateInBoundsGEP(stack, {builder.getInt32(depth)}, "top");
+
+		llvm::Value* status =
+			builder.CreateCall(concatenate_func, {vm_, alloc_temp_3, alloc_temp_1, alloc_temp_2, top, pc}, "status");
+		reload_slots(depth);
+		builder.CreateStore(builder.CreateLoad(alloc_temp_3), result_addr);
+		llvm::Value* _ok = builder.getInt32(static_cast<int32_t>(InterpretResult::OK));
+		llvm::Value* cmp_status = builder.CreateICmpEQ(status, _ok, "cmp_status");
+		builder.CreateCondBr(cmp_status, next, error_bb);
+
+		builder.SetInsertPoint(error_bb);
+		// return error code
+		builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
+
+		builder.SetInsertPoint(else_bb);
+	};
+
 
 	auto size = chunk->size();
 	auto jump_blocks = jumpBlocks(chunk);
@@ -446,37 +1031,66 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 		blocks[val] = llvm::BasicBlock::Create(context, name_, jit_func);
 	}
 
-	builder.CreateBr(blocks[0]);
+	// entry is 0 for regular calls and a loop header for OSR variants.
+#ifdef TYPE_SPECULATION
+	llvm::Value* entry_check = nullptr;
+	for (int32_t i = 0; i < depths[entry]; ++i)
+	{
+		if (entry_types[i] != SlotType::NUMBER)
+			continue;
+		auto check = emit_is_type(builder, value_type, regs[i], ValueType::NUMBER);
+		entry_check = entry_check ? builder.CreateAnd(entry_check, check, "is_number") : check;
+	}
+	if (entry_check)
+		builder.CreateCondBr(entry_check, blocks[entry], deopt_exit(entry, depths[entry]), unlikely_deopt);
+	else
+#endif
+	builder.CreateBr(blocks[entry]);
 	for (auto offset = 0u; offset < size;)
 	{
 		//set block
 		builder.SetInsertPoint(blocks[offset]);
 
 		auto instruction = chunk->get(offset);
+		auto depth = depths[offset];
+		// Runtime errors report the offset of the failing instruction.
+		auto pc = builder.getInt32(offset);
+		if (subprogram)
+			builder.SetCurrentDebugLocation(llvm::DILocation::get(context, chunk->getLine(offset), 0, subprogram));
+
+#ifdef TYPE_SPECULATION
+		auto speculated = isSpeculated(function, offset, types[offset]);
+
+		// Speculation guard: leaves through deoptimize unless the slots hold
+		// numbers. Slots the inference already proved numeric are not checked.
+		auto guard_numbers = [&](std::initializer_list<int32_t> slots_) {
+			auto is_number = check_numbers(types[offset], slots_);
+			if (!is_number)
+				return;
+			llvm::BasicBlock* number_bb = llvm::BasicBlock::Create(context, "number", jit_func);
+			builder.CreateCondBr(is_number, number_bb, deopt_exit(offset, depth), unlikely_deopt);
+			builder.SetInsertPoint(number_bb);
+		};
+#endif
+
+		if (depth < 0)
+		{
+			// Dead code, like the implicit return after an explicit one.
+			builder.CreateUnreachable();
+			offset += instructionSize(instruction);
+			continue;
+		}
+
 		switch (instruction)
 		{
 			case OpCode::CONSTANT:
 			{
 				// get index_
 				auto index_ = chunk->get(offset + 1u);
-				auto index_val = builder.getInt32(index_);
-
-				// get constant
-				llvm::Value* constant_addr = builder.CreateInBoundsGEP(constants, {index_val}, "constant_addr");
-				llvm::Value* constant = builder.CreateLoad(constant_addr, "constant");
-
-
-				// push constant to stack
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-				builder.CreateStore(constant, elem_addr);
 
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
+				// push constant
+				builder.CreateStore(constants[index_], regs[depth]);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 2]);
 				offset += 2;
 				break;
@@ -487,122 +1101,48 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 				uint32_t index_ = chunk->get(offset + 1u) |
 								  static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
 								  static_cast<uint32_t>(chunk->get(offset + 3) << 16u);
-				auto index_val = builder.getInt32(index_);
-
-				// get constant
-				llvm::Value* constant_addr = builder.CreateInBoundsGEP(constants, {index_val}, "constant_addr");
-				llvm::Value* constant = builder.CreateLoad(constant_addr, "constant");
-
-
-				// push constant to stack
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-				builder.CreateStore(constant, elem_addr);
 
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
+				// push constant
+				builder.CreateStore(constants[index_], regs[depth]);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(4), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 4]);
 				offset += 4;
 				break;
 			}
 			case OpCode::NIL:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
+				builder.CreateStore(value_constant(value_type, Value::Nil()), regs[depth]);
 
-				builder.CreateStore(llvm::ConstantStruct::get(value_type,
-															  {type_nil, llvm::ConstantFP::get(double_type, 0.0)}), elem_addr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::TRUE:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-
-				llvm::Value* elem_type_ptr = builder.CreateStructGEP(value_type, elem_addr, 0, "type_ptr");
-				builder.CreateStore(type_bool, elem_type_ptr);
-
-				llvm::Value* elem_value_ptr = builder.CreateStructGEP(value_type, elem_addr, 1, "value_ptr");
-				llvm::Value* elem_bool_ptr = builder.CreateBitCast(elem_value_ptr, boolPtr_type, "elem_bool_ptr");
+				emit_store_bool(builder, value_type, regs[depth], builder.getTrue());
 
-				builder.CreateStore(builder.getTrue(), elem_bool_ptr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::FALSE:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-
-				llvm::Value* elem_type_ptr = builder.CreateStructGEP(value_type, elem_addr, 0, "type_ptr");
-				builder.CreateStore(type_bool, elem_type_ptr);
-
-				llvm::Value* elem_value_ptr = builder.CreateStructGEP(value_type, elem_addr, 1, "value_ptr");
-				llvm::Value* elem_bool_ptr = builder.CreateBitCast(elem_value_ptr, boolPtr_type, "elem_bool_ptr");
+				emit_store_bool(builder, value_type, regs[depth], builder.getFalse());
 
-				builder.CreateStore(builder.getFalse(), elem_bool_ptr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::POP:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* dec_stacktop = builder.CreateSub(stacktop, const_1, "dec_stacktop");
-				builder.CreateStore(dec_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::DUP:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1);
-
-				llvm::Value* temp_addr = builder.CreateInBoundsGEP(stack, {temp}, "elem_addr");
-				llvm::Value* temp_elem = builder.CreateLoad(temp_addr, "elem");
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "elem"), regs[depth]);
 
-				llvm::Value* temp2_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem2_addr");
-				builder.CreateStore(temp_elem, temp2_addr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
@@ -611,155 +1151,62 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 			{
 				// get slot_
 				auto slot_ = chunk->get(offset + 1u);
-				auto slot_val = builder.getInt32(slot_);
-
-				llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {slot_val}, "slot_addr");
-				llvm::Value* slot_elem = builder.CreateLoad(slot_addr, "slot_elem");
-
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "temp_addr");
-				builder.CreateStore(slot_elem, temp_addr);
 
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
+				builder.CreateStore(builder.CreateLoad(regs[slot_], "slot_elem"), regs[depth]);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 2]);
 				offset += 2;
 				break;
 			}
 			case OpCode::GET_LOCAL_SHORT:
 			{
-				// get const_
+				// get slot_
 				uint16_t slot_ = chunk->get(offset + 1u) |
 								 static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
-				auto slot_val = builder.getInt32(slot_);
-
-				llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {slot_val}, "slot_addr");
-				llvm::Value* slot_elem = builder.CreateLoad(slot_addr, "slot_elem");
 
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "temp_addr");
-				builder.CreateStore(slot_elem, temp_addr);
+				builder.CreateStore(builder.CreateLoad(regs[slot_], "slot_elem"), regs[depth]);
 
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(3), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 3]);
 				offset += 3;
 				break;
 			}
 			case OpCode::SET_LOCAL:
 			{
-				// get const_
+				// get slot_
 				auto slot_ = chunk->get(offset + 1u);
-				auto slot_val = builder.getInt32(slot_);
 
-				// get top elem
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1);
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "top_elem"), regs[slot_]);
 
-				llvm::Value* top_elem_addr = builder.CreateInBoundsGEP(stack, {temp}, "top_elem_addr");
-				llvm::Value* top_elem = builder.CreateLoad(top_elem_addr, "top_elem");
-
-				// store in slot
-				llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {slot_val}, "slot_addr");
-				builder.CreateStore(top_elem, slot_addr);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 2]);
 				offset += 2;
 				break;
 			}
 			case OpCode::SET_LOCAL_SHORT:
 			{
-				// get const_
+				// get slot_
 				uint16_t slot_ = chunk->get(offset + 1u) |
 								 static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
-				auto slot_val = builder.getInt32(slot_);
-
-				// get top elem
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1);
 
-				llvm::Value* top_elem_addr = builder.CreateInBoundsGEP(stack, {temp}, "top_elem_addr");
-				llvm::Value* top_elem = builder.CreateLoad(top_elem_addr, "top_elem");
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "top_elem"), regs[slot_]);
 
-				// store in slot
-				llvm::Value* slot_addr = builder.CreateInBoundsGEP(stack, {slot_val}, "slot_addr");
-				builder.CreateStore(top_elem, slot_addr);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(3), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 3]);
 				offset += 3;
 				break;
 			}
 			case OpCode::GET_GLOBAL:
-			{
-				// get const_
-				auto index_ = chunk->get(offset + 1u);
-				auto index_val = builder.getInt32(index_);
-
-				// get value from globals
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(globals, {index_val}, "val_addr");
-				llvm::Value* val = builder.CreateLoad(val_addr, "val");
-
-				llvm::Value* val_type_ptr = builder.CreateStructGEP(value_type, val_addr, 0, "type_ptr");
-				llvm::Value* val_type = builder.CreateLoad(val_type_ptr, false, "val_type");
-				llvm::Value* comp_1 = builder.CreateICmpEQ(val_type, type_undefined, "is_undefined");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_1, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				// call variableError
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(variableError_func, {vm_, index_val, pc_});
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-				builder.SetInsertPoint(else_bb);
-				// push value
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-				builder.CreateStore(val, elem_addr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
-
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 2]);
-				offset += 2;
-				break;
-			}
 			case OpCode::GET_GLOBAL_LONG:
 			{
-				// get const_
-				uint32_t index_ = chunk->get(offset + 1u) |
-								  static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
-								  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
+				// get index_
+				uint32_t index_ = chunk->get(offset + 1u);
+				if (instruction == OpCode::GET_GLOBAL_LONG)
+					index_ |= static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
+							  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
 				auto index_val = builder.getInt32(index_);
 
 				// get value from globals
 				llvm::Value* val_addr = builder.CreateInBoundsGEP(globals, {index_val}, "val_addr");
-				llvm::Value* val = builder.CreateLoad(val_addr, "val");
 
-				llvm::Value* val_type_ptr = builder.CreateStructGEP(value_type, val_addr, 0, "type_ptr");
-				llvm::Value* val_type = builder.CreateLoad(val_type_ptr, false, "val_type");
-				llvm::Value* comp_1 = builder.CreateICmpEQ(val_type, type_undefined, "is_undefined");
+				llvm::Value* comp_1 = emit_is_type(builder, value_type, val_addr, ValueType::UNDEFINED);
 
 				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
 				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
@@ -768,139 +1215,51 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 
 				builder.SetInsertPoint(then_bb);
 				// call variableError
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(variableError_func, {vm_, index_val, pc_});
+				builder.CreateCall(variableError_func, {vm_, index_val, pc});
 				// return error code
 				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
 
 				builder.SetInsertPoint(else_bb);
 				// push value
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(stack, {stacktop}, "elem_addr");
-				builder.CreateStore(val, elem_addr);
-
-				llvm::Value* inc_stacktop = builder.CreateAdd(stacktop, const_1, "inc_stacktop");
-				builder.CreateStore(inc_stacktop, stack_top);
+				builder.CreateStore(builder.CreateLoad(val_addr, "val"), regs[depth]);
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(4), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 4]);
-				offset += 4;
+				auto size_ = instructionSize(instruction);
+				builder.CreateBr(blocks[offset + size_]);
+				offset += size_;
 				break;
 			}
 			case OpCode::DEFINE_GLOBAL:
-			{
-				// get index_
-				auto index_ = chunk->get(offset + 1u);
-				auto index_val = builder.getInt32(index_);
-
-				// get element at stack_top - 1
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-
-				llvm::Value* stack_val_addr = builder.CreateInBoundsGEP(stack, {temp}, "stack_val_addr");
-				llvm::Value* stack_val = builder.CreateLoad(stack_val_addr, "stack_val");
-
-				// store element in globals at index
-				llvm::Value* elem_addr = builder.CreateInBoundsGEP(globals, {index_val}, "elem_addr");
-				builder.CreateStore(stack_val, elem_addr);
-
-				// pop value from stack
-				builder.CreateStore(temp, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 2]);
-				offset += 2;
-				break;
-			}
 			case OpCode::DEFINE_GLOBAL_LONG:
 			{
 				// get index_
-				uint32_t index_ = chunk->get(offset + 1u) |
-								  static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
-								  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
+				uint32_t index_ = chunk->get(offset + 1u);
+				if (instruction == OpCode::DEFINE_GLOBAL_LONG)
+					index_ |= static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
+							  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
 				auto index_val = builder.getInt32(index_);
 
-				// get element at stack_top - 1
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-
-				llvm::Value* stack_val_addr = builder.CreateInBoundsGEP(stack, {temp}, "stack_val_addr");
-				llvm::Value* stack_val = builder.CreateLoad(stack_val_addr, "stack_val");
-
-				// store element in globals at index
+				// store top element in globals at index and pop it
 				llvm::Value* elem_addr = builder.CreateInBoundsGEP(globals, {index_val}, "elem_addr");
-				builder.CreateStore(stack_val, elem_addr);
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "stack_val"), elem_addr);
 
-				// pop value from stack
-				builder.CreateStore(temp, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(4), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 4]);
-				offset += 4;
+				auto size_ = instructionSize(instruction);
+				builder.CreateBr(blocks[offset + size_]);
+				offset += size_;
 				break;
 			}
 			case OpCode::SET_GLOBAL:
-			{
-				// get index_
-				auto index_ = chunk->get(offset + 1u);
-				auto index_val = builder.getInt32(index_);
-
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(globals, {index_val}, "val_addr");
-
-				llvm::Value* val_type_addr = builder.CreateStructGEP(value_type, val_addr, 0, "val_type_addr");
-				llvm::Value* val_type = builder.CreateLoad(val_type_addr, "val_type");
-				llvm::Value* comp_1 = builder.CreateICmpEQ(val_type, type_undefined, "is_undefined");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_1, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				// call variableError
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(variableError_func, {vm_, index_val, pc_});
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-				builder.SetInsertPoint(else_bb);
-
-				// get element at stack_top - 1
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-
-				llvm::Value* stack_val_addr = builder.CreateInBoundsGEP(stack, {temp}, "stack_val_addr");
-				llvm::Value* stack_val = builder.CreateLoad(stack_val_addr, "stack_val");
-
-				// store element in globals at index
-				builder.CreateStore(stack_val, val_addr);
-
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(2), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 2]);
-				offset += 2;
-				break;
-			}
 			case OpCode::SET_GLOBAL_LONG:
 			{
-				// get const_
-				uint32_t index_ = chunk->get(offset + 1u) |
-								  static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
-								  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
+				// get index_
+				uint32_t index_ = chunk->get(offset + 1u);
+				if (instruction == OpCode::SET_GLOBAL_LONG)
+					index_ |= static_cast<uint32_t>(chunk->get(offset + 2u) << 8u) |
+							  static_cast<uint32_t>(chunk->get(offset + 3u) << 16u);
 				auto index_val = builder.getInt32(index_);
 
 				llvm::Value* val_addr = builder.CreateInBoundsGEP(globals, {index_val}, "val_addr");
 
-				llvm::Value* val_type_addr = builder.CreateStructGEP(value_type, val_addr, 0, "val_type_addr");
-				llvm::Value* val_type = builder.CreateLoad(val_type_addr, "val_type");
-				llvm::Value* comp_1 = builder.CreateICmpEQ(val_type, type_undefined, "is_undefined");
+				llvm::Value* comp_1 = emit_is_type(builder, value_type, val_addr, ValueType::UNDEFINED);
 
 				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
 				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
@@ -909,559 +1268,264 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 
 				builder.SetInsertPoint(then_bb);
 				// call variableError
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(variableError_func, {vm_, index_val, pc_});
+				builder.CreateCall(variableError_func, {vm_, index_val, pc});
 				// return error code
 				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
 
 				builder.SetInsertPoint(else_bb);
 
-				// get element at stack_top - 1
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-
-				llvm::Value* stack_val_addr = builder.CreateInBoundsGEP(stack, {temp}, "stack_val_addr");
-				llvm::Value* stack_val = builder.CreateLoad(stack_val_addr, "stack_val");
-
-				// store element in globals at index
-				builder.CreateStore(stack_val, val_addr);
+				// store top element in globals at index
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "stack_val"), val_addr);
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(4), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 4]);
-				offset += 4;
+				auto size_ = instructionSize(instruction);
+				builder.CreateBr(blocks[offset + size_]);
+				offset += size_;
 				break;
 			}
 			case OpCode::EQUAL:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
+				llvm::Value* a_addr = regs[depth - 2];
+				llvm::Value* b_addr = regs[depth - 1];
 
 				llvm::Value* res = builder.CreateCall(equal_func, {a_addr, b_addr});
 
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_value_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_value_addr");
-				llvm::Value* a_bool_addr = builder.CreateBitCast(a_value_addr, boolPtr_type, "a_bool_addr");
-
-				builder.CreateStore(type_bool, a_type_addr);
-				builder.CreateStore(res, a_bool_addr);
+				emit_store_bool(builder, value_type, a_addr, res);
 
-				// pop
-				builder.CreateStore(temp, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::GREATER:
-			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
-
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_number = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_number = builder.CreateLoad(b_number_addr, "b_number");
-
-				llvm::Value* less_cmp = builder.CreateFCmpOGT(a_number, b_number, "less_cmp");
-
-				// store result
-				builder.CreateStore(type_bool, a_type_addr);
-				llvm::Value* a_bool_ptr = builder.CreateBitCast(a_number_addr, boolPtr_type, "a_bool_ptr");
-				builder.CreateStore(less_cmp, a_bool_ptr);
-
-				// pop value
-				builder.CreateStore(temp, stack_top);
-
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 1]);
-				offset += 1;
-				break;
-			}
 			case OpCode::LESS:
+			case OpCode::SUBTRACT:
+			case OpCode::MULTIPLY:
+			case OpCode::DIVIDE:
+			case OpCode::MODULO:
+			case OpCode::GREATER_EQUAL:
+			case OpCode::LESS_EQUAL:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
+				llvm::Value* a_addr = regs[depth - 2];
+				llvm::Value* b_addr = regs[depth - 1];
 
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_number = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_number = builder.CreateLoad(b_number_addr, "b_number");
+#ifdef TYPE_SPECULATION
+				if (speculated)
+					guard_numbers({depth - 2, depth - 1});
+				else
+#endif
+				check_number_operands({a_addr, b_addr}, pc);
 
-				llvm::Value* less_cmp = builder.CreateFCmpOLT(a_number, b_number, "less_cmp");
+				llvm::Value* a_number = emit_load_number(builder, value_type, a_addr);
+				llvm::Value* b_number = emit_load_number(builder, value_type, b_addr);
 
 				// store result
-				builder.CreateStore(type_bool, a_type_addr);
-				llvm::Value* a_bool_ptr = builder.CreateBitCast(a_number_addr, boolPtr_type, "a_bool_ptr");
-				builder.CreateStore(less_cmp, a_bool_ptr);
-
-				// pop value
-				builder.CreateStore(temp, stack_top);
+				switch (instruction)
+				{
+					case OpCode::GREATER:
+						emit_store_bool(builder, value_type, a_addr, builder.CreateFCmpOGT(a_number, b_number, "greater_cmp"));
+						break;
+					case OpCode::LESS:
+						emit_store_bool(builder, value_type, a_addr, builder.CreateFCmpOLT(a_number, b_number, "less_cmp"));
+						break;
+					// The negation of LESS and GREATER, true for NaN.
+					case OpCode::GREATER_EQUAL:
+						emit_store_bool(builder, value_type, a_addr, builder.CreateFCmpUGE(a_number, b_number, "greater_equal_cmp"));
+						break;
+					case OpCode::LESS_EQUAL:
+						emit_store_bool(builder, value_type, a_addr, builder.CreateFCmpULE(a_number, b_number, "less_equal_cmp"));
+						break;
+					case OpCode::SUBTRACT:
+						emit_store_number(builder, value_type, a_addr, builder.CreateFSub(a_number, b_number));
+						break;
+					case OpCode::MULTIPLY:
+						emit_store_number(builder, value_type, a_addr, builder.CreateFMul(a_number, b_number));
+						break;
+					case OpCode::DIVIDE:
+						emit_store_number(builder, value_type, a_addr, builder.CreateFDiv(a_number, b_number));
+						break;
+					default:
+						emit_store_number(builder, value_type, a_addr, builder.CreateFRem(a_number, b_number));
+						break;
+				}
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::ADD:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* error_bb = llvm::BasicBlock::Create(context, "error", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-				llvm::BasicBlock* end_bb = llvm::BasicBlock::Create(context, "end", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				builder.CreateStore(builder.CreateLoad(a_addr), alloc_temp_1);
-				builder.CreateStore(builder.CreateLoad(b_addr), alloc_temp_2);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* status =
-					builder.CreateCall(concatenate_func, {vm_, alloc_temp_3, alloc_temp_1, alloc_temp_2, pc_}, "status");
-				builder.CreateStore(builder.CreateLoad(alloc_temp_3), a_addr);
-				llvm::Value* _ok = builder.getInt32(static_cast<int32_t>(InterpretResult::OK));
-				llvm::Value* cmp_status = builder.CreateICmpEQ(status, _ok, "cmp_status");
-				builder.CreateCondBr(cmp_status, end_bb, error_bb);
-
-				builder.SetInsertPoint(error_bb);
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
+				llvm::Value* a_addr = regs[depth - 2];
+				llvm::Value* b_addr = regs[depth - 1];
 
-				builder.SetInsertPoint(else_bb);
+#ifdef TYPE_SPECULATION
+				if (speculated)
+					guard_numbers({depth - 2, depth - 1});
+				else
+#endif
+				add_objects(a_addr, b_addr, a_addr, depth, pc, blocks[offset + 1]);
 
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_numer = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_numer = builder.CreateLoad(b_number_addr, "b_number");
+				llvm::Value* a_numer = emit_load_number(builder, value_type, a_addr);
+				llvm::Value* b_numer = emit_load_number(builder, value_type, b_addr);
 
 				llvm::Value* res = builder.CreateFAdd(a_numer, b_numer);
 
 				// store result
-				builder.CreateStore(res, a_number_addr);
-				builder.CreateBr(end_bb);
+				emit_store_number(builder, value_type, a_addr, res);
 
-				builder.SetInsertPoint(end_bb);
-				// pop value
-				builder.CreateStore(temp, stack_top);
-
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
-			case OpCode::SUBTRACT:
+			case OpCode::NOT_EQUAL:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
+				llvm::Value* a_addr = regs[depth - 2];
+				llvm::Value* b_addr = regs[depth - 1];
 
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
-
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_numer = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_numer = builder.CreateLoad(b_number_addr, "b_number");
-
-				llvm::Value* res = builder.CreateFSub(a_numer, b_numer);
-
-				// store result
-				builder.CreateStore(res, a_number_addr);
+				llvm::Value* res = builder.CreateCall(equal_func, {a_addr, b_addr});
 
-				// pop value
-				builder.CreateStore(temp, stack_top);
+				emit_store_bool(builder, value_type, a_addr, builder.CreateNot(res, "not_equal"));
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
-			case OpCode::MULTIPLY:
+			case OpCode::SET_LOCAL_POP:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
-
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_numer = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_numer = builder.CreateLoad(b_number_addr, "b_number");
-
-				llvm::Value* res = builder.CreateFMul(a_numer, b_numer);
-
-				// store result
-				builder.CreateStore(res, a_number_addr);
+				// get slot_
+				auto slot_ = chunk->get(offset + 1u);
 
-				// pop value
-				builder.CreateStore(temp, stack_top);
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "top_elem"), regs[slot_]);
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 1]);
-				offset += 1;
+				builder.CreateBr(blocks[offset + 2]);
+				offset += 2;
 				break;
 			}
-			case OpCode::DIVIDE:
+			case OpCode::ADD_LOCAL_LOCAL:
+			case OpCode::INC_LOCAL_CONST:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
-
-
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
-
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_numer = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_numer = builder.CreateLoad(b_number_addr, "b_number");
-
-				llvm::Value* res = builder.CreateFDiv(a_numer, b_numer);
+				// The operands are a local and a local or a number constant, the
+				// result goes to the stack or back to the local.
+				auto slot_ = chunk->get(offset + 1u);
+				auto operand_ = chunk->get(offset + 2u);
+				llvm::Value* a_addr = regs[slot_];
+				llvm::Value* b_addr = regs[operand_];
+				llvm::Value* result_addr = regs[depth];
+				if (instruction == OpCode::INC_LOCAL_CONST)
+				{
+					builder.CreateStore(constants[operand_], alloc_temp_2);
+					b_addr = alloc_temp_2;
+					result_addr = a_addr;
+				}
 
-				// store result
-				builder.CreateStore(res, a_number_addr);
+#ifdef TYPE_SPECULATION
+				if (speculated)
+				{
+					if (instruction == OpCode::INC_LOCAL_CONST)
+						guard_numbers({slot_});
+					else
+						guard_numbers({slot_, operand_});
+				}
+				else
+#endif
+				add_objects(a_addr, b_addr, result_addr, depth, pc, blocks[offset + 3]);
 
-				// pop value
-				builder.CreateStore(temp, stack_top);
+				llvm::Value* a_number = emit_load_number(builder, value_type, a_addr);
+				llvm::Value* b_number = emit_load_number(builder, value_type, b_addr);
+				emit_store_number(builder, value_type, result_addr, builder.CreateFAdd(a_number, b_number));
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 1]);
-				offset += 1;
+				builder.CreateBr(blocks[offset + 3]);
+				offset += 3;
 				break;
 			}
-			case OpCode::MODULO:
+			case OpCode::MULTIPLY_LOCAL_LOCAL:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
+				auto a_ = chunk->get(offset + 1u);
+				auto b_ = chunk->get(offset + 2u);
 
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* b_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
+#ifdef TYPE_SPECULATION
+				if (speculated)
+					guard_numbers({a_, b_});
+				else
+#endif
+				check_number_operands({regs[a_], regs[b_]}, pc);
 
-				// get top - 1 element
-				llvm::Value* temp2 = builder.CreateSub(stacktop, const_2, "temp2");
-				llvm::Value* a_addr = builder.CreateInBoundsGEP(stack, {temp2}, "a_addr");
+				llvm::Value* a_number = emit_load_number(builder, value_type, regs[a_]);
+				llvm::Value* b_number = emit_load_number(builder, value_type, regs[b_]);
+				emit_store_number(builder, value_type, regs[depth], builder.CreateFMul(a_number, b_number));
 
+				builder.CreateBr(blocks[offset + 3]);
+				offset += 3;
+				break;
+			}
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+			{
+				llvm::Value* a_addr = regs[depth - 2];
+				llvm::Value* b_addr = regs[depth - 1];
+
+#ifdef TYPE_SPECULATION
+				if (speculated)
+					guard_numbers({depth - 2, depth - 1});
+				else
+#endif
+				check_number_operands({a_addr, b_addr}, pc);
+
+				llvm::Value* a_number = emit_load_number(builder, value_type, a_addr);
+				llvm::Value* b_number = emit_load_number(builder, value_type, b_addr);
+				llvm::Value* cmp = instruction == OpCode::LESS_JUMP_IF_FALSE
+					? builder.CreateFCmpOLT(a_number, b_number, "less_cmp")
+					: builder.CreateFCmpOGT(a_number, b_number, "greater_cmp");
+				// The result stays on the stack for the POP on either edge.
+				emit_store_bool(builder, value_type, a_addr, cmp);
 
-				llvm::Value* a_type_addr = builder.CreateStructGEP(value_type, a_addr, 0, "a_type_addr");
-				llvm::Value* a_type = builder.CreateLoad(a_type_addr, "a_type");
-				llvm::Value* b_type_addr = builder.CreateStructGEP(value_type, b_addr, 0, "b_type_addr");
-				llvm::Value* b_type = builder.CreateLoad(b_type_addr, "b_type");
-
-				auto comp_1 = builder.CreateICmpNE(a_type, type_number, "comp_1");
-				auto comp_2 = builder.CreateICmpNE(b_type, type_number, "comp_2");
-				auto comp_3 = builder.CreateOr(comp_1, comp_2, "comp_3");
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(comp_3, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-
-
-				builder.SetInsertPoint(else_bb);
-
-				llvm::Value* a_number_addr = builder.CreateStructGEP(value_type, a_addr, 1, "a_number_addr");
-				llvm::Value* a_numer = builder.CreateLoad(a_number_addr, "a_number");
-				llvm::Value* b_number_addr = builder.CreateStructGEP(value_type, b_addr, 1, "b_number_addr");
-				llvm::Value* b_numer = builder.CreateLoad(b_number_addr, "b_number");
-
-				llvm::Value* res = builder.CreateFRem(a_numer, b_numer);
-
-				// store result
-				builder.CreateStore(res, a_number_addr);
-
-				// pop value
-				builder.CreateStore(temp, stack_top);
+				// jump
+				uint16_t jump = chunk->get(offset + 1u) |
+								static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
-				builder.CreateBr(blocks[offset + 1]);
-				offset += 1;
+				builder.CreateCondBr(cmp, blocks[offset + 3], blocks[offset + 3 + jump]);
+				offset += 3;
 				break;
 			}
 			case OpCode::NOT:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(stack, {temp}, "val_addr");
+				llvm::Value* val_addr = regs[depth - 1];
 
 				// call is_falsey
 				llvm::Value* result = builder.CreateCall(is_falsey, {val_addr}, "result");
 
 				// store result
-				llvm::Value* val_type_addr = builder.CreateStructGEP(value_type, val_addr, 0, "val_type_addr");
-				llvm::Value* val_value_addr = builder.CreateStructGEP(value_type, val_addr, 1, "val_value_addr");
-				llvm::Value* val_bool_ptr = builder.CreateBitCast(val_value_addr, boolPtr_type, "val_bool_ptr");
+				emit_store_bool(builder, value_type, val_addr, result);
 
-				builder.CreateStore(type_bool, val_type_addr);
-				builder.CreateStore(result, val_bool_ptr);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::NEGATE:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(stack, {temp}, "val_addr");
-
-				llvm::Value* val_type_addr = builder.CreateStructGEP(value_type, val_addr, 0, "val_type_addr");
-				llvm::Value* val_type = builder.CreateLoad(val_type_addr, "val_type");
-
-				llvm::Value* cmp = builder.CreateICmpNE(val_type, type_number);
-
-				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then", jit_func);
-				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else", jit_func);
-
-				builder.CreateCondBr(cmp, then_bb, else_bb);
-
-				builder.SetInsertPoint(then_bb);
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				builder.CreateCall(numberError_func, {vm_, pc_});
-				// return error code
-				builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
+				llvm::Value* val_addr = regs[depth - 1];
 
-				builder.SetInsertPoint(else_bb);
-				llvm::Value* val_number_addr = builder.CreateStructGEP(value_type, val_addr, 1, "val_number_addr");
-				llvm::Value* val_number = builder.CreateLoad(val_number_addr, "val_number");
+#ifdef TYPE_SPECULATION
+				if (speculated)
+					guard_numbers({depth - 1});
+				else
+#endif
+				check_number_operands({val_addr}, pc);
+				llvm::Value* val_number = emit_load_number(builder, value_type, val_addr);
 
 				llvm::Value* res = builder.CreateFNeg(val_number, "res");
 
 				// store result
-				builder.CreateStore(res, val_number_addr);
+				emit_store_number(builder, value_type, val_addr, res);
 
-				pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
 			}
 			case OpCode::PRINT:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(stack, {temp}, "val_addr");
-				builder.CreateStore(builder.CreateLoad(val_addr), alloc_temp_1);
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1]), alloc_temp_1);
 
 				builder.CreateCall(print_func, {alloc_temp_1});
 
-				// pop element
-				builder.CreateStore(temp, stack_top);
-
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 1]);
 				offset += 1;
 				break;
@@ -1472,58 +1536,23 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 				uint16_t jump = chunk->get(offset + 1u) |
 								static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(3 + jump), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 3 + jump]);
 				offset += 3;
 				break;
 			}
 			case OpCode::JUMP_IF_FALSE:
-			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(stack, {temp}, "val_addr");
-
-				llvm::Value* res = builder.CreateCall(is_falsey, {val_addr}, "res");
-
-				// jump
-				uint16_t jump = chunk->get(offset + 1u) |
-								static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
-
-				llvm::Value* cmp = builder.CreateICmpEQ(res, builder.getTrue());
-				llvm::BasicBlock* rtn = llvm::BasicBlock::Create(context, "rtn_jmp", jit_func);
-
-				gen_if_else_jmp(cmp, pc, 3 + jump, 3, builder, context, jit_func, rtn);
-
-				builder.SetInsertPoint(rtn);
-				builder.CreateCondBr(cmp, blocks[offset + 3 + jump], blocks[offset + 3]);
-				offset += 3;
-				break;
-			}
 			case OpCode::JUMP_IF_TRUE:
 			{
-				llvm::Value* stacktop = builder.CreateLoad(stack_top, "stacktop");
-
-				// get top element
-				llvm::Value* temp = builder.CreateSub(stacktop, const_1, "temp");
-				llvm::Value* val_addr = builder.CreateInBoundsGEP(stack, {temp}, "val_addr");
-
-				llvm::Value* res = builder.CreateCall(is_falsey, {val_addr}, "res");
+				llvm::Value* res = builder.CreateCall(is_falsey, {regs[depth - 1]}, "res");
 
 				// jump
 				uint16_t jump = chunk->get(offset + 1u) |
 								static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
 
-				llvm::Value* cmp = builder.CreateICmpEQ(res, builder.getFalse());
-				llvm::BasicBlock* rtn = llvm::BasicBlock::Create(context, "rtn_jmp", jit_func);
-
-				gen_if_else_jmp(cmp, pc, 3 + jump, 3, builder, context, jit_func, rtn);
-
-				builder.SetInsertPoint(rtn);
-				builder.CreateCondBr(cmp, blocks[offset + 3 + jump], blocks[offset + 3]);
+				if (instruction == OpCode::JUMP_IF_FALSE)
+					builder.CreateCondBr(res, blocks[offset + 3 + jump], blocks[offset + 3]);
+				else
+					builder.CreateCondBr(res, blocks[offset + 3], blocks[offset + 3 + jump]);
 				offset += 3;
 				break;
 			}
@@ -1533,9 +1562,15 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 				uint16_t jump = chunk->get(offset + 1u) |
 								static_cast<uint16_t>(chunk->get(offset + 2u) << 8u);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(3 - jump), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
+				// safepoint, taken when the VM asks for one
+				llvm::BasicBlock* safepoint_bb = llvm::BasicBlock::Create(context, "safepoint", jit_func);
+				auto requested = builder.CreateICmpNE(builder.CreateLoad(safepoint_flag, true, "poll"), builder.getInt8(0), "requested");
+				builder.CreateCondBr(requested, safepoint_bb, blocks[offset + 3 - jump], unlikely_safepoint);
+
+				builder.SetInsertPoint(safepoint_bb);
+				spill_slots(depth);
+				builder.CreateCall(safepoint_func, {vm_, builder.CreateInBoundsGEP(stack, {builder.getInt32(depth)}, "top")});
+				reload_slots(depth);
 				builder.CreateBr(blocks[offset + 3 - jump]);
 				offset += 3;
 				break;
@@ -1552,25 +1587,86 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 				auto arg_count = chunk->get(offset + 1u);
 				auto argCount = builder.getInt32(arg_count);
 
-				// get top - argCount element
-				llvm::Value* temp = builder.CreateSub(builder.CreateLoad(stack_top, "stacktop"),builder.CreateAdd(argCount, const_1, "argcount_1"), "temp");
-				llvm::Value* c_addr = builder.CreateInBoundsGEP(stack, {temp}, "b_addr");
-
-				llvm::Value* c_type_addr = builder.CreateStructGEP(value_type, c_addr, 0, "c_type_addr");
-				llvm::Value* c_type = builder.CreateLoad(c_type_addr, "c_type");
-				llvm::Value* c_value_addr = builder.CreateStructGEP(value_type, c_addr, 1, "c_value_addr");
-
-				auto comp_1 = builder.CreateICmpEQ(c_type, type_obj, "comp_1");
+				// A safepoint. The callee and its arguments, the only values the
+				// callee reads, are where its frame starts.
+				auto base = depth - arg_count - 1;
+				spill_slots(depth);
+				llvm::Value* c_addr = builder.CreateInBoundsGEP(stack, {builder.getInt32(base)}, "c_addr");
 
 				llvm::BasicBlock* then_bb = llvm::BasicBlock::Create(context, "then_obj", jit_func);
 				llvm::BasicBlock* else_bb = llvm::BasicBlock::Create(context, "else_obj", jit_func);
 				llvm::BasicBlock* end_bb = llvm::BasicBlock::Create(context, "end_obj", jit_func);
 
+				// Calls callee_addr (arity already checked) and stores the result
+				// in the callee slot.
+				auto emit_invoke = [&](llvm::Value* callee_addr) {
+					builder.CreateStore(builder.CreateAdd(argCount, const_1, "temp_top"), call_top);
+					llvm::Value* status = builder.CreateCall(callee_addr, {vm_, globals, c_addr, call_top}, "status");
+
+					// HANDLE RUNTIME ERROR
+					auto status_comp = builder.CreateICmpNE(status, builder.getInt32(static_cast<int32_t>(InterpretResult::OK)));
+					llvm::BasicBlock* then_status_bb = llvm::BasicBlock::Create(context, "then_status_bb", jit_func);
+					llvm::BasicBlock* else_status_bb = llvm::BasicBlock::Create(context, "else_status_bb", jit_func);
+					builder.CreateCondBr(status_comp, then_status_bb, else_status_bb);
+					builder.SetInsertPoint(then_status_bb);
+					builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
+					builder.SetInsertPoint(else_status_bb);
+					// GET RESULT, it replaces the callee
+					llvm::Value* temp_st = builder.CreateSub(builder.CreateLoad(call_top), const_1, "temp_st");
+					llvm::Value* val_addr = builder.CreateInBoundsGEP(c_addr, {temp_st}, "val_addr");
+					builder.CreateStore(builder.CreateLoad(val_addr, "val"), regs[base]);
+
+					builder.CreateBr(end_bb);
+				};
+
+				// Loads the native entry point of a function, falling back to the
+				// interpreter for functions that are not hot yet.
+				auto emit_load_entry = [&](llvm::Value* callee_ptr_addr) {
+					llvm::Value* callee_addr = builder.CreateLoad(callee_ptr_addr, "callee_addr");
+#ifdef TIERED_EXECUTION
+					auto is_compiled = builder.CreateICmpNE(callee_addr, llvm::ConstantPointerNull::get(funcPtr_type), "is_compiled");
+					callee_addr = builder.CreateSelect(is_compiled, callee_addr, callInterpreted_func, "callee_addr");
+#endif
+					return callee_addr;
+				};
+
+				auto comp_1 = emit_is_type(builder, value_type, regs[base], ValueType::OBJ);
+
+				// Direct call: the callee is a global bound once to a function
+				// with the right arity. Checking that the slot still holds that
+				// very object replaces the type, arity and entry point checks.
+				auto known = directCallee(vm, chunk, depths, offset);
+				if (known != nullptr)
+				{
+					llvm::BasicBlock* direct_bb = llvm::BasicBlock::Create(context, "direct_call", jit_func);
+					llvm::BasicBlock* check_bb = llvm::BasicBlock::Create(context, "check_callee", jit_func);
+
+					auto known_addr = builder.CreateBitCast(object_ref(known), objPtr_type, "known_addr");
+					auto is_known = builder.CreateAnd(comp_1,
+						builder.CreateICmpEQ(emit_load_obj(builder, value_type, regs[base], objPtr_type), known_addr), "is_known");
+					builder.CreateCondBr(is_known, direct_bb, check_bb);
+
+					builder.SetInsertPoint(direct_bb);
+					if (known == function && entry == 0)
+					{
+						// Recursion calls this very function.
+						emit_invoke(jit_func);
+					}
+					else
+					{
+						auto known_function = builder.CreateBitCast(object_ref(known), objFunctionPtr_type, "known_function");
+						auto callee_ptr_addr = builder.CreateBitCast(
+							builder.CreateStructGEP(objFunction_type, known_function, 5), funcPtrPtr_type, "callee_ptr_addr");
+						emit_invoke(emit_load_entry(callee_ptr_addr));
+					}
+
+					builder.SetInsertPoint(check_bb);
+				}
+
 				builder.CreateCondBr(comp_1, then_bb, else_bb);
 				builder.SetInsertPoint(then_bb);
 				{
-					llvm::Value* c_obj_ptr_addr = builder.CreateBitCast(c_value_addr, objPtrPtr_type, "c_obj_ptr_addr");
-					llvm::Value* c_obj_addr = builder.CreateLoad(c_obj_ptr_addr, "c_obj_addr");
+					llvm::Value* c_obj_addr = emit_load_obj(builder, value_type, regs[base], objPtr_type);
 
 					llvm::Value* c_obj_type_addr = builder.CreateStructGEP(obj_type, c_obj_addr, 2, "c_obj_type_addr");
 					llvm::Value* c_obj_type = builder.CreateLoad(c_obj_type_addr, "c_obj_type");
@@ -1588,10 +1684,6 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 					builder.SetInsertPoint(then_fun_bb);
 					{
 						// IS FUNCTION
-						llvm::Value* temp_top = builder.CreateAdd(argCount, const_1, "temp_top");
-						//llvm::AllocaInst* temp_stack_top = builder.CreateAlloca(int32_type, nullptr, "temp_stack_top");
-						builder.CreateStore(temp_top, stack_top);
-
 						llvm::Value* callee_obj_addr = builder.CreateBitCast(c_obj_addr, objFunctionPtr_type, "callee_obj_addr");
 						// CHECK ARITY
 						llvm::Value* arity_addr = builder.CreateStructGEP(objFunction_type, callee_obj_addr, 3, "arity_addr");
@@ -1602,39 +1694,15 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 						builder.CreateCondBr(comp_arity, then_arity_bb, else_arity_bb);
 						builder.SetInsertPoint(then_arity_bb);
 						// INCORRECT NUMBER OF ARGUMENTS
-						llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-						builder.CreateCall(arityError_func, {vm_, arity, argCount, pc_});
+						builder.CreateCall(arityError_func, {vm_, arity, argCount, pc});
 						builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
 
 						// CORRECT NUMBER OF ARGUMENTS
 						builder.SetInsertPoint(else_arity_bb);
+
 						llvm::Value* callee_ptr_raw_addr = builder.CreateStructGEP(objFunction_type, callee_obj_addr, 5, "callee_ptr_raw_addr");
 						llvm::Value* callee_ptr_addr = builder.CreateBitCast(callee_ptr_raw_addr, funcPtrPtr_type, "callee_ptr_addr");
-						llvm::Value* callee_addr = builder.CreateLoad(callee_ptr_addr, "callee_addr");
-						llvm::Value* status = builder.CreateCall(callee_addr, {vm_, globals, c_addr, stack_top}, "status");
-
-						// HANDLE RUNTIME ERROR
-						auto status_comp = builder.CreateICmpNE(status, builder.getInt32(static_cast<int32_t>(InterpretResult::OK)));
-						llvm::BasicBlock* then_status_bb = llvm::BasicBlock::Create(context, "then_status_bb", jit_func);
-						llvm::BasicBlock* else_status_bb = llvm::BasicBlock::Create(context, "else_status_bb", jit_func);
-						builder.CreateCondBr(status_comp, then_status_bb, else_status_bb);
-						builder.SetInsertPoint(then_status_bb);
-						builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
-						builder.SetInsertPoint(else_status_bb);
-						// GET RESULT
-						llvm::Value* temp_st = builder.CreateSub(builder.CreateLoad(stack_top), const_1, "temp_st");
-						llvm::Value* val_addr = builder.CreateInBoundsGEP(c_addr, {temp_st}, "val_addr");
-						// RECOVER STACK
-						builder.CreateStore(temp, stack_top);
-						// SAVE RESULT
-						llvm::Value* stackTop = builder.CreateLoad(stack_top, "stackTop");
-						llvm::Value* res_addr = builder.CreateInBoundsGEP(stack, {stackTop}, "res");
-						builder.CreateStore(builder.CreateLoad(val_addr, "val"), res_addr);
-						// INCREMENT STACK
-						llvm::Value* inc_stack_top = builder.CreateAdd(stackTop, const_1, "inc_stack_top");
-						builder.CreateStore(inc_stack_top, stack_top);
-
-						builder.CreateBr(end_bb);
+						emit_invoke(emit_load_entry(callee_ptr_addr));
 					}
 					builder.SetInsertPoint(else_fun_bb);
 					{
@@ -1647,17 +1715,11 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 							llvm::Value* callee_ptr_addr = builder.CreateBitCast(callee_ptr_raw_addr, nativePtrPtr_type, "callee_ptr_addr");
 							llvm::Value* callee_addr = builder.CreateLoad(callee_ptr_addr, "callee_addr");
 
-							builder.CreateCall(callNative_func, {callee_addr, const_1, c_addr, alloc_temp_3});
+							llvm::Value* args_addr = builder.CreateInBoundsGEP(c_addr, {const_1}, "args_addr");
+							builder.CreateCall(callNative_func, {callee_addr, argCount, args_addr, alloc_temp_3});
 
-							// RECOVER STACK
-							builder.CreateStore(temp, stack_top);
-							// SAVE RESULT
-							llvm::Value* stackTop = builder.CreateLoad(stack_top, "stackTop");
-							llvm::Value* res_addr = builder.CreateInBoundsGEP(stack, {stackTop}, "res");
-							builder.CreateStore(builder.CreateLoad(alloc_temp_3, "val"), res_addr);
-							// INCREMENT STACK
-							llvm::Value* inc_stack_top = builder.CreateAdd(stackTop, const_1, "inc_stack_top");
-							builder.CreateStore(inc_stack_top, stack_top);
+							// SAVE RESULT, it replaces the callee
+							builder.CreateStore(builder.CreateLoad(alloc_temp_3, "val"), regs[base]);
 
 							// finish
 							builder.CreateBr(end_bb);
@@ -1665,8 +1727,7 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 						builder.SetInsertPoint(else_nat_bb);
 						{
 							// OBJECT IS NOT CALLABLE
-							llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-							builder.CreateCall(callError_func, {vm_, pc_});
+							builder.CreateCall(callError_func, {vm_, pc});
 							// return error code
 							builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
 						}
@@ -1675,22 +1736,22 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 				builder.SetInsertPoint(else_bb);
 				{
 					// VALUE IS NOT CALLABLE
-					llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-					builder.CreateCall(callError_func, {vm_, pc_});
+					builder.CreateCall(callError_func, {vm_, pc});
 					// return error code
 					builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::RUNTIME_ERROR)));
 				}
 				builder.SetInsertPoint(end_bb);
+				reload_slots(base);
 
-				llvm::Value* pc_ = builder.CreateLoad(pc, "pc_");
-				llvm::Value* inc_pc = builder.CreateAdd(pc_, builder.getInt32(1), "inc_pc");
-				builder.CreateStore(inc_pc, pc);
 				builder.CreateBr(blocks[offset + 2]);
 				offset += 2;
 				break;
 			}
 			case OpCode::RETURN:
 			{
+				// the caller finds the result at stack[*stack_top - 1]
+				builder.CreateStore(builder.CreateLoad(regs[depth - 1], "result"), stack);
+				builder.CreateStore(const_1, stack_top);
 				builder.CreateBr(return_bb);
 				offset += 1;
 				break;
@@ -1703,5 +1764,7 @@ llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::str
 
 	builder.SetInsertPoint(return_bb);
 	builder.CreateRet(builder.getInt32(static_cast<int32_t>(InterpretResult::OK)));
+	if (di_builder)
+		di_builder->finalize();
 	return jit_func;
-}
\ No newline at end of file
+}
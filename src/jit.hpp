@@ -5,14 +5,35 @@
 #ifndef CPPLOX_JIT_HPP
 #define CPPLOX_JIT_HPP
 
+#include <string>
+#include <vector>
+
 #include <llvm/IR/Function.h>
 
 class VM;
 class Chunk;
+struct sObj;
+struct ObjFunction;
+struct Value;
+
+// The Lox objects the code generated for a function refers to, and the key
+// naming that code. JITed code does not embed object addresses: objects[i]
+// is the external symbol referenceSymbol(i), resolved when the object file is
+// linked, so the machine code can be cached and linked again by later runs.
+struct CodeReferences
+{
+	std::vector<sObj*> objects;
+	std::string key;
+};
+
+CodeReferences codeReferences(VM* vm, ObjFunction* function, uint32_t entry = 0, const Value* entry_slots = nullptr);
+std::string referenceSymbol(size_t index);
 
-llvm::Function* generate_main(llvm::Module* module, const std::string& name, llvm::StructType* value_type, llvm::PointerType* valutePtr_type);
-llvm::Function* generade_code(llvm::Module* module, Chunk* chunk, const std::string& name, llvm::GlobalValue::LinkageTypes linkage, llvm::StructType* value_type, llvm::PointerType* valutePtr_type);
-llvm::Function* generate_falsey(llvm::Module* module, llvm::StructType* value_type, llvm::PointerType* valutePtr_type);
-llvm::Function* generate_equal(llvm::Module* module, llvm::StructType* value_type, llvm::PointerType* valutePtr_type);
+llvm::Type* create_value_type(llvm::LLVMContext& context);
+void declareRuntime(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type);
+llvm::Function* generate_main(llvm::Module* module, const std::string& name, llvm::Type* value_type, llvm::PointerType* valutePtr_type);
+llvm::Function* generade_code(llvm::Module* module, VM* vm, ObjFunction* function, const CodeReferences& refs, const std::string& name, llvm::GlobalValue::LinkageTypes linkage, llvm::Type* value_type, llvm::PointerType* valutePtr_type, uint32_t entry = 0, const Value* entry_slots = nullptr);
+llvm::Function* generate_falsey(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type);
+llvm::Function* generate_equal(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type);
 
 #endif //CPPLOX_JIT_HPP
@@ -12,121 +12,155 @@
 #include <llvm/Support/DynamicLibrary.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
-#include <llvm/Analysis/TargetLibraryInfo.h>
-#include <llvm/Analysis/TargetTransformInfo.h>
+#include <llvm/Analysis/AliasAnalysis.h>
+#include <llvm/Passes/PassBuilder.h>
 #include <llvm/Transforms/IPO/AlwaysInliner.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/Scalar/GVN.h>
-#include <llvm/InitializePasses.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+
+#include <algorithm>
 
 using namespace llvm;
 
 namespace {
 
-	void addOptPasses(
-		llvm::legacy::PassManagerBase &passes,
-		llvm::legacy::FunctionPassManager &fnPasses,
-		llvm::TargetMachine *machine,
-		uint32_t opt,
-		uint32_t size
-	) {
-		llvm::PassManagerBuilder builder;
-		builder.OptLevel = opt;
-		builder.SizeLevel = size;
-		if (opt > 1)
-			builder.Inliner = llvm::createFunctionInliningPass(opt, size, false);
+	llvm::PassBuilder::OptimizationLevel optimizationLevel(const OptimizationOptions& options) {
+		if (options.size == 1)
+			return llvm::PassBuilder::OptimizationLevel::Os;
+		if (options.size > 1)
+			return llvm::PassBuilder::OptimizationLevel::Oz;
+		switch (options.level) {
+			case 0:
+				return llvm::PassBuilder::OptimizationLevel::O0;
+			case 1:
+				return llvm::PassBuilder::OptimizationLevel::O1;
+			case 2:
+				return llvm::PassBuilder::OptimizationLevel::O2;
+			default:
+				return llvm::PassBuilder::OptimizationLevel::O3;
+		}
+	}
+
+	// Fills passes with the pipeline options asks for. The default pipelines
+	// need optimizations, -O0 only inlines the always_inline runtime helpers.
+	llvm::Error buildPipeline(llvm::PassBuilder& builder, llvm::ModulePassManager& passes, const OptimizationOptions& options) {
+		if (!options.pipeline.empty())
+			return builder.parsePassPipeline(passes, options.pipeline);
+		if (options.level == 0 && options.size == 0)
+			passes.addPass(llvm::AlwaysInlinerPass());
 		else
-			builder.Inliner = llvm::createAlwaysInlinerLegacyPass();
-		builder.LoopVectorize = opt > 1 && size < 2;
-		builder.SLPVectorize = opt > 1 && size < 2;
-		machine->adjustPassManager(builder);
-
-		builder.populateFunctionPassManager(fnPasses);
-		fnPasses.add(llvm::createInstructionCombiningPass());
-		fnPasses.add(llvm::createReassociatePass());
-		fnPasses.add(llvm::createGVNPass());
-		fnPasses.add(llvm::createCFGSimplificationPass());
-		builder.populateModulePassManager(passes);
-		passes.add(llvm::createIPConstantPropagationPass());
-	}
-
-	void addLinkPasses(llvm::legacy::PassManagerBase &passes, uint32_t opt, uint32_t size) {
-		llvm::PassManagerBuilder builder;
-		builder.OptLevel = opt;
-		builder.SizeLevel = size;
-		builder.VerifyInput = true;
-		builder.Inliner = llvm::createFunctionInliningPass();
-		builder.populateLTOPassManager(passes);
-	}
-
-	void initializePasses() {
-		// Initialize passes
-		PassRegistry &Registry = *PassRegistry::getPassRegistry();
-		initializeCore(Registry);
-		//initializeCoroutines(Registry);
-		initializeScalarOpts(Registry);
-		//initializeObjCARCOpts(Registry);
-		initializeVectorization(Registry);
-		initializeIPO(Registry);
-		initializeAnalysis(Registry);
-		initializeTransformUtils(Registry);
-		initializeInstCombine(Registry);
-		initializeAggressiveInstCombine(Registry);
-		initializeInstrumentation(Registry);
-		initializeTarget(Registry);
-		// For codegen passes, only passes that do IR to IR transformation are
-		// supported.
-		initializeExpandMemCmpPassPass(Registry);
-		initializeScalarizeMaskedMemIntrinPass(Registry);
-		initializeCodeGenPreparePass(Registry);
-		initializeAtomicExpandPass(Registry);
-		initializeRewriteSymbolsLegacyPassPass(Registry);
-		initializeWinEHPreparePass(Registry);
-		initializeDwarfEHPreparePass(Registry);
-		initializeSafeStackLegacyPassPass(Registry);
-		initializeSjLjEHPreparePass(Registry);
-		initializeStackProtectorPass(Registry);
-		initializePreISelIntrinsicLoweringLegacyPassPass(Registry);
-		initializeGlobalMergePass(Registry);
-		initializeIndirectBrExpandPassPass(Registry);
-		//initializeInterleavedLoadCombinePass(Registry);
-		initializeInterleavedAccessPass(Registry);
-		initializeEntryExitInstrumenterPass(Registry);
-		initializePostInlineEntryExitInstrumenterPass(Registry);
-		initializeUnreachableBlockElimLegacyPassPass(Registry);
-		initializeExpandReductionsPass(Registry);
-		initializeWasmEHPreparePass(Registry);
-		initializeWriteBitcodePassPass(Registry);
-		//initializeHardwareLoopsPass(Registry);
-	}
-
-}
-
-void optimizeModule(llvm::TargetMachine *machine, llvm::Module *module, uint32_t opt, uint32_t size) {
-	initializePasses();
+			passes = builder.buildPerModuleDefaultPipeline(optimizationLevel(options));
+		return llvm::Error::success();
+	}
+
+}
+
+bool parseOptimizationFlag(const std::string& flag, OptimizationOptions* options) {
+	static const std::string passes_flag = "--passes=";
+	if (flag.compare(0, passes_flag.size(), passes_flag) == 0) {
+		options->pipeline = flag.substr(passes_flag.size());
+		return true;
+	}
+	if (flag.size() != 3 || flag[0] != '-' || flag[1] != 'O')
+		return false;
+	switch (flag[2]) {
+		case '0':
+		case '1':
+		case '2':
+		case '3':
+			options->level = static_cast<uint32_t>(flag[2] - '0');
+			options->size = 0;
+			return true;
+		case 's':
+			options->level = 2;
+			options->size = 1;
+			return true;
+		case 'z':
+			options->level = 2;
+			options->size = 2;
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool checkPipeline(const OptimizationOptions& options, std::string* error) {
+	llvm::PassBuilder builder;
+	llvm::ModulePassManager passes;
+	if (auto err = buildPipeline(builder, passes, options)) {
+		*error = llvm::toString(std::move(err));
+		return false;
+	}
+	return true;
+}
+
+void optimizeModule(llvm::TargetMachine *machine, llvm::Module *module, const OptimizationOptions& options) {
 	module->setTargetTriple(machine->getTargetTriple().str());
 	module->setDataLayout(machine->createDataLayout());
 
-	llvm::legacy::PassManager passes;
-	passes.add(new llvm::TargetLibraryInfoWrapperPass(machine->getTargetTriple()));
-	passes.add(llvm::createTargetTransformInfoWrapperPass(machine->getTargetIRAnalysis()));
-
-	llvm::legacy::FunctionPassManager fnPasses(module);
-	fnPasses.add(llvm::createTargetTransformInfoWrapperPass(machine->getTargetIRAnalysis()));
+	llvm::PipelineTuningOptions tuning;
+	tuning.LoopVectorization = options.level > 1 && options.size < 2;
+	tuning.SLPVectorization = options.level > 1 && options.size < 2;
+	// The target machine provides the cost model (TargetIRAnalysis), the
+	// library info is derived from the triple of the module.
+	llvm::PassBuilder builder(machine, tuning);
 
-	//if (opt > 0)
-		addLinkPasses(passes, opt, size);
-	addOptPasses(passes, fnPasses, machine, opt, size);
+	llvm::LoopAnalysisManager loop_analyses;
+	llvm::FunctionAnalysisManager function_analyses;
+	llvm::CGSCCAnalysisManager cgscc_analyses;
+	llvm::ModuleAnalysisManager module_analyses;
+	function_analyses.registerPass([&] { return builder.buildDefaultAAPipeline(); });
+	builder.registerModuleAnalyses(module_analyses);
+	builder.registerCGSCCAnalyses(cgscc_analyses);
+	builder.registerFunctionAnalyses(function_analyses);
+	builder.registerLoopAnalyses(loop_analyses);
+	builder.crossRegisterProxies(loop_analyses, function_analyses, cgscc_analyses, module_analyses);
 
-	fnPasses.doInitialization();
-	for (llvm::Function &func : *module) {
-		fnPasses.run(func);
+	llvm::ModulePassManager passes;
+	if (auto error = buildPipeline(builder, passes, options)) {
+		DIE << "Invalid pass pipeline '" << options.pipeline << "': " << llvm::toString(std::move(error));
 	}
-	fnPasses.doFinalization();
+	passes.addPass(llvm::VerifierPass());
+	passes.run(*module, module_analyses);
+}
+
+namespace {
+
+	// SectionMemoryManager that keeps a running total of the sections it
+	// allocated, so the JIT can report how much code stays resident.
+	class CountingMemoryManager : public llvm::SectionMemoryManager {
+	public:
+		explicit CountingMemoryManager(std::atomic<size_t>& total) : total_(total) {}
+
+		~CountingMemoryManager() override {
+			total_ -= size_;
+		}
+
+		uint8_t* allocateCodeSection(uintptr_t size, unsigned alignment, unsigned section_id,
+		                             llvm::StringRef section_name) override {
+			count(size);
+			return SectionMemoryManager::allocateCodeSection(size, alignment, section_id, section_name);
+		}
+
+		uint8_t* allocateDataSection(uintptr_t size, unsigned alignment, unsigned section_id,
+		                             llvm::StringRef section_name, bool read_only) override {
+			count(size);
+			return SectionMemoryManager::allocateDataSection(size, alignment, section_id, section_name, read_only);
+		}
+
+	private:
+		void count(uintptr_t size) {
+			size_ += size;
+			total_ += size;
+		}
+
+		std::atomic<size_t>& total_;
+		size_t size_ = 0;
+	};
 
-	passes.add(llvm::createVerifierPass());
-	passes.run(*module);
 }
 
 // namespace {
@@ -148,58 +182,206 @@ llvm::SmallVector<std::string, 0> DetectMachineAttributes() {
 	return result;
 }
 
-SimpleOrcJIT::SimpleOrcJIT(bool verbose)
-    : verbose_(verbose), target_machine_(EngineBuilder().selectTarget()),
+JitObjectCache::JitObjectCache(std::string directory, std::string target, const Diagnostics& diagnostics)
+	: directory_(std::move(directory)), target_(std::move(target)), diagnostics_(diagnostics) {}
+
+std::string JitObjectCache::path(const std::string& key) const {
+	// Objects only fit the LLVM version and the target that produced them.
+	llvm::SHA1 hash;
+	hash.update(LLVM_VERSION_STRING);
+	hash.update(target_);
+	hash.update(key);
+	llvm::SmallString<128> result(directory_);
+	llvm::sys::path::append(result, llvm::toHex(hash.final()) + ".o");
+	return result.str().str();
+}
+
+void JitObjectCache::notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) {
+	store(module->getModuleIdentifier(), object, diagnostics_);
+}
+
+void JitObjectCache::store(const std::string& key, llvm::MemoryBufferRef object, const Diagnostics& diagnostics) {
+	if (auto error = llvm::sys::fs::create_directories(directory_)) {
+		std::cerr << "[Object cache] cannot create " << directory_ << ": " << error.message() << "\n";
+		return;
+	}
+
+	// Other processes may read the same entry, it is written to a temporary
+	// file first and renamed into place.
+	auto final_path = path(key);
+	int fd;
+	llvm::SmallString<128> temp_path;
+	if (llvm::sys::fs::createUniqueFile(final_path + ".%%%%%%.tmp", fd, temp_path))
+		return;
+	{
+		llvm::raw_fd_ostream out(fd, true);
+		out << object.getBuffer();
+	}
+	if (llvm::sys::fs::rename(temp_path, final_path)) {
+		llvm::sys::fs::remove(temp_path);
+		return;
+	}
+	if (diagnostics.enabled(Diagnostics::LOG)) {
+		std::cout << "[Object cache] stored " << key << "\n";
+	}
+}
+
+std::unique_ptr<llvm::MemoryBuffer> JitObjectCache::getObject(const llvm::Module* module) {
+	return load(module->getModuleIdentifier());
+}
+
+std::unique_ptr<llvm::MemoryBuffer> JitObjectCache::load(const std::string& key) {
+	return load(key, diagnostics_);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> JitObjectCache::load(const std::string& key, const Diagnostics& diagnostics) {
+	auto buffer = llvm::MemoryBuffer::getFile(path(key), -1, false);
+	if (!buffer) {
+		return nullptr;
+	}
+	if (diagnostics.enabled(Diagnostics::LOG)) {
+		std::cout << "[Object cache] loaded " << key << "\n";
+	}
+	return std::move(*buffer);
+}
+
+SimpleOrcJIT::SimpleOrcJIT(const Diagnostics& diagnostics, const std::string& cache_dir)
+    : diagnostics_(diagnostics), target_machine_(EngineBuilder().selectTarget()),
       data_layout_(target_machine_->createDataLayout()),
+      object_cache_(cache_dir.empty() ? nullptr : std::make_unique<JitObjectCache>(cache_dir,
+          target_machine_->getTargetTriple().str() + " " + target_machine_->getTargetCPU().str() + " " +
+          target_machine_->getTargetFeatureString().str(), diagnostics_)),
 
-      object_layer_(execution_session_, [this](llvm::orc::VModuleKey) {
+      object_layer_(execution_session_, [this](llvm::orc::VModuleKey key) {
 		  llvm::orc::LegacyRTDyldObjectLinkingLayer::Resources result;
-		  result.MemMgr = std::make_shared<llvm::SectionMemoryManager>();
-		  result.Resolver = this->symbol_resolver_;
+		  result.MemMgr = std::make_shared<CountingMemoryManager>(code_size_);
+		  result.Resolver = create_resolver(key);
 		  return result;
+	  }, {}, [this](llvm::orc::VModuleKey key, const object::ObjectFile& object,
+	                const RuntimeDyld::LoadedObjectInfo& info) {
+		  // Relocated by now, the listeners see the code that runs.
+		  for (auto listener : event_listeners())
+			  listener->notifyObjectLoaded(key, object, info);
+	  }, [this](llvm::orc::VModuleKey key, const object::ObjectFile&) {
+		  for (auto listener : event_listeners())
+			  listener->notifyFreeingObject(key);
 	  }),
       compile_layer_(object_layer_,
-                     ObjectDumpingCompiler(*target_machine_, verbose_)) {
+                     ObjectDumpingCompiler(*target_machine_, diagnostics_, object_cache_.get())) {
   std::string error_string;
   if (llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr,
                                                         &error_string)) {
     DIE << "Failed to LoadLibraryPermanently: " << error_string;
   }
+}
 
-  if (verbose_) {
-    Triple triple = target_machine_->getTargetTriple();
-    std::cout << "JIT target machine:\n";
-    std::cout << "  triple: " << triple.str() << "\n";
-    std::cout << "  target cpu: " << target_machine_->getTargetCPU().str()
-              << "\n";
-    std::cout << "  target features: "
-              << target_machine_->getTargetFeatureString().str() << "\n";
-  }
+void SimpleOrcJIT::print_target_machine(std::ostream& out) const {
+  Triple triple = target_machine_->getTargetTriple();
+  out << "JIT target machine:\n";
+  out << "  triple: " << triple.str() << "\n";
+  out << "  target cpu: " << target_machine_->getTargetCPU().str()
+      << "\n";
+  out << "  target features: "
+      << target_machine_->getTargetFeatureString().str() << "\n";
 }
 
-void SimpleOrcJIT::add_module(std::unique_ptr<llvm::Module> module) {
-	auto key = execution_session_.allocateVModule();
+std::vector<llvm::JITEventListener*> SimpleOrcJIT::event_listeners() {
+	// Both listeners are process wide singletons. Code loaded while a sink was
+	// off is unknown to them, they ignore its release.
+	std::vector<llvm::JITEventListener*> listeners;
+	if (diagnostics_.enabled(Diagnostics::GDB)) {
+		listeners.push_back(JITEventListener::createGDBRegistrationListener());
+	}
+	if (diagnostics_.enabled(Diagnostics::PERF)) {
+		if (auto perf = JITEventListener::createPerfJITEventListener()) {
+			listeners.push_back(perf);
+		} else {
+			static bool warned = false;
+			if (!warned) {
+				std::cerr << "[perf] LLVM was built without LLVM_USE_PERF, no jitdump is written\n";
+				warned = true;
+			}
+		}
+	}
+	return listeners;
+}
 
-	symbol_resolver_ = orc::createLegacyLookupResolver(execution_session_,
-		[this](const std::string& name) -> JITSymbol {
-			if (auto sym = find_mangled_symbol(name, false))
-				return sym;
-			else if (auto Err = sym.takeError())
-				return std::move(Err);
+std::shared_ptr<llvm::orc::SymbolResolver> SimpleOrcJIT::create_resolver(llvm::orc::VModuleKey key) {
+	return orc::createLegacyLookupResolver(execution_session_,
+		[this, key](const std::string& name) -> JITSymbol {
+			auto& locals = local_symbols_[key];
+			auto local = locals.find(name);
+			if (local != locals.end())
+				return JITSymbol(local->second, JITSymbolFlags::Exported);
+			// The runtime helpers live in the process. Looking there before the
+			// other modules keeps linking a module independent of how many
+			// modules a long session (the REPL) has added already.
 			if (auto sym_addr =
 				RTDyldMemoryManager::getSymbolAddressInProcess(name)) {
 				return JITSymbol(sym_addr, JITSymbolFlags::Exported);
 			}
+			if (auto sym = find_mangled_symbol(name, false))
+				return sym;
+			else if (auto Err = sym.takeError())
+				return std::move(Err);
 			return JITSymbol(nullptr);
 		}, [](llvm::Error Err) {
 			cantFail(std::move(Err), "lookupFlags failed");
 		});
+}
+
+llvm::orc::VModuleKey SimpleOrcJIT::add_module(std::unique_ptr<llvm::Module> module, LocalSymbols locals) {
+	auto key = execution_session_.allocateVModule();
+	for (auto& local : locals)
+		local_symbols_[key][mangle(local.first)] = local.second;
 
 	cantFail(compile_layer_.addModule(key, std::move(module)));
 
 	module_keys_.push_back(key);
+	return key;
+}
+
+llvm::Optional<llvm::orc::VModuleKey> SimpleOrcJIT::add_cached_object(const std::string& key, LocalSymbols locals) {
+	if (!object_cache_)
+		return llvm::None;
+	auto object = object_cache_->load(key);
+	if (!object)
+		return llvm::None;
+	return add_object(std::move(object), std::move(locals));
+}
+
+std::unique_ptr<llvm::TargetMachine> SimpleOrcJIT::create_target_machine() {
+	return std::unique_ptr<llvm::TargetMachine>(EngineBuilder().selectTarget());
+}
+
+std::unique_ptr<llvm::MemoryBuffer> SimpleOrcJIT::compile_module(llvm::Module& module, llvm::TargetMachine& machine, const Diagnostics& diagnostics) {
+	auto object = ObjectDumpingCompiler(machine, diagnostics, object_cache_.get())(module);
+	if (!object) {
+		DIE << "Unable to compile " << module.getModuleIdentifier() << ": " << llvm::toString(object.takeError());
+	}
+	return std::move(*object);
+}
+
+llvm::orc::VModuleKey SimpleOrcJIT::add_object(std::unique_ptr<llvm::MemoryBuffer> object, LocalSymbols locals) {
+	auto module_key = execution_session_.allocateVModule();
+	for (auto& local : locals)
+		local_symbols_[module_key][mangle(local.first)] = local.second;
+
+	cantFail(object_layer_.addObject(module_key, std::move(object)));
+
+	module_keys_.push_back(module_key);
+	return module_key;
 }
 
+void SimpleOrcJIT::remove_module(llvm::orc::VModuleKey key) {
+	// Cached objects skip the compile layer, both kinds live in the object layer.
+	cantFail(object_layer_.removeObject(key));
+	local_symbols_.erase(key);
+	module_keys_.erase(std::remove(module_keys_.begin(), module_keys_.end(), key), module_keys_.end());
+	if (diagnostics_.enabled(Diagnostics::LOG)) {
+		std::cout << "[Removed module] resident code: " << code_size_ << " bytes\n";
+	}
+}
 
 llvm::JITSymbol SimpleOrcJIT::find_symbol(const std::string& name) {
 	std::string mangled_name;
@@ -208,6 +390,17 @@ llvm::JITSymbol SimpleOrcJIT::find_symbol(const std::string& name) {
 	return compile_layer_.findSymbol(name, true);
 }
 
+llvm::JITSymbol SimpleOrcJIT::find_symbol_in(llvm::orc::VModuleKey key, const std::string& name) {
+	return compile_layer_.findSymbolIn(key, mangle(name), true);
+}
+
+std::string SimpleOrcJIT::mangle(const std::string& name) {
+	std::string mangled_name;
+	raw_string_ostream mangled_name_stream(mangled_name);
+	Mangler::getNameWithPrefix(mangled_name_stream, name, data_layout_);
+	return mangled_name_stream.str();
+}
+
 llvm::JITSymbol SimpleOrcJIT::find_mangled_symbol(const std::string& name, bool exported_symbols_only) {
 
   // Search modules in reverse order: from last added to first added.
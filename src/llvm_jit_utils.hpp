@@ -5,10 +5,16 @@
 #ifndef LLVM_JIT_UTILS_H
 #define LLVM_JIT_UTILS_H
 
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <string>
 #include <vector>
 
+#include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/ADT/Optional.h>
 #include <llvm/ExecutionEngine/Orc/CompileUtils.h>
 #include <llvm/ExecutionEngine/Orc/IRCompileLayer.h>
 #include <llvm/ExecutionEngine/Orc/LambdaResolver.h>
@@ -22,55 +28,81 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/DynamicLibrary.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
-#include <llvm/Transforms/Scalar.h>
-#include <llvm/Transforms/IPO.h>
-#include <llvm/Transforms/Utils.h>
-//#include <llvm/Transforms/>
 
+#include "diagnostics.hpp"
 #include "utils.hpp"
 
-void optimizeModule(llvm::TargetMachine *machine, llvm::Module *module, uint32_t opt, uint32_t size);
+// How optimizeModule transforms a module before its code is generated. level
+// and size pick one of LLVM's default pipelines (-O0 to -O3, -Os is size 1
+// and -Oz size 2). A non empty pipeline replaces it with a pipeline of the new
+// pass manager in the syntax of opt -passes, for instance
+// "default<O2>,function(loop(loop-interchange))".
+struct OptimizationOptions {
+	uint32_t level = 3;
+	uint32_t size = 0;
+	std::string pipeline;
+};
 
-static inline void OptPass(const llvm::PassManagerBuilder &builder, llvm::legacy::PassManagerBase &pm) {
-	//if (builder.OptLevel > 2 && builder.SizeLevel == 0)
-	{
-		pm.add(llvm::createPromoteMemoryToRegisterPass());
-	}
-}
-
-static inline void addMyLoopPass(const llvm::PassManagerBuilder &builder, llvm::legacy::PassManagerBase &pm) {
-	//if (builder.OptLevel > 2 && builder.SizeLevel == 0)
-	{
-		pm.add(llvm::createIndVarSimplifyPass());
-		pm.add(llvm::createLoopInstSimplifyPass());
-		pm.add(llvm::createLoopSimplifyCFGPass());
-		pm.add(llvm::createLoopInterchangePass());
-		pm.add(llvm::createLoopRotatePass());
-		pm.add(llvm::createSimpleLoopUnrollPass(builder.OptLevel));
-	}
-}
+// Parses a command line flag selecting the optimization (-O0 .. -O3, -Os, -Oz
+// or --passes=<pipeline>) into options. Returns false for any other flag.
+bool parseOptimizationFlag(const std::string& flag, OptimizationOptions* options);
 
-static inline void addStrengthReductionPass(const llvm::PassManagerBuilder &builder, llvm::legacy::PassManagerBase &pm) {
-	//if (builder.OptLevel > 2 && builder.SizeLevel == 0)
-	{
-		pm.add(llvm::createLoopStrengthReducePass());
-		pm.add(llvm::createLoopDeletionPass());
-	}
-}
+// Whether the pipeline of options can be built, error explains why not.
+bool checkPipeline(const OptimizationOptions& options, std::string* error);
+
+void optimizeModule(llvm::TargetMachine *machine, llvm::Module *module, const OptimizationOptions& options);
+
+// Keeps the object files of compiled modules in a directory so later runs
+// can link them instead of generating and optimizing the IR again. Objects are
+// stored under a hash of the module identifier and the target, the identifier
+// has to name the code (see codeReferences).
+class JitObjectCache : public llvm::ObjectCache {
+public:
+	JitObjectCache(std::string directory, std::string target, const Diagnostics& diagnostics);
+
+	void notifyObjectCompiled(const llvm::Module* module, llvm::MemoryBufferRef object) override;
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* module) override;
+
+	// The object stored under key, or nullptr.
+	std::unique_ptr<llvm::MemoryBuffer> load(const std::string& key);
 
+	// load and notifyObjectCompiled reporting to diagnostics instead of the
+	// ones the cache was made with, for threads that work on a copy.
+	std::unique_ptr<llvm::MemoryBuffer> load(const std::string& key, const Diagnostics& diagnostics);
+	void store(const std::string& key, llvm::MemoryBufferRef object, const Diagnostics& diagnostics);
+
+private:
+	std::string path(const std::string& key) const;
+
+	std::string directory_;
+	std::string target_;
+	const Diagnostics& diagnostics_;
+};
 
 // ObjectDumpingCompiler is a copycat of Orc JIT's SimpleCompiler, with added
 // dumping of the generated object file so we can inspect the final machine code
 // produced by LLVM. Note that no IR-level optimizations are performed here.
-// Dumping happens only in verbose mode (when verbose=true) in the constructor.
+// Dumping happens only when diagnostics enables the obj sink, the file is
+// named after the source file name of the module. Like SimpleCompiler, it
+// asks cache (if any) first and fills it on a miss.
 class ObjectDumpingCompiler {
 	using CompileResult = llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>;
 public:
-	ObjectDumpingCompiler(llvm::TargetMachine& target_machine, bool verbose)
-			: target_machine_(target_machine), verbose_(verbose) {}
+	ObjectDumpingCompiler(llvm::TargetMachine& target_machine, const Diagnostics& diagnostics, JitObjectCache* cache = nullptr)
+			: target_machine_(target_machine), diagnostics_(diagnostics), cache_(cache) {}
 
 	CompileResult operator()(llvm::Module& module) const {
+		if (cache_) {
+			if (auto cached = cache_->load(module.getModuleIdentifier(), diagnostics_)) {
+				return std::move(cached);
+			}
+		}
+
+		llvm::Optional<Timer> tcodegen;
+		if (diagnostics_.enabled(Diagnostics::TIMING)) {
+			tcodegen.emplace();
+		}
+
 		llvm::SmallVector<char, 0> obj_buffer_vec;
 		llvm::raw_svector_ostream obj_stream(obj_buffer_vec);
 
@@ -81,6 +113,9 @@ public:
 		}
 		pass_manager.run(module);
 		auto obj_buffer = std::make_unique<llvm::SmallVectorMemoryBuffer>(std::move(obj_buffer_vec));
+		if (tcodegen) {
+			std::cout << "[Code generation] " << module.getSourceFileName() << " in " << tcodegen->elapsed() << "s\n";
+		}
 
 		llvm::Expected<std::unique_ptr<llvm::object::ObjectFile>> obj =
 				llvm::object::ObjectFile::createObjectFile(obj_buffer->getMemBufferRef());
@@ -91,7 +126,7 @@ public:
 		//
 		// LLVM represents the object in memory as an ELF image. To dump the code,
 		// we iterate to find the text section and emit its contents.
-		if (verbose_) {
+		if (obj && diagnostics_.enabled(Diagnostics::OBJECT)) {
 			bool found_text_section = false;
 			for (auto& section : (*obj)->sections()) {
 				if (section.isText()) {
@@ -104,8 +139,8 @@ public:
 
 					auto sr = section.getContents();
 					if (sr) {
-						const char* filename = "llvmjit-out.bin";
-						FILE* outfile = fopen(filename, "wb");
+						auto filename = diagnostics_.path(module.getSourceFileName() + ".bin");
+						FILE* outfile = fopen(filename.c_str(), "wb");
 						if (outfile) {
 							size_t n = sr->size();
 							if (fwrite(sr->data(), 1, n, outfile) == n) {
@@ -119,6 +154,9 @@ public:
 		}
 
 		if (obj) {
+			if (cache_) {
+				cache_->store(module.getModuleIdentifier(), obj_buffer->getMemBufferRef(), diagnostics_);
+			}
 			return std::move(obj_buffer);
 		}
 
@@ -127,34 +165,72 @@ public:
 
 private:
 	llvm::TargetMachine& target_machine_;
-	bool verbose_;
+	const Diagnostics& diagnostics_;
+	JitObjectCache* cache_;
 };
 
 // A type encapsulating simple Orc JIT functionality. Loosely based on the
-// KaleidoscopeJIT example in the LLVM tree. Doesn't support cross-module
-// symbol resolution; this JIT is best used with just a single module.
+// KaleidoscopeJIT example in the LLVM tree. Modules are compiled as they are
+// added; the VM decides when a function is worth adding.
+// Every module (or cached object) is linked with its own local symbols, which
+// take precedence over the symbols of other modules and of the process.
 class SimpleOrcJIT {
 public:
-  // Initialize the JIT. In verbose mode extra information will be dumped. The
-  // JIT is created with a default target machine.
-  SimpleOrcJIT(bool verbose);
+  // Unmangled name to address of the symbols only one module refers to.
+  using LocalSymbols = std::map<std::string, llvm::JITTargetAddress>;
+
+  // Initialize the JIT. It reports its work to the sinks diagnostics enables,
+  // which has to outlive it. The JIT is created with a default target machine.
+  // A non empty cache_dir keeps the compiled objects there (see
+  // JitObjectCache).
+  SimpleOrcJIT(const Diagnostics& diagnostics, const std::string& cache_dir = "");
 
   // Get access to the target machine used by the JIT.
   llvm::TargetMachine& get_target_machine() {
     return *target_machine_;
   }
 
+  // Print the triple, CPU and features of the target machine to out.
+  void print_target_machine(std::ostream& out) const;
+
   // Add an LLVM module to the JIT. The JIT takes ownership.
-  void add_module(std::unique_ptr<llvm::Module> module);
+  llvm::orc::VModuleKey add_module(std::unique_ptr<llvm::Module> module, LocalSymbols locals = {});
+
+  // Add the object the cache holds for the module identified by key, if any.
+  // This skips IR generation, optimization and code generation altogether.
+  llvm::Optional<llvm::orc::VModuleKey> add_cached_object(const std::string& key, LocalSymbols locals = {});
+
+  // Create a target machine like the one of the JIT. Threads that optimize or
+  // compile modules at the same time need one each.
+  std::unique_ptr<llvm::TargetMachine> create_target_machine();
+
+  // Generate the object code of an optimized module with machine, through the
+  // object cache, reporting to diagnostics. Unlike the other members this only
+  // touches the arguments, several threads can call it at once.
+  std::unique_ptr<llvm::MemoryBuffer> compile_module(llvm::Module& module, llvm::TargetMachine& machine, const Diagnostics& diagnostics);
+
+  // Add object code generated by compile_module.
+  llvm::orc::VModuleKey add_object(std::unique_ptr<llvm::MemoryBuffer> object, LocalSymbols locals = {});
+
+  // Remove the module (or cached object) added as key and free its code. No
+  // code of that module may run afterwards.
+  void remove_module(llvm::orc::VModuleKey key);
+
+  // Bytes of code and data sections the loaded modules occupy.
+  size_t code_size() const {
+    return code_size_;
+  }
 
   // Find a symbol in JITed code. name is plain, unmangled. SimpleOrcJIT will
   // mangle it internally.
   llvm::JITSymbol find_symbol(const std::string& name);
 
+  // Find a symbol defined by the module added as key.
+  llvm::JITSymbol find_symbol_in(llvm::orc::VModuleKey key, const std::string& name);
+
 private:
-  // This sample doesn't implement on-request or lazy compilation. It therefore
-  // uses Orc's eager compilation layer directly - IRCompileLayer. It also uses
-  // the basis object layer - ObjectLinkingLayer - directly.
+  // Modules are compiled by Orc's eager compilation layer - IRCompileLayer -
+  // on top of the basis object layer - ObjectLinkingLayer.
   using ObjLayerT = llvm::orc::LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = llvm::orc::LegacyIRCompileLayer<ObjLayerT, ObjectDumpingCompiler>;
 
@@ -162,12 +238,24 @@ private:
   // Helper method to look for symbols that already have mangled names.
   llvm::JITSymbol find_mangled_symbol(const std::string& name, bool exported_symbols_only = true);
 
-  bool verbose_;
+  std::string mangle(const std::string& name);
+
+  // Resolves the external symbols of the module added as key.
+  std::shared_ptr<llvm::orc::SymbolResolver> create_resolver(llvm::orc::VModuleKey key);
+
+  // The listeners (perf, GDB) the diagnostics register loaded code with.
+  std::vector<llvm::JITEventListener*> event_listeners();
+
+  const Diagnostics& diagnostics_;
+  // Updated by the memory manager of every module. It has to outlive
+  // object_layer_, which destroys them.
+  std::atomic<size_t> code_size_{0};
 
   std::unique_ptr<llvm::TargetMachine> target_machine_;
   const llvm::DataLayout data_layout_;
+  std::unique_ptr<JitObjectCache> object_cache_;
   llvm::orc::ExecutionSession execution_session_;
-  std::shared_ptr<llvm::orc::SymbolResolver> symbol_resolver_;
+  std::map<llvm::orc::VModuleKey, LocalSymbols> local_symbols_;
   ObjLayerT object_layer_;
   CompileLayerT compile_layer_;
   std::vector<llvm::orc::VModuleKey> module_keys_;
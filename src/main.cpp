@@ -1,24 +1,65 @@
+#include <cstdlib>
 #include <iostream>
 #include "Lox.hpp"
 #include "scanner.hpp"
 #include "chunk.hpp"
 
+// --gc-pause=<ms>, the longest the collector runs at a time.
+static bool parseGcFlag(const std::string& flag, double* pauseTarget)
+{
+	static const std::string pause_flag = "--gc-pause=";
+	if (flag.compare(0, pause_flag.size(), pause_flag) != 0)
+		return false;
+	auto value = flag.c_str() + pause_flag.size();
+	char* end = nullptr;
+	auto milliseconds = std::strtod(value, &end);
+	if (end == value || *end != '\0' || !(milliseconds > 0.0))
+		return false;
+	*pauseTarget = milliseconds;
+	return true;
+}
+
 int main(int argc, const char **argv)
 {
-	std::cout << sizeof(Chunk) << std::endl;
-	std::cout << alignof(Chunk) << std::endl;
+	// Optimization, diagnostics and collector flags come before the other
+	// arguments.
+	OptimizationOptions optimization;
+	auto diagnostics = Diagnostics::fromEnvironment();
+	double gcPause = GC_PAUSE_TARGET;
+	auto arg = 1;
+	while (arg < argc && (parseOptimizationFlag(argv[arg], &optimization) || parseDiagnosticsFlag(argv[arg], &diagnostics) ||
+	                      parseGcFlag(argv[arg], &gcPause)))
+		arg++;
+	std::string error;
+	if (!checkPipeline(optimization, &error))
+	{
+		std::cerr << "Invalid pass pipeline '" << optimization.pipeline << "': " << error << std::endl;
+		exit(64);
+	}
+	Lox::setOptimization(optimization);
+	Lox::setDiagnostics(diagnostics);
+	Lox::setGcPauseTarget(gcPause);
 
-	if (argc == 1)
+	auto args = argc - arg;
+	if (args == 0)
 	{
 		Lox::repl();
 	}
-	else if (argc == 2)
+	else if (args == 1)
+	{
+		Lox::runFile(argv[arg]);
+	}
+	else if (args == 3 && std::string(argv[arg]) == "--emit-obj")
 	{
-		Lox::runFile(argv[1]);
+		Lox::compileFile(argv[arg + 2], argv[arg + 1]);
 	}
 	else
 	{
-		std::cerr << "Usage: CppLox [path]" << std::endl;
+		std::cerr << "Usage: CppLox [options] [path]" << std::endl;
+		std::cerr << "       CppLox [options] --emit-obj <output.o> <path>" << std::endl;
+		std::cerr << "Options: -O0|-O1|-O2|-O3|-Os|-Oz, --passes=<pipeline>," << std::endl;
+		std::cerr << "         --jit-dump=<log,host,ir,opt-ir,obj,timing,perf,gdb|all>, --jit-dump-dir=<dir>," << std::endl;
+		std::cerr << "         --gc-pause=<ms>" << std::endl;
 		exit(64);
 	}
 
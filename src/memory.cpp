@@ -2,40 +2,417 @@
 // Created by juanb on 30/09/2018.
 //
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <new>
+
 #include "memory.hpp"
 #include "vm.hpp"
 #include "object.hpp"
 
+// Runs the cycle under way to the end, or a whole new one.
+void Memory::collectGarbage(VM *vm)
+{
+	auto start = Clock::now();
+	if (vm->m_gcPhase == GcPhase::IDLE)
+		startCycle(vm);
+	advance(vm, Clock::time_point::max());
+
+	auto pause = recordPause(vm, start);
+#ifdef DEBUG_LOG_GC
+	std::cerr << "-- gc: collected in " << pause << " ms" << std::endl;
+#else
+	(void)pause;
+#endif
+}
+
+// Marks or sweeps until the pause target of the VM is reached. The next
+// increment comes after GC_STEP_SIZE more bytes, or at a back edge once the
+// program ran as long as the collector.
+void Memory::collectStep(VM *vm)
+{
+	auto start = Clock::now();
+	auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<double, std::milli>(vm->m_gcPauseTarget));
+	if (vm->m_gcPhase == GcPhase::IDLE)
+		startCycle(vm);
+	advance(vm, deadline);
+	if (vm->m_gcPhase != GcPhase::IDLE)
+		vm->m_nextGC = vm->m_bytesAllocated + GC_STEP_SIZE;
+	vm->m_gcStats.increments++;
+
+	auto pause = recordPause(vm, start);
+#ifdef DEBUG_LOG_GC
+	std::cerr << "-- gc step: " << pause << " ms" << std::endl;
+#else
+	(void)pause;
+#endif
+}
+
+void Memory::safepoint(VM *vm)
+{
+#ifdef DEBUG_STRESS_GC
+	collectGarbage(vm);
+#else
+	if (vm->m_gcPhase == GcPhase::IDLE)
+	{
+		vm->m_safepointRequested = 0;
+		return;
+	}
+	auto sinceLastPause = std::chrono::duration<double, std::milli>(Clock::now() - vm->m_lastGcPause).count();
+	if (sinceLastPause >= vm->m_gcPauseTarget)
+		collectStep(vm);
+#endif
+}
+
+void Memory::collectNursery(VM *vm)
+{
+	auto start = Clock::now();
+	auto promoted = vm->m_gcStats.bytesPromoted;
+	evacuateNursery(vm);
+	vm->m_gcStats.minorCollections++;
+
+	auto pause = recordPause(vm, start);
+#ifdef DEBUG_LOG_GC
+	std::cerr << "-- minor gc: promoted " << vm->m_gcStats.bytesPromoted - promoted << " bytes in " << pause << " ms" << std::endl;
+#else
+	(void)promoted;
+	(void)pause;
+#endif
+}
+
+// Grays the roots. The cycle keeps everything reachable when it started
+// without a barrier on most stores, because of three things:
+// - every root is grayed here at once, so overwriting a stack slot or a
+//   global afterwards loses nothing,
+// - objects made while marking runs are marked (see track),
+// - the strings createString finds in the intern table are shaded, they may
+//   have been unreachable when the cycle started.
+// Chunk constants are only appended, with values of this kind. The one
+// reference of a heap object ever overwritten, the name of a function being
+// compiled, goes through writeBarrier.
+void Memory::startCycle(VM *vm)
+{
+	evacuateNursery(vm);
+	vm->m_gcPhase = GcPhase::MARKING;
+	markRoots(vm);
+	vm->m_safepointRequested = 1;
+}
+
+void Memory::advance(VM *vm, Clock::time_point deadline)
+{
+	if (vm->m_gcPhase == GcPhase::MARKING)
+	{
+		if (!traceReferences(vm, deadline))
+			return;
+		finishMarking(vm);
+	}
+	if (sweep(vm, deadline))
+		finishCycle(vm);
+}
+
+// The intern table is weak, its entries go with their strings. Entries
+// createString is about to fill are still null. The young strings are not
+// marked, evacuateNursery takes care of theirs.
+void Memory::finishMarking(VM *vm)
+{
+	for (auto &[text, string] : vm->m_strings)
+	{
+		if (!string || (!string->isMarked && !isYoung(vm, string)))
+			vm->m_strings.erase(text);
+	}
+	vm->m_gcPhase = GcPhase::SWEEPING;
+	vm->m_sweepLink = &vm->m_objects;
+}
+
+void Memory::finishCycle(VM *vm)
+{
+	vm->m_gcPhase = GcPhase::IDLE;
+	vm->m_sweepLink = nullptr;
+	vm->m_nextGC = std::max<size_t>(vm->m_bytesAllocated * GC_HEAP_GROW_FACTOR, GC_INITIAL_THRESHOLD);
+	vm->m_gcStats.collections++;
+#ifdef SLAB_ALLOCATION
+	// The heap grows up to GC_HEAP_GROW_FACTOR times what is alive before the
+	// next cycle, into the pages left empty first.
+	vm->m_stringPool.trim(GC_HEAP_GROW_FACTOR - 1);
+	vm->m_functionPool.trim(GC_HEAP_GROW_FACTOR - 1);
+	vm->m_nativePool.trim(GC_HEAP_GROW_FACTOR - 1);
+#endif
+#ifndef DEBUG_STRESS_GC
+	vm->m_safepointRequested = 0;
+#endif
+#ifdef DEBUG_LOG_GC
+	std::cerr << "-- gc: cycle done, " << vm->m_bytesAllocated << " bytes live, next at " << vm->m_nextGC << std::endl;
+#ifdef SLAB_ALLOCATION
+	std::cerr << "-- heap: strings " << vm->m_stringPool.occupancy() << ", functions " << vm->m_functionPool.occupancy()
+	          << ", natives " << vm->m_nativePool.occupancy() << std::endl;
+#endif
+#endif
+}
+
+// Adds the pause that began at start to the statistics, returns its length
+// in milliseconds.
+double Memory::recordPause(VM *vm, Clock::time_point start)
+{
+	vm->m_lastGcPause = Clock::now();
+	auto length = vm->m_lastGcPause - start;
+	auto pause = std::chrono::duration<double, std::milli>(length).count();
+	auto micros = std::chrono::duration_cast<std::chrono::microseconds>(length).count();
+
+	auto &stats = vm->m_gcStats;
+	stats.totalPause += pause;
+	stats.maxPause = std::max(stats.maxPause, pause);
+	size_t bucket = 0;
+	while (bucket + 1 < GcStats::PAUSE_BUCKETS && micros >= (1ll << bucket))
+		bucket++;
+	stats.pauses[bucket]++;
+	return pause;
+}
+
+bool Memory::isYoung(VM *vm, const sObj *obj)
+{
+	auto address = reinterpret_cast<uintptr_t>(obj);
+	return address >= reinterpret_cast<uintptr_t>(vm->m_nursery.get()) &&
+		address < reinterpret_cast<uintptr_t>(vm->m_nurseryEnd);
+}
+
+// Replaces a young string in value by its copy in the heap, made the first
+// time it is reached. The young one keeps the address of the copy in next,
+// which only heap objects use, and is marked.
+void Memory::promote(VM *vm, Value &value)
+{
+	if (!value.isObj() || !isYoung(vm, value.asObj()))
+		return;
+
+	auto young = value.asObjString();
+	if (!young->isMarked)
+	{
+		auto promoted = allocate<ObjString>(vm, std::move(young->value));
+		track(vm, promoted);
+		vm->m_gcStats.bytesPromoted += objectSize(promoted);
+		young->isMarked = true;
+		young->next = promoted;
+	}
+	value = Value::Object(young->next);
+}
+
+// The roots of the nursery are the stack and the globals. Heap objects only
+// refer to the strings of the compiler, which createString never returns
+// young, so nothing has to record stores into the heap.
+void Memory::evacuateNursery(VM *vm)
+{
+	for (auto slot = &vm->m_stack.get(0); slot < vm->m_stack.getTop(); ++slot)
+		promote(vm, *slot);
+	for (auto &global : vm->m_globalValues)
+		promote(vm, global);
+	// The entries of the intern table for young strings, looked up from the
+	// nursery, which is much smaller than the table.
+	for (auto slot = vm->m_nursery.get(); slot < vm->m_nurseryTop; ++slot)
+	{
+		auto young = std::launder(reinterpret_cast<ObjString *>(slot));
+		auto promoted = young->isMarked ? static_cast<ObjString *>(young->next) : nullptr;
+		auto entry = vm->m_strings.find(promoted ? promoted->value : young->value);
+		if (entry == vm->m_strings.end() || entry->second != young)
+			continue;
+		if (promoted)
+			entry->second = promoted;
+		else
+			vm->m_strings.erase(young->value);
+	}
+	emptyNursery(vm);
+}
+
+void Memory::emptyNursery(VM *vm)
+{
+	for (auto slot = vm->m_nursery.get(); slot < vm->m_nurseryTop; ++slot)
+		std::launder(reinterpret_cast<ObjString *>(slot))->~ObjString();
+	vm->m_nurseryTop = vm->m_nursery.get();
+	vm->m_nurseryBytes = 0;
+}
+
 void Memory::freeObjects(VM *vm)
 {
+	emptyNursery(vm);
+	vm->m_gcPhase = GcPhase::IDLE;
 	auto object = vm->m_objects;
 	while (object)
 	{
 		auto next = object->next;
-		destroyObject(object);
+		destroyObject(vm, object);
 		object = next;
 	}
+	vm->m_objects = nullptr;
+}
 
+// What an object counts for in m_bytesAllocated. Strings do not change once
+// created, the size is the same when they are freed.
+size_t Memory::objectSize(const sObj *obj)
+{
+	switch (obj->type)
+	{
+		case ObjType::FUNCTION:
+			return sizeof(ObjFunction);
+		case ObjType::NATIVE:
+			return sizeof(ObjNative);
+		case ObjType::STRING:
+			return sizeof(ObjString) + static_cast<const ObjString *>(obj)->value.capacity();
+	}
+	return 0;
+}
+
+void Memory::markValue(VM *vm, Value value)
+{
+	if (value.isObj())
+		markObject(vm, value.asObj());
 }
 
-void Memory::destroyObject(sObj *obj)
+void Memory::markObject(VM *vm, sObj *obj)
 {
+	if (obj == nullptr || obj->isMarked)
+		return;
+	obj->isMarked = true;
+	vm->m_grayStack.push_back(obj);
+}
+
+// Everything the VM reaches without going through another object. Slots
+// above the top of the stack are stale, the interpreters move the top over
+// every live slot before they allocate. Native frames are on the stack too:
+// JITed code spills its live slots at every safepoint, and the runtime
+// function it calls moves the top to the end of its frame.
+void Memory::markRoots(VM *vm)
+{
+	for (auto slot = &vm->m_stack.get(0); slot < vm->m_stack.getTop(); ++slot)
+		markValue(vm, *slot);
+	for (uint32_t i = 0; i < vm->m_frameCount; ++i)
+		markObject(vm, vm->m_frames[i].function);
+	for (auto &global : vm->m_globalValues)
+		markValue(vm, global);
+	// The functions being compiled, the innermost first.
+	for (auto scope = vm->m_compiler.m_current; scope != nullptr; scope = scope->enclosing)
+		markObject(vm, scope->function);
+#ifdef BACKGROUND_COMPILATION
+	// A compile thread works on their code, installCompiled writes to them.
+	for (auto &pending : vm->m_compiling)
+	{
+		markObject(vm, pending.function);
+		markReferences(vm, &pending.references);
+	}
+#endif
+#ifndef LOX_AOT_RUNTIME
+	// Native frames may still run retired code and the script module, whose
+	// functions can be gone already.
+	for (auto key : vm->m_retiredModules)
+		markReferences(vm, vm->moduleReferences(key));
+	if (vm->m_scriptModule != 0)
+		markReferences(vm, vm->moduleReferences(vm->m_scriptModule));
+#endif
+}
+
+// A direct call only compares the callee with the function it was compiled
+// against, that function must not be freed (and its address reused) while
+// code refers to it.
+void Memory::markReferences(VM *vm, const std::vector<sObj *> *objects)
+{
+	if (objects == nullptr)
+		return;
+	for (auto object : *objects)
+		markObject(vm, object);
+}
+
+// Marks what the marked objects refer to, until nothing new is reached or
+// the deadline passes. Returns whether marking is done.
+bool Memory::traceReferences(VM *vm, Clock::time_point deadline)
+{
+	size_t work = 0;
+	while (!vm->m_grayStack.empty())
+	{
+		if (work >= WORK_PER_CLOCK_READ)
+		{
+			if (Clock::now() >= deadline)
+				return false;
+			work = 0;
+		}
+		auto obj = vm->m_grayStack.back();
+		vm->m_grayStack.pop_back();
+		work++;
+		if (obj->type != ObjType::FUNCTION)
+			continue;
+
+		// The register form only holds copies of the constants.
+		auto function = static_cast<ObjFunction *>(obj);
+		markObject(vm, function->name);
+		for (size_t i = 0; i < function->chunk.constantsSize(); ++i)
+			markValue(vm, function->chunk.getConstant(i));
+		work += function->chunk.constantsSize();
+#ifndef LOX_AOT_RUNTIME
+		auto modules = vm->m_jitModules.find(function);
+		if (modules != vm->m_jitModules.end())
+		{
+			for (auto key : modules->second)
+				markReferences(vm, vm->moduleReferences(key));
+		}
+#endif
+	}
+	return true;
+}
+
+// Frees the unmarked objects of m_objects and clears the mark of the others,
+// from the sweep link on, until the end of the list or the deadline. Returns
+// whether the end was reached. The objects of an AOT image are not in the
+// list, they keep their mark and live as long as the executable.
+bool Memory::sweep(VM *vm, Clock::time_point deadline)
+{
+	auto before = vm->m_bytesAllocated;
+	size_t work = 0;
+	auto link = vm->m_sweepLink;
+	while (*link)
+	{
+		if (++work >= WORK_PER_CLOCK_READ)
+		{
+			if (Clock::now() >= deadline)
+				break;
+			work = 0;
+		}
+		auto object = *link;
+		if (object->isMarked)
+		{
+			object->isMarked = false;
+			link = &object->next;
+			continue;
+		}
+		*link = object->next;
+		destroyObject(vm, object);
+	}
+	vm->m_sweepLink = link;
+	vm->m_gcStats.bytesFreed += before - vm->m_bytesAllocated;
+	return *link == nullptr;
+}
+
+void Memory::destroyObject(VM *vm, sObj *obj)
+{
+	vm->m_bytesAllocated -= objectSize(obj);
 	switch (obj->type)
 	{
 		case ObjType::FUNCTION: {
 			auto function = static_cast<ObjFunction *>(obj);
+#ifndef LOX_AOT_RUNTIME
+			// Nothing runs its code anymore, and a function allocated at the
+			// same address must not find it.
+			vm->retireCode(function);
+			vm->m_jitModules.erase(function);
+#endif
 			function->function = nullptr;
-			delete function;
+			release(vm, function);
 			break;
 		}
 		case ObjType::NATIVE: {
-			delete static_cast<ObjNative *>(obj);
+			release(vm, static_cast<ObjNative *>(obj));
 			break;
 		}
 		case ObjType::STRING: {
-			delete static_cast<ObjString *>(obj);
+			release(vm, static_cast<ObjString *>(obj));
 			break;
 		}
 	}
 }
-
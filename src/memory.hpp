@@ -5,7 +5,11 @@
 #ifndef CPPLOX_MEMORY_HPP
 #define CPPLOX_MEMORY_HPP
 
+#include <chrono>
+#include <vector>
+
 #include "object.hpp"
+#include "slab.hpp"
 
 struct sObj;
 class VM;
@@ -17,11 +21,64 @@ public:
 	static _T* createObject(VM *vm, _Types ... args);
 	static ObjString* createString(VM *vm, const std::string &str);
 	static ObjString* createString(VM *vm, std::string_view str);
+	// Like createString, in the nursery. For the results of concatenation,
+	// which mostly die right away. Young strings move when they survive, no
+	// pointer to one is kept across an allocation but in a root.
+	// There is no write barrier for the nursery: no heap object may ever refer
+	// to a young string. Only the stack and the globals do, and collectNursery
+	// scans them as its roots. createString never returns a young string, so
+	// chunk constants and function names stay old.
+	static ObjString* createYoungString(VM *vm, const std::string &str);
+	static bool isYoung(VM *vm, const sObj *obj);
 	static ObjFunction* createFunction(VM *vm);
 	static ObjNative* createNative(VM *vm, NativeFn function);
+	// Frees every object the VM cannot reach anymore, finishing the running
+	// cycle or running a new one at once.
+	static void collectGarbage(VM *vm);
+	// Does the next increment of the running cycle, or starts one.
+	static void collectStep(VM *vm);
+	// Reached at back edges while the VM asks for a safepoint, with the live
+	// values of the frame on the stack.
+	static void safepoint(VM *vm);
+	// To call before the name of a function is overwritten, the only
+	// reference of a heap object that ever is (see startCycle). Marks what it
+	// referred to while marking runs. A new store of that kind needs it too.
+	static void writeBarrier(VM *vm, sObj *previous);
+	// Moves the young strings the VM can reach to the heap and empties the
+	// nursery.
+	static void collectNursery(VM *vm);
 	static void freeObjects(VM *vm);
 private:
-	static void destroyObject(sObj *obj);
+	using Clock = std::chrono::steady_clock;
+	// Objects scanned or swept between two reads of the clock.
+	static constexpr size_t WORK_PER_CLOCK_READ = 256;
+
+	template <typename _T, typename ... _Types>
+	static _T* allocate(VM *vm, _Types&& ... args);
+	template <typename _T>
+	static void release(VM *vm, _T *obj);
+#ifdef SLAB_ALLOCATION
+	template <typename _T>
+	static SlabPool<_T>& pool(VM *vm);
+#endif
+	static void track(VM *vm, sObj *obj);
+	static void shade(VM *vm, sObj *obj);
+	static void startCycle(VM *vm);
+	static void advance(VM *vm, Clock::time_point deadline);
+	static void finishMarking(VM *vm);
+	static void finishCycle(VM *vm);
+	static double recordPause(VM *vm, Clock::time_point start);
+	static void promote(VM *vm, Value &value);
+	static void evacuateNursery(VM *vm);
+	static void emptyNursery(VM *vm);
+	static size_t objectSize(const sObj *obj);
+	static void markValue(VM *vm, Value value);
+	static void markObject(VM *vm, sObj *obj);
+	static void markRoots(VM *vm);
+	static void markReferences(VM *vm, const std::vector<sObj *> *objects);
+	static bool traceReferences(VM *vm, Clock::time_point deadline);
+	static bool sweep(VM *vm, Clock::time_point deadline);
+	static void destroyObject(VM *vm, sObj *obj);
 };
 
 #include "memory.inl"
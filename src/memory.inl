@@ -1,12 +1,92 @@
+#include <new>
+#include <utility>
+
 #include "vm.hpp"
 
 template<typename _T, typename... _Types>
 _T* Memory::createObject(VM *vm, _Types... args)
 {
-	auto obj = new _T(args...);
+#ifdef DEBUG_STRESS_GC
+	collectGarbage(vm);
+#else
+	if (vm->m_bytesAllocated > vm->m_nextGC)
+		collectStep(vm);
+#endif
+	auto obj = allocate<_T>(vm, args...);
+	track(vm, obj);
+	return obj;
+}
+
+// The memory of an object of the heap, from its pool.
+template<typename _T, typename... _Types>
+_T* Memory::allocate(VM *vm, _Types&&... args)
+{
+#ifdef SLAB_ALLOCATION
+	return pool<_T>(vm).create(std::forward<_Types>(args)...);
+#else
+	(void)vm;
+	return new _T(std::forward<_Types>(args)...);
+#endif
+}
+
+template<typename _T>
+void Memory::release(VM *vm, _T *obj)
+{
+#ifdef SLAB_ALLOCATION
+	pool<_T>(vm).destroy(obj);
+#else
+	(void)vm;
+	delete obj;
+#endif
+}
+
+#ifdef SLAB_ALLOCATION
+template<>
+inline SlabPool<ObjString>& Memory::pool<ObjString>(VM *vm)
+{
+	return vm->m_stringPool;
+}
+
+template<>
+inline SlabPool<ObjFunction>& Memory::pool<ObjFunction>(VM *vm)
+{
+	return vm->m_functionPool;
+}
+
+template<>
+inline SlabPool<ObjNative>& Memory::pool<ObjNative>(VM *vm)
+{
+	return vm->m_nativePool;
+}
+#endif
+
+// Links obj into the heap. Objects made while marking runs are marked, the
+// cycle only frees what was unreachable when it started. Sweeping starts
+// from the head of the list, the ones made while it runs go before it.
+inline void Memory::track(VM *vm, sObj *obj)
+{
+	vm->m_bytesAllocated += objectSize(obj);
 	obj->next = vm->m_objects;
 	vm->m_objects = obj;
-	return obj;
+	if (vm->m_gcPhase == GcPhase::MARKING)
+		obj->isMarked = true;
+	else if (vm->m_gcPhase == GcPhase::SWEEPING && vm->m_sweepLink == &vm->m_objects)
+		vm->m_sweepLink = &obj->next;
+}
+
+// Marks obj while marking runs. Young strings are never marked, the nursery
+// is emptied when a cycle starts and the strings moved out of it since are
+// marked by track.
+inline void Memory::shade(VM *vm, sObj *obj)
+{
+	if (vm->m_gcPhase == GcPhase::MARKING && !isYoung(vm, obj))
+		markObject(vm, obj);
+}
+
+inline void Memory::writeBarrier(VM *vm, sObj *previous)
+{
+	if (previous)
+		shade(vm, previous);
 }
 
 inline ObjFunction* Memory::createFunction(VM *vm)
@@ -24,8 +104,20 @@ inline ObjNative* Memory::createNative(VM *vm, NativeFn function)
 inline ObjString* Memory::createString(VM *vm, const std::string &str)
 {
 	auto interned = vm->m_strings[str];
+	if (interned && isYoung(vm, interned))
+	{
+		// The compiler keeps its strings in chunk constants, which are no
+		// roots of the nursery. The young one and the references to it are
+		// moved to the heap first.
+		collectNursery(vm);
+		interned = vm->m_strings[str];
+	}
 	if (interned)
+	{
+		// The table is weak, a string found in it is reachable again.
+		shade(vm, interned);
 		return static_cast<ObjString*>(interned);
+	}
 
 	auto obj_str = createObject<ObjString>(vm, str);
 	vm->m_strings[str] = obj_str;
@@ -36,3 +128,29 @@ inline ObjString* Memory::createString(VM *vm, std::string_view str)
 {
 	return createString(vm, std::string(str));
 }
+
+inline ObjString* Memory::createYoungString(VM *vm, const std::string &str)
+{
+	auto interned = vm->m_strings[str];
+	if (interned)
+	{
+		shade(vm, interned);
+		return static_cast<ObjString*>(interned);
+	}
+
+#ifdef DEBUG_STRESS_GC
+	collectGarbage(vm);
+#endif
+	if (vm->m_nurseryTop == vm->m_nurseryEnd || vm->m_nurseryBytes >= GC_NURSERY_SIZE)
+	{
+		collectNursery(vm);
+		// What survived grew the heap. A running cycle goes on even if
+		// nothing did.
+		if (vm->m_bytesAllocated > vm->m_nextGC || vm->m_gcPhase != GcPhase::IDLE)
+			collectStep(vm);
+	}
+	auto obj_str = new (vm->m_nurseryTop++) ObjString(str);
+	vm->m_nurseryBytes += obj_str->value.capacity();
+	vm->m_strings[str] = obj_str;
+	return obj_str;
+}
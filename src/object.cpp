@@ -5,7 +5,7 @@
 #include "object.hpp"
 #include "chunk.hpp"
 
-sObj::sObj(ObjType type) : type(type), next(nullptr), hash(reinterpret_cast<size_t>(this))
+sObj::sObj(ObjType type) : next(nullptr), hash(reinterpret_cast<size_t>(this)), type(type), isMarked(false)
 {}
 
 std::ostream &operator<<(std::ostream &os, const sObj &obj)
@@ -32,6 +32,18 @@ ObjFunction::ObjFunction() : sObj(ObjType::FUNCTION), arity(0), /*chunk(*new (&_
 ObjFunction::~ObjFunction() {
 }
 
+void ObjFunction::markGeneric(uint32_t offset)
+{
+	if (genericSites.size() <= offset)
+		genericSites.resize(chunk.size());
+	genericSites[offset] = true;
+}
+
+bool ObjFunction::isGeneric(uint32_t offset) const
+{
+	return offset < genericSites.size() && genericSites[offset];
+}
+
 ObjNative::ObjNative(NativeFn function) : sObj(ObjType::NATIVE), function(function)
 {}
 
@@ -5,14 +5,18 @@
 #ifndef CPPLOX_OBJECT_HPP
 #define CPPLOX_OBJECT_HPP
 
+#include <atomic>
 #include <string>
 #include <ostream>
 #include <iostream>
 #include <memory>
 #include <type_traits>
+#include <vector>
 
 #include "objType.hpp"
 #include "chunk.hpp"
+#include "hashTable.hpp"
+#include "registers.hpp"
 
 struct Value;
 
@@ -21,6 +25,9 @@ struct sObj
 	sObj *next;
 	size_t hash;
 	ObjType type;
+	// Reached by the collection that is running. It fits in the padding after
+	// type, the layout the JIT mirrors does not change.
+	bool isMarked;
 
 	explicit sObj(ObjType type);
 
@@ -34,16 +41,40 @@ struct ObjFunction : sObj
 {
 	uint32_t arity{0};
 	ObjString* name{nullptr};
-	JitFn function{nullptr};
+	std::atomic<JitFn> function{nullptr};
 	Chunk chunk;
+	// Tiering counters. They live after chunk so the layout the JIT mirrors
+	// for the fields above stays the same.
+	uint32_t callCount{0};
+	uint32_t backEdges{0};
+	// Loop header offset -> compiled variant entered through OSR.
+	HashTable<uint32_t, JitFn> osrEntries;
+	// Arithmetic instructions that saw non-number operands, either in the
+	// interpreter or through a failed guard. The JIT does not speculate there.
+	std::vector<bool> genericSites;
+#ifdef REGISTER_VM
+	// The register form of chunk, empty if the function does not fit it.
+	RegisterChunk registers;
+#endif
+#ifdef DIRECT_THREADING
+	// Handler address of the instruction at every offset of chunk, translated
+	// by VM::run the first time it enters the function.
+	std::vector<void*> threaded;
+#endif
 
 	ObjFunction();
 	~ObjFunction();
 
+	void markGeneric(uint32_t offset);
+	bool isGeneric(uint32_t offset) const;
+
 private:
 	//std::aligned_storage<120, 8>::type _chunk;
 };
 
+// The JIT loads function as a plain pointer.
+static_assert(sizeof(std::atomic<JitFn>) == sizeof(JitFn), "std::atomic<JitFn> must have the layout of JitFn");
+
 using NativeFn = Value (*)(int argCount, Value* args);
 
 struct ObjNative : sObj
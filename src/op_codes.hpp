@@ -36,4 +36,15 @@ OPCODE(JUMP_IF_TRUE)
 OPCODE(JUMP_BACK)
 OPCODE(CALL)
 OPCODE(RETURN)
+// Superinstructions. The compiler emits the comparisons directly and fuses
+// the rest (see fuseInstructions) from sequences common in hot loops.
+OPCODE(NOT_EQUAL)                // EQUAL NOT
+OPCODE(GREATER_EQUAL)            // LESS NOT
+OPCODE(LESS_EQUAL)               // GREATER NOT
+OPCODE(SET_LOCAL_POP)            // SET_LOCAL s; POP
+OPCODE(ADD_LOCAL_LOCAL)          // GET_LOCAL a; GET_LOCAL b; ADD
+OPCODE(MULTIPLY_LOCAL_LOCAL)     // GET_LOCAL a; GET_LOCAL b; MULTIPLY
+OPCODE(INC_LOCAL_CONST)          // GET_LOCAL s; CONSTANT k; ADD; SET_LOCAL s; POP
+OPCODE(LESS_JUMP_IF_FALSE)       // LESS; JUMP_IF_FALSE
+OPCODE(GREATER_JUMP_IF_FALSE)    // GREATER; JUMP_IF_FALSE
 
@@ -0,0 +1,33 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+// Instructions of the register form of a function (see registers.hpp). a is
+// the destination slot unless noted, b and c are operands: a slot, or a
+// constant if RK_CONSTANT is set.
+OPCODE(MOVE)                     // a = b
+OPCODE(GET_GLOBAL)               // a = globals[b]
+OPCODE(DEFINE_GLOBAL)            // globals[a] = b
+OPCODE(SET_GLOBAL)               // globals[a] = b, the global has to exist
+OPCODE(EQUAL)                    // a = b == c
+OPCODE(NOT_EQUAL)
+OPCODE(GREATER)
+OPCODE(LESS)
+OPCODE(GREATER_EQUAL)
+OPCODE(LESS_EQUAL)
+OPCODE(ADD)                      // a = b + c
+OPCODE(SUBTRACT)
+OPCODE(MULTIPLY)
+OPCODE(DIVIDE)
+OPCODE(MODULO)
+OPCODE(NOT)                      // a = !b
+OPCODE(NEGATE)                   // a = -b
+OPCODE(PRINT)                    // print a
+OPCODE(JUMP)                     // go to instruction a
+OPCODE(JUMP_IF_FALSE)            // go to a if b is falsey
+OPCODE(JUMP_IF_TRUE)             // go to a unless b is falsey
+OPCODE(LESS_JUMP_IF_FALSE)       // go to a unless b < c
+OPCODE(GREATER_JUMP_IF_FALSE)    // go to a unless b > c
+OPCODE(JUMP_BACK)                // go to the loop header a, at offset b | c << 16 of the stack code
+OPCODE(CALL)                     // call slot a with the b slots after it as arguments
+OPCODE(RETURN)                   // return a
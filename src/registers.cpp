@@ -0,0 +1,460 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#include <limits>
+
+#include "registers.hpp"
+
+namespace
+{
+	constexpr auto NONE = std::numeric_limits<uint32_t>::max();
+
+	// A value of the simulated stack. Stored values are in their own slot, the
+	// others are still an operand (a slot read earlier or a constant) to copy
+	// there once something needs the slot.
+	struct Entry
+	{
+		uint16_t operand;
+		bool stored;
+	};
+
+	class Translator
+	{
+	public:
+		Translator(Chunk* chunk, RegisterChunk* out) : m_chunk(chunk), m_out(out)
+		{}
+
+		bool translate(uint32_t arity);
+
+	private:
+		uint32_t emit(uint8_t op, uint32_t a, uint32_t b = 0, uint32_t c = 0);
+		uint16_t operand(size_t index) const;
+		void store(size_t index);
+		void storeAll();
+		void push(uint16_t operand);
+		void pushConstant(uint32_t index);
+		void pushResult(uint32_t producer);
+		uint16_t pop();
+		void readLocal(uint32_t slot);
+		void writeLocal(uint32_t slot, bool pop);
+		void binary(uint8_t op);
+		void jump(uint8_t op, uint32_t target, uint32_t b = 0, uint32_t c = 0);
+		bool popsAt(uint32_t offset) const;
+
+		Chunk* m_chunk;
+		RegisterChunk* m_out;
+		std::vector<Entry> m_stack;
+		// Offset of the stack instruction translated.
+		uint32_t m_offset = 0;
+		// The instruction that computed the top of the stack into its slot, if
+		// it is the last one emitted, so a store to a local can take its place.
+		uint32_t m_producer = NONE;
+		// Forward jumps: instruction and offset of the target in the stack code.
+		std::vector<std::pair<uint32_t, uint32_t>> m_jumps;
+		std::vector<uint32_t> m_pcs;
+		bool m_failed = false;
+	};
+}
+
+bool translateToRegisters(Chunk* chunk, uint32_t arity, RegisterChunk* out)
+{
+	*out = RegisterChunk();
+	if (Translator(chunk, out).translate(arity))
+		return true;
+	*out = RegisterChunk();
+	return false;
+}
+
+bool Translator::translate(uint32_t arity)
+{
+	auto size = static_cast<uint32_t>(m_chunk->size());
+	auto depths = stackDepths(m_chunk, static_cast<int32_t>(arity) + 1);
+
+	m_out->constants.assign(m_chunk->constants(), m_chunk->constants() + m_chunk->constantsSize());
+	auto nil = static_cast<uint32_t>(m_out->constants.size());
+	m_out->constants.push_back(Value::Nil());
+	m_out->constants.push_back(Value::Bool(true));
+	m_out->constants.push_back(Value::Bool(false));
+
+	std::vector<bool> labels(size, false);
+	for (auto offset = 0u; offset < size; offset += instructionSize(m_chunk->get(offset)))
+	{
+		auto instruction = m_chunk->get(offset);
+		auto next = offset + instructionSize(instruction);
+		if (instructionSize(instruction) != 3)
+			continue;
+		uint16_t jump = m_chunk->get(offset + 1u) | static_cast<uint16_t>(m_chunk->get(offset + 2u) << 8u);
+		switch (instruction)
+		{
+			case OpCode::JUMP:
+			case OpCode::JUMP_IF_FALSE:
+			case OpCode::JUMP_IF_TRUE:
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+				labels[next + jump] = true;
+				break;
+			case OpCode::JUMP_BACK:
+				labels[next - jump] = true;
+				break;
+			default:
+				break;
+		}
+	}
+
+	m_stack.assign(arity + 1, Entry{0, true});
+	m_pcs.assign(size, 0);
+	bool reachable = true;
+	for (auto offset = 0u; offset < size && !m_failed; offset += instructionSize(m_chunk->get(offset)))
+	{
+		m_offset = offset;
+		if (depths[offset] < 0)
+		{
+			m_pcs[offset] = static_cast<uint32_t>(m_out->code.size());
+			continue;
+		}
+		if (labels[offset] || !reachable)
+		{
+			// Every path into a label leaves the stack in its slots.
+			if (reachable)
+				storeAll();
+			m_stack.assign(static_cast<size_t>(depths[offset]), Entry{0, true});
+			m_producer = NONE;
+		}
+		m_pcs[offset] = static_cast<uint32_t>(m_out->code.size());
+		reachable = true;
+
+		auto instruction = m_chunk->get(offset);
+		auto next = offset + instructionSize(instruction);
+		auto operandByte = [&](uint32_t at) -> uint8_t {
+			return offset + at < next ? m_chunk->get(offset + at) : 0;
+		};
+		uint8_t byte = operandByte(1);
+		uint16_t word = byte | static_cast<uint16_t>(operandByte(2) << 8u);
+		uint32_t index = word | static_cast<uint32_t>(operandByte(3) << 16u);
+		switch (instruction)
+		{
+			case OpCode::CONSTANT:
+				pushConstant(byte);
+				break;
+			case OpCode::CONSTANT_LONG:
+				pushConstant(index);
+				break;
+			case OpCode::NIL:
+				pushConstant(nil);
+				break;
+			case OpCode::TRUE:
+				pushConstant(nil + 1);
+				break;
+			case OpCode::FALSE:
+				pushConstant(nil + 2);
+				break;
+			case OpCode::POP:
+				pop();
+				break;
+			case OpCode::DUP:
+				push(operand(m_stack.size() - 1));
+				break;
+			case OpCode::GET_LOCAL:
+				readLocal(byte);
+				break;
+			case OpCode::GET_LOCAL_SHORT:
+				readLocal(word);
+				break;
+			case OpCode::SET_LOCAL:
+				writeLocal(byte, false);
+				break;
+			case OpCode::SET_LOCAL_SHORT:
+				writeLocal(word, false);
+				break;
+			case OpCode::SET_LOCAL_POP:
+				writeLocal(byte, true);
+				break;
+			case OpCode::GET_GLOBAL:
+			case OpCode::GET_GLOBAL_LONG:
+				pushResult(emit(RegisterOp::GET_GLOBAL, static_cast<uint32_t>(m_stack.size()),
+				                instruction == OpCode::GET_GLOBAL ? byte : index));
+				break;
+			case OpCode::DEFINE_GLOBAL:
+			case OpCode::DEFINE_GLOBAL_LONG:
+			{
+				auto value = pop();
+				emit(RegisterOp::DEFINE_GLOBAL, instruction == OpCode::DEFINE_GLOBAL ? byte : index, value);
+				break;
+			}
+			case OpCode::SET_GLOBAL:
+			case OpCode::SET_GLOBAL_LONG:
+				emit(RegisterOp::SET_GLOBAL, instruction == OpCode::SET_GLOBAL ? byte : index, operand(m_stack.size() - 1));
+				break;
+			case OpCode::EQUAL:
+				binary(RegisterOp::EQUAL);
+				break;
+			case OpCode::NOT_EQUAL:
+				binary(RegisterOp::NOT_EQUAL);
+				break;
+			case OpCode::GREATER:
+				binary(RegisterOp::GREATER);
+				break;
+			case OpCode::LESS:
+				binary(RegisterOp::LESS);
+				break;
+			case OpCode::GREATER_EQUAL:
+				binary(RegisterOp::GREATER_EQUAL);
+				break;
+			case OpCode::LESS_EQUAL:
+				binary(RegisterOp::LESS_EQUAL);
+				break;
+			case OpCode::ADD:
+				binary(RegisterOp::ADD);
+				break;
+			case OpCode::SUBTRACT:
+				binary(RegisterOp::SUBTRACT);
+				break;
+			case OpCode::MULTIPLY:
+				binary(RegisterOp::MULTIPLY);
+				break;
+			case OpCode::DIVIDE:
+				binary(RegisterOp::DIVIDE);
+				break;
+			case OpCode::MODULO:
+				binary(RegisterOp::MODULO);
+				break;
+			case OpCode::ADD_LOCAL_LOCAL:
+			case OpCode::MULTIPLY_LOCAL_LOCAL:
+				readLocal(byte);
+				readLocal(operandByte(2));
+				binary(instruction == OpCode::ADD_LOCAL_LOCAL ? RegisterOp::ADD : RegisterOp::MULTIPLY);
+				break;
+			case OpCode::INC_LOCAL_CONST:
+				readLocal(byte);
+				pushConstant(operandByte(2));
+				binary(RegisterOp::ADD);
+				writeLocal(byte, true);
+				break;
+			case OpCode::NOT:
+			case OpCode::NEGATE:
+			{
+				auto value = pop();
+				auto op = instruction == OpCode::NOT ? RegisterOp::NOT : RegisterOp::NEGATE;
+				pushResult(emit(op, static_cast<uint32_t>(m_stack.size()), value));
+				break;
+			}
+			case OpCode::PRINT:
+				emit(RegisterOp::PRINT, pop());
+				break;
+			case OpCode::JUMP:
+				storeAll();
+				jump(RegisterOp::JUMP, next + word);
+				reachable = false;
+				break;
+			case OpCode::JUMP_IF_FALSE:
+			case OpCode::JUMP_IF_TRUE:
+			{
+				auto op = instruction == OpCode::JUMP_IF_FALSE ? RegisterOp::JUMP_IF_FALSE : RegisterOp::JUMP_IF_TRUE;
+				if (popsAt(next) && popsAt(next + word))
+				{
+					// Both edges drop the condition, it never has to be stored.
+					auto condition = pop();
+					storeAll();
+					jump(op, next + word, condition);
+					m_stack.push_back(Entry{0, true});
+				}
+				else
+				{
+					storeAll();
+					jump(op, next + word, operand(m_stack.size() - 1));
+				}
+				break;
+			}
+			case OpCode::LESS_JUMP_IF_FALSE:
+			case OpCode::GREATER_JUMP_IF_FALSE:
+			{
+				auto less = instruction == OpCode::LESS_JUMP_IF_FALSE;
+				if (popsAt(next) && popsAt(next + word))
+				{
+					auto c = pop();
+					auto b = pop();
+					storeAll();
+					jump(less ? RegisterOp::LESS_JUMP_IF_FALSE : RegisterOp::GREATER_JUMP_IF_FALSE, next + word, b, c);
+					m_stack.push_back(Entry{0, true});
+				}
+				else
+				{
+					binary(less ? RegisterOp::LESS : RegisterOp::GREATER);
+					storeAll();
+					jump(RegisterOp::JUMP_IF_FALSE, next + word, operand(m_stack.size() - 1));
+				}
+				break;
+			}
+			case OpCode::JUMP_BACK:
+			{
+				storeAll();
+				auto header = next - word;
+				emit(RegisterOp::JUMP_BACK, m_pcs[header], header & 0xffffu, header >> 16u);
+				reachable = false;
+				break;
+			}
+			case OpCode::CALL:
+			{
+				storeAll();
+				auto base = static_cast<uint32_t>(m_stack.size()) - byte - 1;
+				emit(RegisterOp::CALL, base, byte);
+				m_stack.resize(base);
+				pushResult(NONE);
+				break;
+			}
+			case OpCode::RETURN:
+				emit(RegisterOp::RETURN, pop());
+				reachable = false;
+				break;
+			default:
+				m_failed = true;
+				break;
+		}
+	}
+
+	for (auto& jump : m_jumps)
+	{
+		auto pc = m_pcs[jump.second];
+		if (pc > std::numeric_limits<uint16_t>::max())
+			return false;
+		m_out->code[jump.first].a = static_cast<uint16_t>(pc);
+	}
+	return !m_failed;
+}
+
+// Appends an instruction, at the site of the stack instruction translated.
+// Operands that do not fit make the translation fail.
+uint32_t Translator::emit(uint8_t op, uint32_t a, uint32_t b, uint32_t c)
+{
+	constexpr auto max = std::numeric_limits<uint16_t>::max();
+	auto pc = static_cast<uint32_t>(m_out->code.size());
+	if (a > max || b > max || c > max || pc > max)
+	{
+		m_failed = true;
+		return pc;
+	}
+	m_out->code.push_back(RegisterInstruction{op, static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c)});
+	m_out->sites.push_back(RegisterSite{m_offset, static_cast<uint32_t>(m_stack.size())});
+	return pc;
+}
+
+uint16_t Translator::operand(size_t index) const
+{
+	auto& entry = m_stack[index];
+	return entry.stored ? static_cast<uint16_t>(index) : entry.operand;
+}
+
+void Translator::store(size_t index)
+{
+	auto& entry = m_stack[index];
+	if (entry.stored)
+		return;
+	emit(RegisterOp::MOVE, static_cast<uint32_t>(index), entry.operand);
+	entry.stored = true;
+}
+
+void Translator::storeAll()
+{
+	for (size_t index = 0; index < m_stack.size(); index++)
+		store(index);
+}
+
+void Translator::push(uint16_t operand)
+{
+	if (m_stack.size() >= RK_CONSTANT)
+		m_failed = true;
+	m_stack.push_back(Entry{operand, false});
+}
+
+void Translator::pushConstant(uint32_t index)
+{
+	if (index >= RK_CONSTANT)
+		m_failed = true;
+	push(static_cast<uint16_t>(index | RK_CONSTANT));
+}
+
+// The top of the stack is in its slot, computed by producer.
+void Translator::pushResult(uint32_t producer)
+{
+	if (m_stack.size() >= RK_CONSTANT)
+		m_failed = true;
+	m_stack.push_back(Entry{0, true});
+	m_producer = producer;
+}
+
+uint16_t Translator::pop()
+{
+	auto value = operand(m_stack.size() - 1);
+	m_stack.pop_back();
+	m_producer = NONE;
+	return value;
+}
+
+void Translator::readLocal(uint32_t slot)
+{
+	if (slot >= RK_CONSTANT)
+	{
+		m_failed = true;
+		return;
+	}
+	if (slot < m_stack.size())
+		store(slot);
+	push(static_cast<uint16_t>(slot));
+}
+
+void Translator::writeLocal(uint32_t slot, bool pop)
+{
+	auto top = m_stack.size() - 1;
+	auto value = operand(top);
+	if (value != slot)
+	{
+		// Values read from the local before are copied before it changes.
+		auto size = m_out->code.size();
+		for (size_t index = 0; index < top; index++)
+		{
+			if (!m_stack[index].stored && m_stack[index].operand == slot)
+				store(index);
+		}
+
+		// The value was just computed into its slot, compute it into the local
+		// instead.
+		auto producer = m_producer;
+		if (producer != NONE && producer + 1u == size && size == m_out->code.size() &&
+		    m_stack[top].stored && m_out->code[producer].a == top)
+		{
+			m_out->code[producer].a = static_cast<uint16_t>(slot);
+			m_stack[top] = Entry{static_cast<uint16_t>(slot), false};
+		}
+		else
+		{
+			emit(RegisterOp::MOVE, slot, value);
+		}
+		if (slot < m_stack.size())
+			m_stack[slot].stored = true;
+	}
+	if (pop)
+		this->pop();
+	else
+		m_producer = NONE;
+}
+
+void Translator::binary(uint8_t op)
+{
+	auto c = pop();
+	auto b = pop();
+	// Concatenation allocates, what lies below has to be in its slots.
+	if (op == RegisterOp::ADD)
+		storeAll();
+	pushResult(emit(op, static_cast<uint32_t>(m_stack.size()), b, c));
+}
+
+void Translator::jump(uint8_t op, uint32_t target, uint32_t b, uint32_t c)
+{
+	m_jumps.emplace_back(emit(op, 0, b, c), target);
+}
+
+bool Translator::popsAt(uint32_t offset) const
+{
+	return offset < m_chunk->size() && m_chunk->get(offset) == OpCode::POP;
+}
@@ -0,0 +1,69 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#ifndef CPPLOX_REGISTERS_HPP
+#define CPPLOX_REGISTERS_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "chunk.hpp"
+#include "value.hpp"
+
+namespace RegisterOp
+{
+	enum : uint8_t
+	{
+#define OPCODE(name) name,
+#include "register_op_codes.hpp"
+#undef OPCODE
+		// Number of opcodes, the size of the dispatch table of VM::runRegisters.
+		COUNT
+	};
+}
+
+// Operands with this bit set name a constant of the register chunk instead
+// of a slot of the frame.
+constexpr uint16_t RK_CONSTANT = 0x8000u;
+
+// A three address instruction over the slots of the frame. The slots are the
+// ones the stack code uses: locals first, then the temporaries at the depth
+// the stack code would push them.
+struct RegisterInstruction
+{
+	uint8_t op;
+	uint16_t a;
+	uint16_t b;
+	uint16_t c;
+};
+
+// Where an instruction comes from: the offset of the stack instruction it
+// stands for (its line, and the site the JIT speculates on) and the number of
+// slots live below its operands.
+struct RegisterSite
+{
+	uint32_t offset;
+	uint32_t depth;
+};
+
+// The register form of the code of a function. Constants are the ones of the
+// chunk followed by nil, true and false.
+struct RegisterChunk
+{
+	std::vector<RegisterInstruction> code;
+	std::vector<RegisterSite> sites;
+	std::vector<Value> constants;
+};
+
+// Translates the stack code of chunk, for a function of arity parameters,
+// into register form. Locals and constants are used where they are instead of
+// being pushed first, and values stored to a local right away are computed
+// into it. At every jump and jump target, and before calls and allocations,
+// the slots hold what the stack code would have pushed there, which is what
+// callees, the slow paths of the VM and OSR into native code expect. Returns
+// false if the function needs more slots, constants, globals or instructions
+// than the operands can address.
+bool translateToRegisters(Chunk* chunk, uint32_t arity, RegisterChunk* out);
+
+#endif //CPPLOX_REGISTERS_HPP
@@ -0,0 +1,98 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+// Runtime helpers the generated code calls by name. They are kept apart from
+// the code generator so the runtime library of ahead-of-time compiled scripts
+// can be built without LLVM (see aot.hpp).
+
+#include <cstdio>
+#include <string>
+
+#include "vm.hpp"
+#include "memory.hpp"
+
+extern "C" __declspec(dllexport) void callError(VM* vm, uint32_t pc)
+{
+	using namespace std::string_literals;
+	vm->runtimeError(pc, "Object is not callable."s);
+}
+
+extern "C" __declspec(dllexport) void numberError(VM* vm, uint32_t pc)
+{
+	using namespace std::string_literals;
+	vm->runtimeError(pc, "Operands must be numbers."s);
+}
+
+extern "C" __declspec(dllexport) void variableError(VM *vm, uint32_t pos, uint32_t pc)
+{
+	using namespace std::string_literals;
+	vm->runtimeError(pc, "Undefined variable "s, vm->m_globalNames[pos], "."s);
+}
+
+extern "C" __declspec(dllexport) void arityError(VM *vm, uint32_t arity, uint32_t arg_count, uint32_t pc)
+{
+	using namespace std::string_literals;
+	vm->runtimeError(pc, "Expected "s, std::to_string(arity), " arguments but got "s, std::to_string(arg_count), "."s);
+}
+
+extern "C" __declspec(dllexport) bool equal(Value *a, Value *b)
+{
+	return *a == *b;
+}
+
+// The slots of the calling frame below top are live, the new string may start
+// a collection.
+extern "C" __declspec(dllexport) int concatenate(VM *vm, Value *out, Value *a, Value *b, Value *top, uint32_t pc)
+{
+	vm->m_stack.getTop() = top;
+	if (a->isObjString() && b->isObjString())
+	{
+		*out = Value::Object(Memory::createYoungString(vm, a->asObjString()->value + b->asObjString()->value));
+	}
+	else if(a->isNumber() && b->isObjString())
+	{
+		auto b_str = b->asObjString()->value;
+		auto a_num = a->asNumber();
+		char buff[1024];
+		std::sprintf(buff, "%g", a_num);
+		*out = Value::Object(Memory::createYoungString(vm, std::string(buff) + b_str));
+	}
+	else if(a->isObjString() && b->isNumber())
+	{
+		auto b_num = b->asNumber();
+		auto a_str = a->asObjString()->value;
+		char buff[1024];
+		std::sprintf(buff, "%g", b_num);
+		*out = Value::Object(Memory::createYoungString(vm, a_str + std::string(buff)));
+	}
+	else
+	{
+		vm->runtimeError(pc, "Operands must be numbers or strings.");
+		return (int)InterpretResult::RUNTIME_ERROR;
+	}
+	return (int)InterpretResult::OK;
+}
+
+// Reached from a back edge of JITed code while the VM asks for a safepoint.
+// The slots of the frame below top are spilled to the stack.
+extern "C" __declspec(dllexport) void safepoint(VM *vm, Value *top)
+{
+	vm->m_stack.getTop() = top;
+	Memory::safepoint(vm);
+}
+
+extern "C" __declspec(dllexport) uint8_t* safepointFlag(VM *vm)
+{
+	return &vm->m_safepointRequested;
+}
+
+extern "C" __declspec(dllexport) void print(Value* val)
+{
+	std::cout << *val << std::endl;
+}
+
+extern "C" __declspec(dllexport) void callNative(NativeFn fun, uint32_t argCount, Value *args, Value *out)
+{
+	*out = fun(argCount, args);
+}
@@ -0,0 +1,200 @@
+//
+// Created by agent on 16/10/2026.
+//
+
+#ifndef CPPLOX_SLAB_HPP
+#define CPPLOX_SLAB_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <ostream>
+#include <utility>
+
+#include "common.hpp"
+
+// How full the pages of a pool are.
+struct SlabOccupancy
+{
+	size_t pages = 0;
+	size_t slots = 0;
+	size_t used = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& os, const SlabOccupancy& occupancy)
+{
+	return os << occupancy.used << "/" << occupancy.slots << " slots in " << occupancy.pages << " pages";
+}
+
+// Objects of type T in slots of pages of SLAB_PAGE_SIZE bytes, aligned to
+// their size so that the page of a slot is found from its address. Every page
+// keeps a list of its free slots and hands out the ones it never used in
+// order. Allocation takes a slot from the first page with one. Pages emptied
+// by destroy stay to be used again until trim releases them.
+template <typename T>
+class SlabPool
+{
+	union Slot
+	{
+		Slot* next;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	struct Page
+	{
+		// In m_available if it has free slots, in m_full otherwise.
+		Page* previous;
+		Page* next;
+		Slot* free;
+		// Slots from here on were never used.
+		Slot* unused;
+		size_t used;
+	};
+
+	static constexpr size_t FIRST_SLOT = (sizeof(Page) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+	static constexpr size_t SLOTS_PER_PAGE = (SLAB_PAGE_SIZE - FIRST_SLOT) / sizeof(Slot);
+	static_assert((SLAB_PAGE_SIZE & (SLAB_PAGE_SIZE - 1)) == 0, "SLAB_PAGE_SIZE must be a power of two");
+	static_assert(SLOTS_PER_PAGE > 0, "SLAB_PAGE_SIZE is too small for the objects of the pool");
+
+public:
+	SlabPool() = default;
+	SlabPool(const SlabPool&) = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+
+	// Releases every page. The objects still in them are not destroyed.
+	~SlabPool()
+	{
+		releaseAll(m_available);
+		releaseAll(m_full);
+	}
+
+	template <typename ... _Types>
+	T* create(_Types&& ... args)
+	{
+		if (!m_available)
+			link(m_available, allocatePage());
+
+		auto page = m_available;
+		Slot* slot;
+		if (page->free)
+		{
+			slot = page->free;
+			page->free = slot->next;
+		}
+		else
+		{
+			slot = page->unused++;
+		}
+		if (page->used++ == 0)
+			m_emptyPages--;
+		if (page->used == SLOTS_PER_PAGE)
+		{
+			unlink(m_available, page);
+			link(m_full, page);
+		}
+		m_used++;
+		return new (slot->storage) T(std::forward<_Types>(args)...);
+	}
+
+	void destroy(T* object)
+	{
+		object->~T();
+		auto slot = reinterpret_cast<Slot*>(object);
+		auto page = pageOf(slot);
+		slot->next = page->free;
+		page->free = slot;
+		m_used--;
+		if (page->used-- == SLOTS_PER_PAGE)
+		{
+			unlink(m_full, page);
+			link(m_available, page);
+		}
+		if (page->used == 0)
+			m_emptyPages++;
+	}
+
+	// Releases the empty pages beyond ratio times the pages in use.
+	void trim(size_t ratio)
+	{
+		auto keep = (m_pages - m_emptyPages) * ratio;
+		auto page = m_available;
+		while (page && m_emptyPages > keep)
+		{
+			auto next = page->next;
+			if (page->used == 0)
+			{
+				unlink(m_available, page);
+				::operator delete(page, std::align_val_t(SLAB_PAGE_SIZE));
+				m_pages--;
+				m_emptyPages--;
+			}
+			page = next;
+		}
+	}
+
+	SlabOccupancy occupancy() const
+	{
+		return SlabOccupancy{m_pages, m_pages * SLOTS_PER_PAGE, m_used};
+	}
+
+private:
+	static Page* pageOf(Slot* slot)
+	{
+		return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(slot) & ~static_cast<uintptr_t>(SLAB_PAGE_SIZE - 1));
+	}
+
+	static Slot* firstSlot(Page* page)
+	{
+		return reinterpret_cast<Slot*>(reinterpret_cast<unsigned char*>(page) + FIRST_SLOT);
+	}
+
+	Page* allocatePage()
+	{
+		auto memory = ::operator new(SLAB_PAGE_SIZE, std::align_val_t(SLAB_PAGE_SIZE));
+		auto page = new (memory) Page{nullptr, nullptr, nullptr, nullptr, 0};
+		page->unused = firstSlot(page);
+		m_pages++;
+		m_emptyPages++;
+		return page;
+	}
+
+	static void releaseAll(Page* list)
+	{
+		while (list)
+		{
+			auto page = list;
+			list = page->next;
+			::operator delete(page, std::align_val_t(SLAB_PAGE_SIZE));
+		}
+	}
+
+	// Puts page first in list. A page that just got a free slot is the next
+	// one to allocate from.
+	static void link(Page*& list, Page* page)
+	{
+		page->previous = nullptr;
+		page->next = list;
+		if (list)
+			list->previous = page;
+		list = page;
+	}
+
+	static void unlink(Page*& list, Page* page)
+	{
+		if (page->previous)
+			page->previous->next = page->next;
+		else
+			list = page->next;
+		if (page->next)
+			page->next->previous = page->previous;
+	}
+
+	Page* m_available = nullptr;
+	Page* m_full = nullptr;
+	size_t m_pages = 0;
+	// Pages in m_available without a used slot.
+	size_t m_emptyPages = 0;
+	size_t m_used = 0;
+};
+
+#endif //CPPLOX_SLAB_HPP
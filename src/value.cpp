@@ -2,6 +2,8 @@
 // Created by juanb on 6/06/2020.
 //
 
+#include <cstring>
+
 #include "object.hpp"
 #include "value.hpp"
 
@@ -10,6 +12,51 @@ size_t obj_hash(sObj* obj)
 	return obj->hash;
 }
 
+#ifdef NAN_BOXING
+Value Value::Bool(bool value)
+{
+	return Value(Bits{}, value ? NanBox::TRUE_VAL : NanBox::FALSE_VAL);
+}
+
+Value Value::Nil()
+{
+	return Value(Bits{}, NanBox::NIL_VAL);
+}
+
+Value Value::Number(double value)
+{
+	uint64_t bits;
+	std::memcpy(&bits, &value, sizeof(double));
+	return Value(Bits{}, bits);
+}
+
+Value Value::Object(Obj *value)
+{
+	return Value(Bits{}, NanBox::OBJ_MASK | static_cast<uint64_t>(reinterpret_cast<uintptr_t>(value)));
+}
+
+Value Value::Undefined()
+{
+	return Value();
+}
+
+bool Value::asBool() const
+{
+	return m_value == NanBox::TRUE_VAL;
+}
+
+double Value::asNumber() const
+{
+	double number;
+	std::memcpy(&number, &m_value, sizeof(double));
+	return number;
+}
+
+Obj *Value::asObj() const
+{
+	return reinterpret_cast<Obj*>(static_cast<uintptr_t>(m_value & ~NanBox::OBJ_MASK));
+}
+#else
 Value Value::Bool(bool value)
 {
 	return Value(value);
@@ -49,6 +96,7 @@ Obj *Value::asObj() const
 {
 	return m_as.obj;
 }
+#endif
 
 ObjString *Value::asObjString() const
 {
@@ -77,19 +125,19 @@ ObjType Value::objType() const
 
 std::ostream &operator<<(std::ostream &os, const Value &value)
 {
-	switch (value.m_type)
+	switch (value.type())
 	{
 		case ValueType::BOOL:
-			os << std::boolalpha << value.m_as.boolean;
+			os << std::boolalpha << value.asBool();
 			break;
 		case ValueType::NIL:
 			os << "nil";
 			break;
 		case ValueType::NUMBER:
-			os << value.m_as.number;
+			os << value.asNumber();
 			break;
 		case ValueType::OBJ:
-			os << *value.m_as.obj;
+			os << *value.asObj();
 			break;
 		default:
 			os << "undefined";
@@ -7,7 +7,9 @@
 
 #include <variant>
 #include <ostream>
+#include <cstdint>
 
+#include "common.hpp"
 #include "objType.hpp"
 
 struct sObj;
@@ -26,6 +28,28 @@ enum class ValueType : uint8_t
 
 using Obj = sObj;
 
+#ifdef NAN_BOXING
+// Bit patterns of a NaN-boxed Value. Any 64 bit word that is not a quiet NaN
+// is a double; the remaining space holds the singletons in the low bits and
+// Obj pointers behind the sign bit. The JIT emits the same patterns.
+namespace NanBox
+{
+	constexpr uint64_t SIGN_BIT = 0x8000000000000000u;
+	constexpr uint64_t QNAN = 0x7ffc000000000000u;
+
+	constexpr uint64_t TAG_NIL = 1u;
+	constexpr uint64_t TAG_FALSE = 2u;
+	constexpr uint64_t TAG_TRUE = 3u;
+	constexpr uint64_t TAG_UNDEFINED = 4u;
+
+	constexpr uint64_t NIL_VAL = QNAN | TAG_NIL;
+	constexpr uint64_t FALSE_VAL = QNAN | TAG_FALSE;
+	constexpr uint64_t TRUE_VAL = QNAN | TAG_TRUE;
+	constexpr uint64_t UNDEFINED_VAL = QNAN | TAG_UNDEFINED;
+	constexpr uint64_t OBJ_MASK = SIGN_BIT | QNAN;
+}
+#endif
+
 class Value
 {
 public:
@@ -62,6 +86,11 @@ public:
 	friend bool operator==(const Value &lhs, const Value &rhs);
 
 private:
+#ifdef NAN_BOXING
+	struct Bits {};
+	Value(Bits, uint64_t bits);
+	uint64_t m_value;
+#else
 	template <typename _T>
 	explicit Value(_T value);
 	ValueType m_type;
@@ -75,6 +104,7 @@ private:
 		explicit As(double number) : number(number) {}
 		explicit As(Obj* obj) : obj(obj) {}
 	} m_as{};
+#endif
 };
 
 #include "value.inl"
@@ -1,3 +1,77 @@
+#ifdef NAN_BOXING
+inline Value::Value(Bits, uint64_t bits) : m_value(bits)
+{}
+
+inline Value::Value() : m_value(NanBox::UNDEFINED_VAL)
+{}
+
+inline bool Value::isBool() const
+{
+	return (m_value | 1u) == NanBox::TRUE_VAL;
+}
+
+inline bool Value::isNil() const
+{
+	return m_value == NanBox::NIL_VAL;
+}
+
+inline bool Value::isNumber() const
+{
+	return (m_value & NanBox::QNAN) != NanBox::QNAN;
+}
+
+inline bool Value::isObj() const
+{
+	return (m_value & NanBox::OBJ_MASK) == NanBox::OBJ_MASK;
+}
+
+inline bool Value::isObjType(ObjType type) const
+{
+	return isObj() && objType() == type;
+}
+
+inline bool Value::isObjString() const
+{
+	return isObjType(ObjType::STRING);
+}
+
+inline bool Value::isObjFunction() const
+{
+	return isObjType(ObjType::FUNCTION);
+}
+
+inline bool Value::isObjNative() const
+{
+	return isObjType(ObjType::NATIVE);
+}
+
+inline bool Value::isUndefined() const
+{
+	return m_value == NanBox::UNDEFINED_VAL;
+}
+
+inline ValueType Value::type() const
+{
+	if (isNumber())
+		return ValueType::NUMBER;
+	if (isObj())
+		return ValueType::OBJ;
+	if (isBool())
+		return ValueType::BOOL;
+	if (isNil())
+		return ValueType::NIL;
+	return ValueType::UNDEFINED;
+}
+
+inline bool operator==(const Value &lhs, const Value &rhs)
+{
+	// Numbers compare as doubles so that NaN != NaN and 0 == -0, like the
+	// tagged layout does.
+	if (lhs.isNumber() && rhs.isNumber())
+		return lhs.asNumber() == rhs.asNumber();
+	return lhs.m_value == rhs.m_value;
+}
+#else
 template <typename _T>
 inline Value::Value(_T value)
 {
@@ -97,6 +171,7 @@ inline bool operator==(const Value &lhs, const Value &rhs)
 	}
 	return false;
 }
+#endif
 
 template <class... Ts>
 struct overloaded : Ts ...
@@ -2,12 +2,17 @@
 // Created by juanb on 29/09/2018.
 //
 
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <cmath>
 #include <chrono>
+#include <cstdlib>
 #include <fstream>
 
+#include "common.hpp"
+
+#ifndef LOX_AOT_RUNTIME
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/IRBuilder.h>
@@ -15,44 +20,114 @@
 #include <llvm/IR/Verifier.h>
 #include <llvm/IR/Function.h>
 #include <llvm/Support/TargetSelect.h>
-#include <llvm/Transforms/IPO/PassManagerBuilder.h>
-#include <llvm/Transforms/IPO.h>
 
 #include "llvm_jit_utils.hpp"
+#include "jit.hpp"
+#include "aot.hpp"
+#endif
 #include "utils.hpp"
 
 #include "memory.hpp"
-#include "common.hpp"
 #include "vm.hpp"
 #include "nativeFunctions.hpp"
-#include "jit.hpp"
 
 VM::VM()
 {
+#ifndef LOX_AOT_RUNTIME
 	llvm::InitializeNativeTarget();
 	llvm::InitializeNativeTargetAsmPrinter();
-	m_jit = std::make_unique<SimpleOrcJIT>(true);
+	m_context = std::make_unique<llvm::LLVMContext>();
+	m_valueType = create_value_type(*m_context);
+	std::string cache_dir;
+#ifdef JIT_OBJECT_CACHE
+	cache_dir = JIT_OBJECT_CACHE;
+#endif
+	if (auto directory = std::getenv("LOX_JIT_CACHE"))
+		cache_dir = directory;
+	m_jit = std::make_unique<SimpleOrcJIT>(m_diagnostics, cache_dir);
+#ifdef BACKGROUND_COMPILATION
+	auto threads = JIT_COMPILE_THREADS;
+	if (threads == 0)
+		threads = std::max(2u, std::thread::hardware_concurrency()) - 1;
+	for (unsigned i = 0; i < threads; ++i)
+		m_compileThreads.emplace_back(&VM::compileInBackground, this, m_jit->create_target_machine());
+#endif
+#endif
 
+	m_nursery = std::make_unique<NurserySlot[]>(GC_NURSERY_SIZE / sizeof(NurserySlot));
+	m_nurseryTop = m_nursery.get();
+	m_nurseryEnd = m_nurseryTop + GC_NURSERY_SIZE / sizeof(NurserySlot);
+#ifdef DEBUG_STRESS_GC
+	m_safepointRequested = 1;
+#endif
 	defineNative("clock", clockNative);
 }
 
 VM::~VM()
 {
+#ifdef BACKGROUND_COMPILATION
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		m_stopCompiling = true;
+	}
+	m_compileWake.notify_all();
+	for (auto &thread : m_compileThreads)
+		thread.join();
+#endif
+#ifdef DEBUG_LOG_GC
+	std::cerr << "-- gc: " << m_gcStats.collections << " collections in " << m_gcStats.increments << " increments freed "
+	          << m_gcStats.bytesFreed << " bytes, " << m_gcStats.minorCollections << " minor ones promoted " << m_gcStats.bytesPromoted
+	          << " bytes, pauses " << m_gcStats.totalPause << " ms in total, " << m_gcStats.maxPause << " ms at most" << std::endl;
+#ifdef SLAB_ALLOCATION
+	std::cerr << "-- heap: strings " << m_stringPool.occupancy() << ", functions " << m_functionPool.occupancy()
+	          << ", natives " << m_nativePool.occupancy() << std::endl;
+#endif
+	for (size_t i = 0; i < GcStats::PAUSE_BUCKETS; ++i)
+	{
+		if (!m_gcStats.pauses[i])
+			continue;
+		if (i + 1 < GcStats::PAUSE_BUCKETS)
+			std::cerr << "--   under " << (1u << i) << " us: ";
+		else
+			std::cerr << "--   longer: ";
+		std::cerr << m_gcStats.pauses[i] << std::endl;
+	}
+#endif
 	Mem::freeObjects(this);
 }
 
-InterpretResult VM::interpret(const std::string &source)
+InterpretResult VM::interpret(const std::string &source, const std::string &name)
 {
+#ifndef LOX_AOT_RUNTIME
+	m_sourceName = name;
+#else
+	(void)name;
+#endif
 	auto function = m_compiler.compile(this, source.data());
 
 	if (!function)
 	{
 		return InterpretResult::COMPILE_ERROR;
 	}
+	// A runtime error leaves the frames of the failed line behind, each line
+	// starts from the bottom of the stack.
+	m_stack.reset();
+	m_frameCount = 0;
+	m_frame = nullptr;
 	m_stack.push(Value::Object(function));
 	callValue(Value::Object(function), 0);
 
+#if defined(REGISTER_VM) && (defined(TIERED_EXECUTION) || defined(LOX_AOT_RUNTIME))
+	auto result = runRegisters();
+#elif defined(TIERED_EXECUTION) || defined(LOX_AOT_RUNTIME)
+	auto result = run();
+#else
 	auto result = runJitted();
+#endif
+#ifndef LOX_AOT_RUNTIME
+	// No native frame is left, code replaced during this call can go.
+	releaseRetiredCode();
+#endif
 
 	return result;
 }
@@ -72,6 +147,39 @@ std::vector<Value>& VM::globalValues()
 	return m_globalValues;
 }
 
+std::vector<uint32_t>& VM::globalStores()
+{
+	return m_globalStores;
+}
+
+const GcStats& VM::gcStats() const
+{
+	return m_gcStats;
+}
+
+void VM::setGcPauseTarget(double milliseconds)
+{
+	m_gcPauseTarget = milliseconds;
+}
+
+SlabOccupancy VM::heapOccupancy(ObjType type) const
+{
+#ifdef SLAB_ALLOCATION
+	switch (type)
+	{
+		case ObjType::STRING:
+			return m_stringPool.occupancy();
+		case ObjType::FUNCTION:
+			return m_functionPool.occupancy();
+		case ObjType::NATIVE:
+			return m_nativePool.occupancy();
+	}
+#else
+	(void)type;
+#endif
+	return {};
+}
+
 inline bool VM::call(ObjFunction* function, int argCount)
 {
 	using namespace std::string_literals;
@@ -80,6 +188,20 @@ inline bool VM::call(ObjFunction* function, int argCount)
 		runtimeError("Expected "s, std::to_string(function->arity), " arguments but got "s, std::to_string(argCount), "."s);
 		return false;
 	}
+#ifdef TIERED_EXECUTION
+	auto jitted = function->function.load(std::memory_order_acquire);
+	if (!jitted && ++function->callCount >= JIT_CALL_THRESHOLD)
+	{
+		tierUp(function, m_stack.getTop() - argCount - 1);
+		jitted = function->function.load(std::memory_order_acquire);
+	}
+	if (jitted)
+		return callJitted(jitted, m_stack.getTop() - argCount - 1, argCount + 1);
+#elif defined(LOX_AOT_RUNTIME)
+	// Calls made by a deoptimized activation go back to native code.
+	if (auto compiled = function->function.load(std::memory_order_acquire))
+		return callJitted(compiled, m_stack.getTop() - argCount - 1, argCount + 1);
+#endif
 	if (m_frameCount == FRAMES_MAX)
 	{
 		runtimeError("Stack overflow.");
@@ -93,6 +215,22 @@ inline bool VM::call(ObjFunction* function, int argCount)
 	return true;
 }
 
+// Runs compiled code over the frame starting at slots (stackTop values are
+// live) and leaves its result where the interpreter expects it.
+inline bool VM::callJitted(JitFn function, Value* slots, int32_t stackTop)
+{
+	int32_t stack_top = stackTop;
+
+	auto status = function(this, m_globalValues.data(), slots, &stack_top);
+	if (status != static_cast<int32_t>(InterpretResult::OK))
+		return false;
+
+	auto result = slots[stack_top - 1];
+	m_stack.getTop() = slots;
+	m_stack.push(result);
+	return true;
+}
+
 inline bool VM::callValue(Value callee, int argCount)
 {
 	if (callee.isObj())
@@ -117,20 +255,106 @@ inline bool VM::callValue(Value callee, int argCount)
 	return false;
 }
 
+// Called by JITed code for functions that are not compiled yet. The callee is
+// interpreted on top of the JIT stack and its result is left in slots[0],
+// where a compiled callee would have put it. It takes the arguments of a
+// compiled function, whose globals it does not need.
+extern "C" __declspec(dllexport) int callInterpreted(VM *vm, Value *, Value *slots, int32_t *stack_top)
+{
+	auto argCount = *stack_top - 1;
+	auto baseFrame = vm->m_frameCount;
+
+	vm->m_stack.getTop() = slots + *stack_top;
+	if (!vm->call(slots[0].asObjFunction(), argCount))
+		return static_cast<int>(InterpretResult::RUNTIME_ERROR);
+	if (vm->m_frameCount > baseFrame)
+	{
+		auto status = vm->run(baseFrame);
+		if (status != InterpretResult::OK)
+			return static_cast<int>(status);
+		vm->m_frame = &vm->m_frames[baseFrame - 1];
+	}
+
+	*stack_top = 1;
+	return static_cast<int>(InterpretResult::OK);
+}
+
+// Called by JITed code when a speculation guard fails at offset. The slots of
+// the native activation (depth values) become an interpreter frame that
+// resumes at the failing instruction, and the result is left in slots[0].
+extern "C" __declspec(dllexport) int deoptimize(VM *vm, ObjFunction *function, Value *slots, int32_t depth, int32_t offset, int32_t *stack_top)
+{
+	function->markGeneric(static_cast<uint32_t>(offset));
+	vm->invalidate(function);
+
+	if (vm->m_frameCount == VM::FRAMES_MAX)
+	{
+		vm->runtimeError("Stack overflow.");
+		return static_cast<int>(InterpretResult::RUNTIME_ERROR);
+	}
+	auto baseFrame = vm->m_frameCount;
+	CallFrame* frame = &vm->m_frames[vm->m_frameCount++];
+	frame->function = function;
+	frame->ip = function->chunk.code() + offset;
+	frame->slots = slots;
+
+	vm->m_stack.getTop() = slots + depth;
+	auto status = vm->run(baseFrame);
+	if (status != InterpretResult::OK)
+		return static_cast<int>(status);
+	vm->m_frame = &vm->m_frames[baseFrame - 1];
+
+	*stack_top = 1;
+	return static_cast<int>(InterpretResult::OK);
+}
+
 void VM::defineNative(std::string_view name, NativeFn function)
 {
 	m_stack.push(Value::Object(Memory::createNative(this, function)));
 
 	m_globalValues.push_back(m_stack.get(0));
 	m_globalNames.emplace_back(name);
+	m_globalStores.push_back(1);
 	auto newIndex = m_globalValues.size() - 1;
 	m_globals[std::string(name)] = Value::Number(newIndex);
 
 	m_stack.pop();
 }
 
+// Drops the native code of function after one of its guards failed. It runs
+// in the interpreter again until it is hot, and the next compilation avoids
+// the speculation that failed.
+void VM::invalidate(ObjFunction* function)
+{
+#ifdef TIERED_EXECUTION
+	retireCode(function);
+#ifdef BACKGROUND_COMPILATION
+	// Code being compiled for the old speculation is dropped once it is done.
+	m_compiling.erase(std::remove_if(m_compiling.begin(), m_compiling.end(), [&](const PendingCompile& pending) {
+		return pending.function == function;
+	}), m_compiling.end());
+#endif
+	function->function.store(nullptr, std::memory_order_release);
+	function->osrEntries.clear();
+	function->callCount = 0;
+	function->backEdges = 0;
+#elif defined(LOX_AOT_RUNTIME)
+	// Nothing can compile a generic version, the code is kept and activations
+	// whose guards fail finish in the interpreter.
+	(void)function;
+#else
+	// Every call goes through the function pointer, recompile right away.
+	if (function->name != nullptr)
+	{
+		retireCode(function);
+		function->function.store(compile(function, 0), std::memory_order_release);
+	}
+#endif
+}
+
+#ifndef LOX_AOT_RUNTIME
 // Helper function that prints the textual LLVM IR of module into a file.
-void llvm_module_to_file(const llvm::Module& module, const char* filename) {
+void llvm_module_to_file(const llvm::Module& module, const std::string& filename) {
 	std::string str;
 	llvm::raw_string_ostream os(str);
 	module.print(os, nullptr);
@@ -139,126 +363,108 @@ void llvm_module_to_file(const llvm::Module& module, const char* filename) {
 	of << os.str();
 }
 
-int test_fn(void* vm, Value* glob, Value* stack, int *stack_top)
-{
-	std::cout << stack[*stack_top - 1] << std::endl;
-	stack[*stack_top] = Value::Number(72);
-	*stack_top = *stack_top + 1;
-	return static_cast<int>(InterpretResult::OK);
-}
-
-void compileFunctions(llvm::Module* module, Chunk* chunk, const std::string& name, llvm::GlobalValue::LinkageTypes Linkage, llvm::StructType* value_type, llvm::PointerType* valutePtr_type, std::vector<llvm::Function*> &functions)
+// optimizeModule, dumping the IR before and after and timing it when the
+// diagnostics ask for it. Files are named after the source file name of the
+// module.
+void optimizeAndReport(const Diagnostics& diagnostics, llvm::TargetMachine* machine, llvm::Module* module, const OptimizationOptions& options)
 {
-	functions.push_back(generade_code(module, chunk, name, Linkage, value_type, valutePtr_type));
-	for (size_t i = 0; i < chunk->constantsSize(); ++i)
+	auto name = module->getSourceFileName();
+	if (diagnostics.enabled(Diagnostics::IR))
 	{
-		auto &constant = chunk->constants()[i];
-		if (constant.isObjFunction())
-		{
-			compileFunctions(module, &constant.asObjFunction()->chunk, constant.asObjFunction()->name->value, llvm::Function::ExternalLinkage, value_type, valutePtr_type, functions);
-		}
+		llvm_module_to_file(*module, diagnostics.path(name + ".pre-opt.ll"));
+		std::cout << "[Pre optimization module] dumped to " << diagnostics.path(name + ".pre-opt.ll") << "\n";
 	}
-}
 
-void setCompiledFunctions(Chunk* chunk, SimpleOrcJIT* jit)
-{
-	for (size_t i = 0; i < chunk->constantsSize(); ++i)
+	llvm::Optional<Timer> topt;
+	if (diagnostics.enabled(Diagnostics::TIMING))
+		topt.emplace();
+
+	optimizeModule(machine, module, options);
+
+	if (topt)
+		std::cout << "[Optimization] " << name << " in " << topt->elapsed() << "s\n";
+	if (diagnostics.enabled(Diagnostics::OPT_IR))
 	{
-		auto &constant = chunk->constants()[i];
-		if (constant.isObjFunction())
-		{
-			llvm::JITSymbol func_sym = jit->find_symbol(constant.asObjFunction()->name->value);
-			if (!func_sym) {
-				DIE << "Unable to find symbol " << "_main_func" << " in module";
-			}
-			JitFn func_ptr =
-				reinterpret_cast<JitFn>(func_sym.getAddress().get());
-			constant.asObjFunction()->function = func_ptr;
-			setCompiledFunctions(&constant.asObjFunction()->chunk, jit);
-		}
+		llvm_module_to_file(*module, diagnostics.path(name + ".post-opt.ll"));
+		std::cout << "[Post optimization module] dumped to " << diagnostics.path(name + ".post-opt.ll") << "\n";
 	}
 }
 
-InterpretResult VM::runJitted()
+int test_fn(void* vm, Value* glob, Value* stack, int *stack_top)
 {
-	m_frame = &m_frames[m_frameCount - 1];
-	//auto start = std::chrono::steady_clock::now();
-	auto verbose = true;
-
-	if (verbose) {
-		std::cout << "Host CPU name: " << llvm::sys::getHostCPUName().str() << "\n";
-		std::cout << "CPU features:\n";
-		llvm::StringMap<bool> host_features;
-		if (llvm::sys::getHostCPUFeatures(host_features)) {
-			int linecount = 0;
-			for (auto& feature : host_features) {
-				if (feature.second) {
-					std::cout << "  " << feature.first().str();
-					if (++linecount % 4 == 0) {
-						std::cout << "\n";
-					}
-				}
-			}
-		}
-		std::cout << "\n";
-	}
+	std::cout << stack[*stack_top - 1] << std::endl;
+	stack[*stack_top] = Value::Number(72);
+	*stack_top = *stack_top + 1;
+	return static_cast<int>(InterpretResult::OK);
+}
 
-	llvm::LLVMContext context;
-	std::unique_ptr<llvm::Module> module(new llvm::Module("Loxmodule", context));
+// Declares the host functions and generates the helpers every JITed module
+// calls into. Each compiled function lives in its own module, so this
+// runs once per module.
+void declareRuntime(llvm::Module* module, llvm::Type* value_type, llvm::PointerType* valutePtr_type)
+{
+	llvm::LLVMContext& context = module->getContext();
 
-	llvm::Type* uint8_type = llvm::Type::getInt8Ty(context);
-	llvm::Type* double_type = llvm::Type::getDoubleTy(context);
-	llvm::Type* uint64_type = llvm::Type::getInt64Ty(context);
 	llvm::Type* int32_type = llvm::Type::getInt32Ty(context);
 	llvm::Type* void_type = llvm::Type::getVoidTy(context);
 
 	llvm::PointerType* voidPtr_type = llvm::Type::getInt8PtrTy(context);
 
-	llvm::StructType* value_type = llvm::StructType::create(context, {uint8_type, double_type}, "Value");
-	llvm::PointerType* valutePtr_type = llvm::PointerType::get(value_type, 0);
-
 	llvm::Function* callError_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {voidPtr_type, int32_type}, false),
-		llvm::Function::ExternalLinkage, "callError", module.get());
+		llvm::Function::ExternalLinkage, "callError", module);
 	//numberError_func->setOnlyReadsMemory();
 	callError_func->setOnlyAccessesArgMemory();
 	callError_func->setDoesNotThrow();
 
 	llvm::Function* numberError_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {voidPtr_type, int32_type}, false),
-		llvm::Function::ExternalLinkage, "numberError", module.get());
+		llvm::Function::ExternalLinkage, "numberError", module);
 	//numberError_func->setOnlyReadsMemory();
 	numberError_func->setOnlyAccessesArgMemory();
 	numberError_func->setDoesNotThrow();
 
 	llvm::Function* variableError_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {voidPtr_type, int32_type, int32_type}, false),
-		llvm::Function::ExternalLinkage, "variableError", module.get());
+		llvm::Function::ExternalLinkage, "variableError", module);
 	//variableError_func->setOnlyReadsMemory();
 	variableError_func->setOnlyAccessesArgMemory();
 	variableError_func->setDoesNotThrow();
 
 	llvm::Function* arityError_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {voidPtr_type, int32_type, int32_type, int32_type}, false),
-		llvm::Function::ExternalLinkage, "arityError", module.get());
+		llvm::Function::ExternalLinkage, "arityError", module);
 	//variableError_func->setOnlyReadsMemory();
 	arityError_func->setOnlyAccessesArgMemory();
 	arityError_func->setDoesNotThrow();
 
+	// It may collect, which reads the stack of every frame: no memory
+	// attribute, the spilled slots have to be stored before it.
 	llvm::Function* concatenate_func = llvm::Function::Create(
 		llvm::FunctionType::get(int32_type,
-								{voidPtr_type, valutePtr_type, valutePtr_type, valutePtr_type, int32_type}, false),
-		llvm::Function::ExternalLinkage, "concatenate", module.get());
-	concatenate_func->setOnlyAccessesArgMemory();
+								{voidPtr_type, valutePtr_type, valutePtr_type, valutePtr_type, valutePtr_type, int32_type}, false),
+		llvm::Function::ExternalLinkage, "concatenate", module);
 	concatenate_func->setDoesNotThrow();
 	//concatenate_func->addAttribute(2, llvm::Attribute::StructRet);
 	//concatenate_func->addAttribute(2, llvm::Attribute::NoAlias);
 	//concatenate_func->addAttribute(3, llvm::Attribute::ByVal);
 	//concatenate_func->addAttribute(4, llvm::Attribute::ByVal);
 
+	llvm::Function* safepoint_func = llvm::Function::Create(
+		llvm::FunctionType::get(void_type, {voidPtr_type, valutePtr_type}, false),
+		llvm::Function::ExternalLinkage, "safepoint", module);
+	safepoint_func->setDoesNotThrow();
+
+	// The address of the flag of a VM does not change.
+	llvm::Function* safepointFlag_func = llvm::Function::Create(
+		llvm::FunctionType::get(llvm::Type::getInt8PtrTy(context), {voidPtr_type}, false),
+		llvm::Function::ExternalLinkage, "safepointFlag", module);
+	safepointFlag_func->setDoesNotAccessMemory();
+	safepointFlag_func->setDoesNotThrow();
+
 	llvm::Function* print_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {valutePtr_type}, false),
-		llvm::Function::ExternalLinkage, "print", module.get());
+		llvm::Function::ExternalLinkage, "print", module);
 	print_func->setOnlyAccessesArgMemory();
 	print_func->setDoesNotThrow();
 
@@ -266,78 +472,512 @@ InterpretResult VM::runJitted()
 	llvm::FunctionType* native_func_type =  llvm::FunctionType::get(value_type,{int32_type, valutePtr_type}, false);
 	llvm::Function* callNative_func = llvm::Function::Create(
 		llvm::FunctionType::get(void_type, {llvm::PointerType::get(native_func_type, 0), int32_type, valutePtr_type, valutePtr_type}, false),
-		llvm::Function::ExternalLinkage, "callNative", module.get());
+		llvm::Function::ExternalLinkage, "callNative", module);
 	callNative_func->setOnlyAccessesArgMemory();
 	callNative_func->setDoesNotThrow();
 
+	llvm::Function::Create(
+		llvm::FunctionType::get(int32_type, {voidPtr_type, valutePtr_type, valutePtr_type, llvm::Type::getInt32PtrTy(context)}, false),
+		llvm::Function::ExternalLinkage, "callInterpreted", module);
 
-	llvm::Function* falsey_func = generate_falsey(module.get(), value_type, valutePtr_type);
-	llvm::Function* equal_func = generate_equal(module.get(), value_type, valutePtr_type);
-	//llvm::Function* jit_func = generade_code(module.get(), &m_frame->function->chunk, "_jit_func", value_type, valutePtr_type);
-	std::vector<llvm::Function*> functions;
-	compileFunctions(module.get(), &m_frame->function->chunk, "_jit_func", llvm::Function::InternalLinkage, value_type, valutePtr_type, functions);
-	static int m_ = 0;
-	std::string main_name = "_main" + std::to_string(m_++);
-	llvm::Function* main_func = generate_main(module.get(), main_name, value_type, valutePtr_type);
+	llvm::Function::Create(
+		llvm::FunctionType::get(int32_type, {voidPtr_type, voidPtr_type, valutePtr_type, int32_type, int32_type, llvm::Type::getInt32PtrTy(context)}, false),
+		llvm::Function::ExternalLinkage, "deoptimize", module);
 
-	if (verbose) {
-		const char* pre_opt_file = "llvmjit-pre-opt.ll";
-		llvm_module_to_file(*module, pre_opt_file);
-		std::cout << "[Pre optimization module] dumped to " << pre_opt_file << "\n";
-	}
+	llvm::Function* falsey_func = generate_falsey(module, value_type, valutePtr_type);
+	llvm::Function* equal_func = generate_equal(module, value_type, valutePtr_type);
 
-	if (llvm::verifyFunction(*main_func, &llvm::errs()))
-		DIE << "Error verifying function.";
-	for(auto func: functions)
-	{
-		if (llvm::verifyFunction(*func, &llvm::errs()))
-			DIE << "Error verifying function.";
-	}
 	if (llvm::verifyFunction(*falsey_func, &llvm::errs()))
 		DIE << "Error verifying function.";
 	if (llvm::verifyFunction(*equal_func, &llvm::errs()))
 		DIE << "Error verifying function.";
+}
+
+// Symbols are looked up in the module that defines them, so the name of a
+// compiled function only has to be the same in every run.
+std::string jitSymbolName(ObjFunction* function, uint32_t entry)
+{
+	auto name = function->name != nullptr ? function->name->value : std::string("_script");
+	return entry == 0 ? name : name + ".osr" + std::to_string(entry);
+}
+
+// Where the references of JITed code point in this run.
+SimpleOrcJIT::LocalSymbols referenceAddresses(const CodeReferences& refs)
+{
+	SimpleOrcJIT::LocalSymbols symbols;
+	for (size_t i = 0; i < refs.objects.size(); ++i)
+		symbols[referenceSymbol(i)] = reinterpret_cast<llvm::JITTargetAddress>(refs.objects[i]);
+	return symbols;
+}
+
+// Lowers a single function into its own module, identified by the key of its
+// code. A non zero entry produces an OSR variant that starts at
+// that bytecode offset. slots, when given, are the values the activation
+// holds at entry right now.
+std::unique_ptr<llvm::Module> generateFunctionModule(VM* vm, ObjFunction* function, const CodeReferences& refs, const std::string& name, llvm::Type* value_type, uint32_t entry = 0, const Value* slots = nullptr)
+{
+	auto module = std::make_unique<llvm::Module>(refs.key, value_type->getContext());
+	// Dumps of the module are named after the function.
+	module->setSourceFileName(name);
+	llvm::PointerType* valutePtr_type = llvm::PointerType::get(value_type, 0);
+
+	declareRuntime(module.get(), value_type, valutePtr_type);
+	llvm::Function* func = generade_code(module.get(), vm, function, refs, name, llvm::Function::ExternalLinkage, value_type, valutePtr_type, entry, slots);
+	if (llvm::verifyFunction(*func, &llvm::errs()))
+		DIE << "Error verifying function.";
+	return module;
+}
 
-	// Optimize the emitted LLVM IR.
-	Timer topt;
+// Without the interpreter tier every function nested in chunk is compiled (or
+// loaded from the object cache) before the script runs. Functions compiled by
+// an earlier interpret call keep their code.
+void VM::setCompiledFunctions(Chunk* chunk)
+{
+	for (size_t i = 0; i < chunk->constantsSize(); ++i)
+	{
+		auto &constant = chunk->constants()[i];
+		if (constant.isObjFunction())
+		{
+			auto function = constant.asObjFunction();
+			if (function->function)
+				continue;
+
+			function->function = compile(function, 0);
+			setCompiledFunctions(&function->chunk);
+		}
+	}
+}
+
+// Code the object cache already holds for the same function, entry and
+// speculation is linked as is, without generating any IR.
+JitFn VM::compile(ObjFunction* function, uint32_t entry, const Value* slots)
+{
+	auto name = jitSymbolName(function, entry);
+	auto refs = codeReferences(this, function, entry, slots);
+	auto symbols = referenceAddresses(refs);
+
+	auto key = m_jit->add_cached_object(refs.key, symbols);
+	if (!key)
+	{
+		auto module = generateFunctionModule(this, function, refs, name, m_valueType, entry, slots);
+		optimizeAndReport(m_diagnostics, &m_jit->get_target_machine(), module.get(), m_optimization);
+		key = m_jit->add_module(std::move(module), symbols);
+	}
+
+	llvm::JITSymbol func_sym = m_jit->find_symbol_in(*key, name);
+	if (!func_sym) {
+		DIE << "Unable to find symbol " << name << " in module";
+	}
+	m_jitModules[function].push_back(*key);
+	m_moduleReferences[*key] = std::move(refs.objects);
+	return reinterpret_cast<JitFn>(func_sym.getAddress().get());
+}
+
+// Called when the code of function is replaced. Activations of the old code
+// may still be on the native stack (a recursive caller, the frame that
+// deoptimized), so its modules are only released by releaseRetiredCode.
+void VM::retireCode(ObjFunction* function)
+{
+	auto &modules = m_jitModules[function];
+	m_retiredModules.insert(m_retiredModules.end(), modules.begin(), modules.end());
+	modules.clear();
+}
+
+// The objects the code of a module refers to, nullptr once it is released.
+const std::vector<sObj*>* VM::moduleReferences(llvm::orc::VModuleKey key)
+{
+	auto references = m_moduleReferences.find(key);
+	return references != m_moduleReferences.end() ? &references->second : nullptr;
+}
+
+void VM::releaseRetiredCode()
+{
+#ifdef BACKGROUND_COMPILATION
+	// The compile threads own the JIT.
+	if (m_retiredModules.empty())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		m_releaseQueue.insert(m_releaseQueue.end(), m_retiredModules.begin(), m_retiredModules.end());
+	}
+	m_compileWake.notify_one();
+#else
+	for (auto key : m_retiredModules)
+		m_jit->remove_module(key);
+#endif
+	for (auto key : m_retiredModules)
+		m_moduleReferences.erase(key);
+	m_retiredModules.clear();
+}
+
+size_t VM::jitCodeSize() const
+{
+	return m_jit->code_size();
+}
+
+void VM::setOptimization(OptimizationOptions options)
+{
+	m_optimization = std::move(options);
+}
+
+const OptimizationOptions& VM::optimization() const
+{
+	return m_optimization;
+}
+
+const Diagnostics& VM::diagnostics() const
+{
+	return m_diagnostics;
+}
+
+const std::string& VM::sourceName() const
+{
+	return m_sourceName;
+}
+
+void VM::setDiagnostics(Diagnostics diagnostics)
+{
+	{
+#ifdef BACKGROUND_COMPILATION
+		// Compile threads report to the copy their job took under
+		// m_compileMutex, and read this one through the JIT under m_jitMutex.
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		std::lock_guard<std::mutex> jit_lock(m_jitMutex);
+#endif
+		m_diagnostics = std::move(diagnostics);
+	}
+
+	if (m_diagnostics.enabled(Diagnostics::HOST))
+	{
+		std::cout << "Host CPU name: " << llvm::sys::getHostCPUName().str() << "\n";
+		std::cout << "CPU features:\n";
+		llvm::StringMap<bool> host_features;
+		if (llvm::sys::getHostCPUFeatures(host_features)) {
+			int linecount = 0;
+			for (auto& feature : host_features) {
+				if (feature.second) {
+					std::cout << "  " << feature.first().str();
+					if (++linecount % 4 == 0) {
+						std::cout << "\n";
+					}
+				}
+			}
+		}
+		std::cout << "\n";
+		m_jit->print_target_machine(std::cout);
+	}
+}
+
+#ifdef BACKGROUND_COMPILATION
+// Generates the IR of function (or of its OSR variant at entry) right away,
+// while the speculation state and slots are current, and queues it for the
+// compile threads. Nothing happens if that variant is queued already.
+void VM::enqueueCompile(ObjFunction* function, uint32_t entry, const Value* slots)
+{
+	for (auto &pending : m_compiling)
+	{
+		if (pending.function == function && pending.entry == entry)
+			return;
+	}
+
+	auto job = std::make_unique<CompileJob>();
+	job->id = m_nextCompileId++;
+	job->function = function;
+	job->entry = entry;
+	job->name = jitSymbolName(function, entry);
+	auto refs = codeReferences(this, function, entry, slots);
+	job->key = refs.key;
+	job->symbols = referenceAddresses(refs);
+	job->optimization = m_optimization;
+	// Compile threads optimize modules while this thread generates the next
+	// one, each module gets a context of its own.
+	job->context = std::make_unique<llvm::LLVMContext>();
+	job->module = generateFunctionModule(this, function, refs, job->name, create_value_type(*job->context), entry, slots);
+
+	m_compiling.push_back({job->id, function, entry, std::move(refs.objects)});
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		job->diagnostics = m_diagnostics;
+		m_compileQueue.push_back(std::move(job));
+	}
+	m_compileWake.notify_one();
+}
 
-	optimizeModule(&m_jit->get_target_machine(), module.get(), 3, 0);
+// Body of the compile threads: link cached objects, optimize and generate
+// machine code, and release retired modules. The expensive part, optimizing
+// and generating code, runs in parallel with a target machine per thread;
+// only adding the result to the JIT is serialized by m_jitMutex.
+void VM::compileInBackground(std::unique_ptr<llvm::TargetMachine> machine)
+{
+	std::unique_lock<std::mutex> lock(m_compileMutex);
+	while (true)
+	{
+		m_compileWake.wait(lock, [this] {
+			return m_stopCompiling || !m_compileQueue.empty() || !m_releaseQueue.empty();
+		});
+		if (m_stopCompiling)
+			return;
+
+		auto release = std::move(m_releaseQueue);
+		m_releaseQueue.clear();
+		std::unique_ptr<CompileJob> job;
+		if (!m_compileQueue.empty())
+		{
+			job = std::move(m_compileQueue.front());
+			m_compileQueue.pop_front();
+		}
+		lock.unlock();
 
-	if (verbose) {
-		std::cout << "[Optimization elapsed:] " << topt.elapsed() << "s\n";
-		const char* post_opt_file = "llvmjit-post-opt.ll";
-		llvm_module_to_file(*module, post_opt_file);
-		std::cout << "[Post optimization module] dumped to " << post_opt_file
-		          << "\n";
+		if (!release.empty())
+		{
+			std::lock_guard<std::mutex> jit_lock(m_jitMutex);
+			for (auto key : release)
+				m_jit->remove_module(key);
+		}
+
+		if (job)
+		{
+			llvm::Optional<llvm::orc::VModuleKey> key;
+			{
+				std::lock_guard<std::mutex> jit_lock(m_jitMutex);
+				key = m_jit->add_cached_object(job->key, job->symbols);
+			}
+			std::unique_ptr<llvm::MemoryBuffer> object;
+			if (!key)
+			{
+				optimizeAndReport(job->diagnostics, machine.get(), job->module.get(), job->optimization);
+				object = m_jit->compile_module(*job->module, *machine, job->diagnostics);
+			}
+			job->module.reset();
+			job->context.reset();
+
+			std::lock_guard<std::mutex> jit_lock(m_jitMutex);
+			if (!key)
+				key = m_jit->add_object(std::move(object), job->symbols);
+			llvm::JITSymbol func_sym = m_jit->find_symbol_in(*key, job->name);
+			if (!func_sym) {
+				DIE << "Unable to find symbol " << job->name << " in module";
+			}
+			job->code = reinterpret_cast<JitFn>(func_sym.getAddress().get());
+			job->moduleKey = *key;
+		}
+
+		lock.lock();
+		if (job)
+		{
+			m_compiledJobs.push_back(std::move(job));
+			m_hasCompiled.store(true, std::memory_order_release);
+		}
+	}
+}
+
+// Publishes the code the compile threads finished. Code of a function that was
+// invalidated after its IR was generated speculates on stale types, it is
+// retired without ever running.
+void VM::installCompiled()
+{
+	if (!m_hasCompiled.load(std::memory_order_acquire))
+		return;
+
+	std::vector<std::unique_ptr<CompileJob>> jobs;
+	{
+		std::lock_guard<std::mutex> lock(m_compileMutex);
+		jobs.swap(m_compiledJobs);
+		m_hasCompiled.store(false, std::memory_order_relaxed);
 	}
 
-	// JIT the optimized LLVM IR to native code and execute it.
-	m_jit->add_module(std::move(module));
+	for (auto &job : jobs)
+	{
+		auto pending = std::find_if(m_compiling.begin(), m_compiling.end(), [&](const PendingCompile& p) {
+			return p.id == job->id;
+		});
+		if (pending == m_compiling.end())
+		{
+			m_retiredModules.push_back(job->moduleKey);
+			continue;
+		}
+		m_moduleReferences[job->moduleKey] = std::move(pending->references);
+		m_compiling.erase(pending);
+
+		m_jitModules[job->function].push_back(job->moduleKey);
+		if (job->entry == 0)
+			job->function->function.store(job->code, std::memory_order_release);
+		else
+			job->function->osrEntries[job->entry] = job->code;
+	}
+}
+#endif
 
-	llvm::JITSymbol main_func_sym = m_jit->find_symbol(main_name);
+// Compiles a function that got hot in the interpreter. Calls made after its
+// code is published (from the interpreter or from JITed code) run the native
+// code. With BACKGROUND_COMPILATION that happens on a later call, call() asks
+// again until then.
+void VM::tierUp(ObjFunction* function, const Value* slots)
+{
+#ifdef BACKGROUND_COMPILATION
+	installCompiled();
+	if (!function->function.load(std::memory_order_relaxed))
+		enqueueCompile(function, 0, slots);
+#else
+	function->function.store(compile(function, 0, slots), std::memory_order_release);
+#endif
+}
+
+// On-stack replacement: the variant of function that finishes the running
+// activation in native code, starting at the loop header entry. nullptr while
+// a compile thread is still working on it, the loop goes on in the
+// interpreter and asks again JIT_OSR_POLL_INTERVAL back edges later.
+JitFn VM::osrVariant(ObjFunction* function, uint32_t entry)
+{
+	// The script itself is never called again, only its loops are worth compiling.
+	if (function->name != nullptr && !function->function)
+		tierUp(function);
+
+#ifdef BACKGROUND_COMPILATION
+	installCompiled();
+	if (auto variant = function->osrEntries[entry])
+		return variant;
+
+	enqueueCompile(function, entry, m_frame->slots);
+	function->backEdges = JIT_BACKEDGE_THRESHOLD - JIT_OSR_POLL_INTERVAL;
+	return nullptr;
+#else
+	auto &variant = function->osrEntries[entry];
+	if (!variant)
+		variant = compile(function, entry, m_frame->slots);
+	return variant;
+#endif
+}
+
+InterpretResult VM::runJitted()
+{
+	m_frame = &m_frames[m_frameCount - 1];
+	// The script and its main wrapper share one module, cached under the key
+	// of the script code.
+	auto refs = codeReferences(this, m_frame->function);
+	auto symbols = referenceAddresses(refs);
+	auto main_key = "main." + refs.key;
+	std::string main_name = "_main";
+
+	auto key = m_jit->add_cached_object(main_key, symbols);
+	if (!key)
+	{
+		// Compiled functions may outlive this call (globals survive between
+		// interpret calls), so their types come from the VM's long lived context.
+		llvm::LLVMContext& context = *m_context;
+		std::unique_ptr<llvm::Module> module(new llvm::Module(main_key, context));
+		module->setSourceFileName("main");
+
+		llvm::Type* value_type = m_valueType;
+		llvm::PointerType* valutePtr_type = llvm::PointerType::get(value_type, 0);
+
+		declareRuntime(module.get(), value_type, valutePtr_type);
+		// The top level script runs exactly once, so it is compiled eagerly.
+		llvm::Function* jit_func = generade_code(module.get(), this, m_frame->function, refs, "_jit_func", llvm::Function::InternalLinkage, value_type, valutePtr_type);
+		llvm::Function* main_func = generate_main(module.get(), main_name, value_type, valutePtr_type);
+
+		if (llvm::verifyFunction(*main_func, &llvm::errs()))
+			DIE << "Error verifying function.";
+		if (llvm::verifyFunction(*jit_func, &llvm::errs()))
+			DIE << "Error verifying function.";
+
+		// Optimize the emitted LLVM IR.
+		optimizeAndReport(m_diagnostics, &m_jit->get_target_machine(), module.get(), m_optimization);
+
+		// JIT the optimized LLVM IR to native code and execute it.
+		key = m_jit->add_module(std::move(module), symbols);
+	}
+
+	llvm::JITSymbol main_func_sym = m_jit->find_symbol_in(*key, main_name);
 	if (!main_func_sym) {
-		DIE << "Unable to find symbol " << "_main_func" << " in module";
+		DIE << "Unable to find symbol " << main_name << " in module";
 	}
 
 	using MainFuncType = int32_t (*)(void*, Value*,  Value*);
 	MainFuncType main_func_ptr =
 			reinterpret_cast<MainFuncType>(main_func_sym.getAddress().get());
 
-	setCompiledFunctions(&m_frame->function->chunk, m_jit.get());
+	setCompiledFunctions(&m_frame->function->chunk);
 
 	auto vm_ = this;
 	auto globals = m_globalValues.data();
 	auto stack = &m_stack.get(0);
 
-	auto result = main_func_ptr(vm_, globals, stack);
+	m_scriptModule = *key;
+	m_moduleReferences[*key] = std::move(refs.objects);
+	auto result = main_func_ptr(vm_, globals, stack);
+	m_moduleReferences.erase(*key);
+	m_scriptModule = 0;
+
+	// The script ran to completion and nothing refers to its code, only the
+	// functions it defined stay compiled. A REPL session keeps one script
+	// module at a time instead of one per line.
+	m_jit->remove_module(*key);
+
+	return static_cast<InterpretResult>(result);
+}
+
+// Compiles source and writes its native code, with everything the runtime
+// library needs to run it, to the object file at path (see aot.hpp).
+InterpretResult VM::compileToObject(const std::string &source, const std::string &path)
+{
+	auto function = m_compiler.compile(this, source.data());
+	if (!function)
+		return InterpretResult::COMPILE_ERROR;
+
+	emitObjectFile(this, function, path);
+	return InterpretResult::OK;
+}
+#endif
+
+// The slow path of ADD for the operands on top of the stack when they are not
+// both numbers: strings are concatenated with strings or numbers. The
+// instruction, size bytes before ip, is marked generic so the JIT does not
+// speculate on it.
+bool VM::addObjects(uint32_t size)
+{
+	auto function = m_frame->function;
+	function->markGeneric(static_cast<uint32_t>(m_frame->ip - size - function->chunk.code()));
 
-	return static_cast<InterpretResult>(result);
+	if (m_stack.top().isObjString() && m_stack.peek(1).isObjString())
+	{
+		concatenate<std::string, std::string>();
+	}
+	else if(m_stack.top().isObjString() && m_stack.peek(1).isNumber())
+	{
+		concatenate<double, std::string>();
+	}
+	else if(m_stack.top().isNumber() && m_stack.peek(1).isObjString())
+	{
+		concatenate<std::string, double>();
+	}
+	else
+	{
+		runtimeError("Operands must be numbers or strings.");
+		return false;
+	}
+	return true;
 }
 
-InterpretResult VM::run()
+#ifdef DIRECT_THREADING
+// Translates the code of function into the handler address of every
+// instruction, at the offset of its opcode. Operand bytes stay null.
+static void* const* threadCode(ObjFunction* function, void* const* dispatchTable)
 {
-	m_frame = &m_frames[m_frameCount - 1];
+	auto& threaded = function->threaded;
+	if (threaded.empty())
+	{
+		auto& chunk = function->chunk;
+		threaded.resize(chunk.size());
+		for (size_t offset = 0; offset < chunk.size(); offset += instructionSize(chunk.get(offset)))
+			threaded[offset] = dispatchTable[chunk.get(offset)];
+	}
+	return threaded.data();
+}
+#endif
 
+InterpretResult VM::run(uint32_t baseFrame)
+{
 #ifdef DEBUG_TRACE_EXECUTION
 #define DEBUG_TRACE() debugTrace()
 #else
@@ -346,28 +986,44 @@ InterpretResult VM::run()
 
 #ifdef COMPUTED_GOTO
 
-#define INTERPRET_LOOP BREAK;
+#define INTERPRET_LOOP LOAD_FRAME(); BREAK;
 #define CASE(name) OP_##name
-#define BREAK DEBUG_TRACE(); goto *dispatchTable[instruction=readByte()]
 
-	static void* dispatchTable[] = {
+	static void* const dispatchTable[] = {
 #define OPCODE(name) &&OP_##name,
 #include "op_codes.hpp"
 #undef OPCODE
 	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == OpCode::COUNT,
+		"the dispatch table has to follow op_codes.hpp");
+
+#ifdef DIRECT_THREADING
+	// Handlers of the code of the current frame, and its first byte.
+	void* const* handlers = nullptr;
+	const uint8_t* code = nullptr;
+#define LOAD_FRAME()                                              \
+	m_frame = &m_frames[m_frameCount - 1];                        \
+	handlers = threadCode(m_frame->function, dispatchTable);      \
+	code = m_frame->function->chunk.code()
+#define BREAK DEBUG_TRACE(); goto *handlers[m_frame->ip++ - code]
+#else
+#define LOAD_FRAME() m_frame = &m_frames[m_frameCount - 1]
+#define BREAK DEBUG_TRACE(); goto *dispatchTable[readByte()]
+#endif
 
 #else
 #define INTERPRET_LOOP                          \
 	using namespace OpCode;                     \
+	LOAD_FRAME();                               \
 	loop:                                       \
 		DEBUG_TRACE()                           \
-		switch(instruction = readByte())
+		switch(readByte())
 
+#define LOAD_FRAME() m_frame = &m_frames[m_frameCount - 1]
 #define CASE(name) case name
 #define BREAK goto loop
 #endif
 
-	uint8_t instruction;
 	INTERPRET_LOOP
 	{
 
@@ -523,21 +1179,8 @@ InterpretResult VM::run()
 				auto a = m_stack.top().asNumber();
 				m_stack.top() = Value::Number(a + b);
 			}
-			else if (m_stack.top().isObjString() && m_stack.peek(1).isObjString())
-			{
-				concatenate<std::string, std::string>();
-			}
-			else if(m_stack.top().isObjString() && m_stack.peek(1).isNumber())
-			{
-				concatenate<double, std::string>();
-			}
-			else if(m_stack.top().isNumber() && m_stack.peek(1).isObjString())
-			{
-				concatenate<std::string, double>();
-			}
-			else
+			else if (!addObjects(1))
 			{
-				runtimeError("Operands must be numbers or strings.");
 				return InterpretResult::RUNTIME_ERROR;
 			}
 			BREAK;
@@ -617,6 +1260,28 @@ InterpretResult VM::run()
 		{
 			auto offset = readShort();
 			m_frame->ip -= offset;
+#ifdef TIERED_EXECUTION
+			auto function = m_frame->function;
+			if (++function->backEdges >= JIT_BACKEDGE_THRESHOLD)
+			{
+				// Hot loop, the rest of this activation runs in native code. The
+				// result is left on the stack as if the frame had returned.
+				if (auto variant = osrVariant(function, static_cast<uint32_t>(m_frame->ip - function->chunk.code())))
+				{
+					auto slots = m_frame->slots;
+					if (!callJitted(variant, slots, static_cast<int32_t>(m_stack.getTop() - slots)))
+						return InterpretResult::RUNTIME_ERROR;
+
+					m_frameCount--;
+					if (m_frameCount <= baseFrame)
+						return InterpretResult::OK;
+					LOAD_FRAME();
+				}
+			}
+#endif
+			// The stack holds the live values of the frame.
+			if (m_safepointRequested)
+				Memory::safepoint(this);
 			BREAK;
 		}
 		CASE(CALL):
@@ -626,7 +1291,7 @@ InterpretResult VM::run()
 			{
 				return InterpretResult::RUNTIME_ERROR;
 			}
-			m_frame = &m_frames[m_frameCount - 1];
+			LOAD_FRAME();
 			BREAK;
 		}
 		CASE(RETURN):
@@ -634,23 +1299,437 @@ InterpretResult VM::run()
 			Value result = m_stack.pop();
 
 			m_frameCount--;
-			if (m_frameCount <= 0)
+			m_stack.getTop() = m_frame->slots;
+			m_stack.push(result);
+
+			// Nested runs (see callInterpreted) stop once their own frames are gone.
+			if (m_frameCount <= baseFrame)
 				return InterpretResult::OK;
 
+			LOAD_FRAME();
+			BREAK;
+		}
+		CASE(NOT_EQUAL):
+		{
+			auto b = m_stack.pop();
+			auto a = m_stack.top();
+			m_stack.top() = Value::Bool(!(a == b));
+			BREAK;
+		}
+		CASE(GREATER_EQUAL):
+		{
+			// As LESS NOT, NaN compares greater or equal.
+			auto status = binaryOp(Value::Bool, [](double a, double b) { return !(a < b); });
+			if (status != InterpretResult::OK)
+				return status;
+			BREAK;
+		}
+		CASE(LESS_EQUAL):
+		{
+			auto status = binaryOp(Value::Bool, [](double a, double b) { return !(a > b); });
+			if (status != InterpretResult::OK)
+				return status;
+			BREAK;
+		}
+		CASE(SET_LOCAL_POP):
+		{
+			auto slot = readByte();
+			m_frame->slots[slot] = m_stack.pop();
+			BREAK;
+		}
+		CASE(ADD_LOCAL_LOCAL):
+		{
+			auto a = m_frame->slots[readByte()];
+			auto b = m_frame->slots[readByte()];
+			if (a.isNumber() && b.isNumber())
+			{
+				m_stack.push(Value::Number(a.asNumber() + b.asNumber()));
+			}
+			else
+			{
+				m_stack.push(a);
+				m_stack.push(b);
+				if (!addObjects(3))
+					return InterpretResult::RUNTIME_ERROR;
+			}
+			BREAK;
+		}
+		CASE(MULTIPLY_LOCAL_LOCAL):
+		{
+			auto a = m_frame->slots[readByte()];
+			auto b = m_frame->slots[readByte()];
+			if (!a.isNumber() || !b.isNumber())
+			{
+				runtimeError("Operands must be numbers.");
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			m_stack.push(Value::Number(a.asNumber() * b.asNumber()));
+			BREAK;
+		}
+		CASE(INC_LOCAL_CONST):
+		{
+			auto slot = readByte();
+			auto constant = readConstant();
+			auto &local = m_frame->slots[slot];
+			if (local.isNumber())
+			{
+				local = Value::Number(local.asNumber() + constant.asNumber());
+			}
+			else
+			{
+				m_stack.push(local);
+				m_stack.push(constant);
+				if (!addObjects(3))
+					return InterpretResult::RUNTIME_ERROR;
+				m_frame->slots[slot] = m_stack.pop();
+			}
+			BREAK;
+		}
+		CASE(LESS_JUMP_IF_FALSE):
+		{
+			auto offset = readShort();
+			auto status = binaryOp(Value::Bool, std::less<>());
+			if (status != InterpretResult::OK)
+				return status;
+			m_frame->ip += !m_stack.top().asBool() * offset;
+			BREAK;
+		}
+		CASE(GREATER_JUMP_IF_FALSE):
+		{
+			auto offset = readShort();
+			auto status = binaryOp(Value::Bool, std::greater<>());
+			if (status != InterpretResult::OK)
+				return status;
+			m_frame->ip += !m_stack.top().asBool() * offset;
+			BREAK;
+		}
+
+	}
 
-			m_stack.getTop() = m_frame->slots;
-			m_stack.push(result);
+	return InterpretResult::RUNTIME_ERROR;
+
+#undef BREAK
+#undef LOAD_FRAME
+#undef CASE
+#undef INTERPRET_LOOP
+#undef DEBUG_TRACE
+}
+
+#ifdef REGISTER_VM
+// Points ip of the frame past the stack instruction the register instruction
+// stands for, where runtime errors and generic sites look for it.
+void VM::syncIp(const RegisterInstruction* instruction)
+{
+	auto function = m_frame->function;
+	auto offset = function->registers.sites[instruction - function->registers.code.data()].offset;
+	m_frame->ip = function->chunk.code() + offset + instructionSize(function->chunk.get(offset));
+}
+
+// Runs the frames from baseFrame on in register form. Callees without one run
+// in the stack code.
+InterpretResult VM::runRegisters(uint32_t baseFrame)
+{
+	m_frame = &m_frames[m_frameCount - 1];
+	if (m_frame->function->registers.code.empty())
+		return run(baseFrame);
+	m_frame->pc = m_frame->function->registers.code.data();
+
+	const RegisterInstruction* instruction;
+	const RegisterInstruction* pc;
+	const RegisterInstruction* code;
+	const Value* constants;
+	Value* slots;
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define DEBUG_TRACE() disassembleRegisterInstruction(m_frame->function->registers, pc - code)
+#else
+#define DEBUG_TRACE()
+#endif
+
+#define LOAD_FRAME()                                              \
+	m_frame = &m_frames[m_frameCount - 1];                        \
+	code = m_frame->function->registers.code.data();              \
+	constants = m_frame->function->registers.constants.data();    \
+	slots = m_frame->slots;                                       \
+	pc = m_frame->pc
+
+#ifdef COMPUTED_GOTO
+
+#define INTERPRET_LOOP LOAD_FRAME(); BREAK;
+#define CASE(name) OP_##name
+#define BREAK DEBUG_TRACE(); instruction = pc++; goto *dispatchTable[instruction->op]
+
+	static void* const dispatchTable[] = {
+#define OPCODE(name) &&OP_##name,
+#include "register_op_codes.hpp"
+#undef OPCODE
+	};
+	static_assert(sizeof(dispatchTable) / sizeof(dispatchTable[0]) == RegisterOp::COUNT,
+		"the dispatch table has to follow register_op_codes.hpp");
 
-			m_frame = &m_frames[m_frameCount - 1];
+#else
+#define INTERPRET_LOOP                          \
+	using namespace RegisterOp;                 \
+	LOAD_FRAME();                               \
+	loop:                                       \
+		DEBUG_TRACE();                          \
+		instruction = pc++;                     \
+		switch(instruction->op)
+
+#define CASE(name) case name
+#define BREAK goto loop
+#endif
+
+#define R(operand) slots[operand]
+#define RK(operand) ((operand) & RK_CONSTANT ? constants[(operand) & ~RK_CONSTANT] : slots[operand])
+#define NUMBERS(result)                                       \
+	{                                                         \
+		auto b = RK(instruction->b);                          \
+		auto c = RK(instruction->c);                          \
+		if (!b.isNumber() || !c.isNumber())                   \
+		{                                                     \
+			syncIp(instruction);                              \
+			runtimeError("Operands must be numbers.");        \
+			return InterpretResult::RUNTIME_ERROR;            \
+		}                                                     \
+		auto x = b.asNumber();                                \
+		auto y = c.asNumber();                                \
+		R(instruction->a) = result;                           \
+		BREAK;                                                \
+	}
+
+	INTERPRET_LOOP
+	{
+		CASE(MOVE):
+		{
+			R(instruction->a) = RK(instruction->b);
+			BREAK;
+		}
+		CASE(GET_GLOBAL):
+		{
+			using namespace std::string_literals;
+			auto value = m_globalValues[instruction->b];
+			if (value.isUndefined())
+			{
+				syncIp(instruction);
+				runtimeError("Undefined variable "s, m_globalNames[instruction->b], "."s);
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			R(instruction->a) = value;
+			BREAK;
+		}
+		CASE(DEFINE_GLOBAL):
+		{
+			m_globalValues[instruction->a] = RK(instruction->b);
+			BREAK;
+		}
+		CASE(SET_GLOBAL):
+		{
+			using namespace std::string_literals;
+			if (m_globalValues[instruction->a].isUndefined())
+			{
+				syncIp(instruction);
+				runtimeError("Undefined variable "s, m_globalNames[instruction->a], "."s);
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			m_globalValues[instruction->a] = RK(instruction->b);
+			BREAK;
+		}
+		CASE(EQUAL):
+		{
+			R(instruction->a) = Value::Bool(RK(instruction->b) == RK(instruction->c));
+			BREAK;
+		}
+		CASE(NOT_EQUAL):
+		{
+			R(instruction->a) = Value::Bool(!(RK(instruction->b) == RK(instruction->c)));
+			BREAK;
+		}
+		CASE(GREATER):
+			NUMBERS(Value::Bool(x > y))
+		CASE(LESS):
+			NUMBERS(Value::Bool(x < y))
+		CASE(GREATER_EQUAL):
+			NUMBERS(Value::Bool(!(x < y)))
+		CASE(LESS_EQUAL):
+			NUMBERS(Value::Bool(!(x > y)))
+		CASE(ADD):
+		{
+			auto b = RK(instruction->b);
+			auto c = RK(instruction->c);
+			if (b.isNumber() && c.isNumber())
+			{
+				R(instruction->a) = Value::Number(b.asNumber() + c.asNumber());
+				BREAK;
+			}
+			// The slow path of the stack code, over the slots live below.
+			syncIp(instruction);
+			auto &site = m_frame->function->registers.sites[instruction - code];
+			m_stack.getTop() = slots + site.depth;
+			m_stack.push(b);
+			m_stack.push(c);
+			if (!addObjects(instructionSize(m_frame->function->chunk.get(site.offset))))
+				return InterpretResult::RUNTIME_ERROR;
+			R(instruction->a) = m_stack.pop();
+			BREAK;
+		}
+		CASE(SUBTRACT):
+			NUMBERS(Value::Number(x - y))
+		CASE(MULTIPLY):
+			NUMBERS(Value::Number(x * y))
+		CASE(DIVIDE):
+			NUMBERS(Value::Number(x / y))
+		CASE(MODULO):
+			NUMBERS(Value::Number(std::fmod(x, y)))
+		CASE(NOT):
+		{
+			R(instruction->a) = Value::Bool(isFalsey(RK(instruction->b)));
+			BREAK;
+		}
+		CASE(NEGATE):
+		{
+			auto value = RK(instruction->b);
+			if (!value.isNumber())
+			{
+				syncIp(instruction);
+				runtimeError("Operand must be a number.");
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			R(instruction->a) = Value::Number(-value.asNumber());
+			BREAK;
+		}
+		CASE(PRINT):
+		{
+			std::cout << RK(instruction->a) << std::endl;
+			BREAK;
+		}
+		CASE(JUMP):
+		{
+			pc = code + instruction->a;
+			BREAK;
+		}
+		CASE(JUMP_IF_FALSE):
+		{
+			if (isFalsey(RK(instruction->b)))
+				pc = code + instruction->a;
+			BREAK;
+		}
+		CASE(JUMP_IF_TRUE):
+		{
+			if (!isFalsey(RK(instruction->b)))
+				pc = code + instruction->a;
+			BREAK;
+		}
+		CASE(LESS_JUMP_IF_FALSE):
+		{
+			auto b = RK(instruction->b);
+			auto c = RK(instruction->c);
+			if (!b.isNumber() || !c.isNumber())
+			{
+				syncIp(instruction);
+				runtimeError("Operands must be numbers.");
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			if (!(b.asNumber() < c.asNumber()))
+				pc = code + instruction->a;
+			BREAK;
+		}
+		CASE(GREATER_JUMP_IF_FALSE):
+		{
+			auto b = RK(instruction->b);
+			auto c = RK(instruction->c);
+			if (!b.isNumber() || !c.isNumber())
+			{
+				syncIp(instruction);
+				runtimeError("Operands must be numbers.");
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			if (!(b.asNumber() > c.asNumber()))
+				pc = code + instruction->a;
 			BREAK;
 		}
+		CASE(JUMP_BACK):
+		{
+			pc = code + instruction->a;
+#ifdef TIERED_EXECUTION
+			auto function = m_frame->function;
+			if (++function->backEdges >= JIT_BACKEDGE_THRESHOLD)
+			{
+				// As in the stack code, the slots hold the stack of the loop header.
+				auto header = instruction->b | static_cast<uint32_t>(instruction->c) << 16u;
+				if (auto variant = osrVariant(function, header))
+				{
+					auto depth = function->registers.sites[instruction - code].depth;
+					if (!callJitted(variant, slots, static_cast<int32_t>(depth)))
+						return InterpretResult::RUNTIME_ERROR;
+
+					m_frameCount--;
+					if (m_frameCount <= baseFrame)
+						return InterpretResult::OK;
+					LOAD_FRAME();
+				}
+			}
+#endif
+			if (m_safepointRequested)
+			{
+				m_stack.getTop() = slots + m_frame->function->registers.sites[instruction - code].depth;
+				Memory::safepoint(this);
+			}
+			BREAK;
+		}
+		CASE(CALL):
+		{
+			auto frameCount = m_frameCount;
+			auto argCount = instruction->b;
+			syncIp(instruction);
+			m_frame->pc = pc;
+			m_stack.getTop() = slots + instruction->a + argCount + 1;
+			if (!callValue(R(instruction->a), argCount))
+			{
+				return InterpretResult::RUNTIME_ERROR;
+			}
+			if (m_frameCount > frameCount)
+			{
+				auto callee = &m_frames[m_frameCount - 1];
+				if (callee->function->registers.code.empty())
+				{
+					auto status = run(m_frameCount - 1);
+					if (status != InterpretResult::OK)
+						return status;
+				}
+				else
+				{
+					callee->pc = callee->function->registers.code.data();
+				}
+			}
+			LOAD_FRAME();
+			BREAK;
+		}
+		CASE(RETURN):
+		{
+			Value result = RK(instruction->a);
+
+			m_frameCount--;
+			m_stack.getTop() = slots;
+			m_stack.push(result);
+
+			if (m_frameCount <= baseFrame)
+				return InterpretResult::OK;
 
+			LOAD_FRAME();
+			BREAK;
+		}
 	}
 
 	return InterpretResult::RUNTIME_ERROR;
 
+#undef NUMBERS
+#undef RK
+#undef R
 #undef BREAK
+#undef LOAD_FRAME
 #undef CASE
 #undef INTERPRET_LOOP
 #undef DEBUG_TRACE
-}
\ No newline at end of file
+}
+#endif
@@ -5,14 +5,24 @@
 #ifndef CPPLOX_VM_HPP
 #define CPPLOX_VM_HPP
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 #include "compiler.hpp"
 #include "chunk.hpp"
 #include "stack.hpp"
 #include "hashTable.hpp"
 #include "object.hpp"
+#include "slab.hpp"
+#ifndef LOX_AOT_RUNTIME
 #include "llvm_jit_utils.hpp"
+#endif
 
 enum class InterpretResult
 {
@@ -28,9 +38,13 @@ extern "C"
 	void __declspec(dllexport) variableError(VM *vm, uint32_t pos, uint32_t pc);
 	void __declspec(dllexport) arityError(VM *vm, uint32_t arity, uint32_t arg_count, uint32_t pc);
 	bool __declspec(dllexport) equal(Value *a, Value *b);
-	int __declspec(dllexport) concatenate(VM *vm, Value *out, Value *a, Value *b, uint32_t pc);
+	int __declspec(dllexport) concatenate(VM *vm, Value *out, Value *a, Value *b, Value *top, uint32_t pc);
+	void __declspec(dllexport) safepoint(VM *vm, Value *top);
+	uint8_t* __declspec(dllexport) safepointFlag(VM *vm);
 	void __declspec(dllexport) print(Value* val);
 	void __declspec(dllexport) callNative(NativeFn fun, uint32_t argCount, Value *args, Value *out);
+	int __declspec(dllexport) callInterpreted(VM *vm, Value *globals, Value *slots, int32_t *stack_top);
+	int __declspec(dllexport) deoptimize(VM *vm, ObjFunction *function, Value *slots, int32_t depth, int32_t offset, int32_t *stack_top);
 }
 
 struct CallFrame
@@ -38,6 +52,37 @@ struct CallFrame
 	ObjFunction* function;
 	uint8_t* ip;
 	Value* slots;
+#ifdef REGISTER_VM
+	// Where the register code of the frame goes on once its callee returns.
+	const RegisterInstruction* pc;
+#endif
+};
+
+// What the collector (Memory::collectGarbage) did since the VM started.
+// Pauses are in milliseconds.
+struct GcStats
+{
+	uint32_t collections = 0;
+	uint32_t minorCollections = 0;
+	size_t bytesFreed = 0;
+	// Bytes of the young strings moved to the heap.
+	size_t bytesPromoted = 0;
+	// Pauses of the cycles run a bit at a time (see Memory::collectStep).
+	uint32_t increments = 0;
+	double totalPause = 0.0;
+	double maxPause = 0.0;
+	// Pauses of every kind by duration: pauses[0] counts the ones under a
+	// microsecond, pauses[i] those from 2^(i-1) up to 2^i microseconds and the
+	// last one the longer ones.
+	static constexpr size_t PAUSE_BUCKETS = 20;
+	std::array<uint32_t, PAUSE_BUCKETS> pauses{};
+};
+
+enum class GcPhase : uint8_t
+{
+	IDLE,
+	MARKING,
+	SWEEPING,
 };
 
 class VM
@@ -47,10 +92,35 @@ class VM
 public:
 	VM();
 	~VM();
-	InterpretResult interpret(const std::string &source);
+	// name is the file source comes from, for the line info of JITed code.
+	InterpretResult interpret(const std::string &source, const std::string &name = "<stdin>");
+#ifndef LOX_AOT_RUNTIME
+	InterpretResult compileToObject(const std::string &source, const std::string &path);
+	// Bytes of native code and data the JIT keeps loaded.
+	size_t jitCodeSize() const;
+	// How compiled code is optimized, -O3 unless changed. Set it before
+	// running code, functions compiled already are not compiled again.
+	void setOptimization(OptimizationOptions options);
+	const OptimizationOptions& optimization() const;
+	// What the JIT reports about its work, nothing unless changed.
+	void setDiagnostics(Diagnostics diagnostics);
+	const Diagnostics& diagnostics() const;
+	// Name of the source last interpreted.
+	const std::string& sourceName() const;
+#else
+	InterpretResult runImage(const uint8_t* image, uint32_t size, void* const* objects, const JitFn* entries);
+#endif
 	HashTable<std::string, Value>& globalsMap();
 	std::vector<std::string>& globalNames();
 	std::vector<Value>& globalValues();
+	std::vector<uint32_t>& globalStores();
+	const GcStats& gcStats() const;
+	// Longest the collector runs at a time, in milliseconds, GC_PAUSE_TARGET
+	// unless changed. Under DEBUG_STRESS_GC collections still run whole.
+	void setGcPauseTarget(double milliseconds);
+	// How full the pages of the objects of type are, nothing without
+	// SLAB_ALLOCATION. Young strings are not counted.
+	SlabOccupancy heapOccupancy(ObjType type) const;
 
 	friend class Memory;
 
@@ -58,15 +128,36 @@ private:
 	bool call(ObjFunction* function, int argCount);
 	bool callValue(Value callee, int argCount);
 	void defineNative(std::string_view name, NativeFn function);
-	InterpretResult run();
+	bool callJitted(JitFn function, Value* slots, int32_t stackTop);
+	InterpretResult run(uint32_t baseFrame = 0);
+#ifdef REGISTER_VM
+	InterpretResult runRegisters(uint32_t baseFrame = 0);
+	void syncIp(const RegisterInstruction* instruction);
+#endif
+#ifndef LOX_AOT_RUNTIME
 	void prepareJit();
+	void setCompiledFunctions(Chunk* chunk);
 	InterpretResult runJitted();
+	JitFn compile(ObjFunction* function, uint32_t entry, const Value* slots = nullptr);
+	void retireCode(ObjFunction* function);
+	const std::vector<sObj*>* moduleReferences(llvm::orc::VModuleKey key);
+	void releaseRetiredCode();
+	void tierUp(ObjFunction* function, const Value* slots = nullptr);
+	JitFn osrVariant(ObjFunction* function, uint32_t entry);
+#ifdef BACKGROUND_COMPILATION
+	void enqueueCompile(ObjFunction* function, uint32_t entry, const Value* slots);
+	void compileInBackground(std::unique_ptr<llvm::TargetMachine> machine);
+	void installCompiled();
+#endif
+#endif
+	void invalidate(ObjFunction* function);
 	uint8_t readByte();
 	uint16_t readShort();
 	uint32_t readLong();
 	Value readConstant();
 	Value readConstantLong();
 	bool isFalsey(const Value &value);
+	bool addObjects(uint32_t size);
 	void debugTrace();
 
 	template <typename _Val, typename _Op>
@@ -88,10 +179,108 @@ private:
 	HashTable<std::string, Value> m_globals;
 	std::vector<std::string> m_globalNames;
 	std::vector<Value> m_globalValues;
+	// Number of DEFINE_GLOBAL/SET_GLOBAL instructions compiled for each global.
+	std::vector<uint32_t> m_globalStores;
 
 	Compiler m_compiler;
 	Obj *m_objects = nullptr;
+#ifdef SLAB_ALLOCATION
+	SlabPool<ObjString> m_stringPool;
+	SlabPool<ObjFunction> m_functionPool;
+	SlabPool<ObjNative> m_nativePool;
+#endif
+	// Bytes of the objects in m_objects (see Memory::objectSize) and the
+	// amount that starts the next collection.
+	size_t m_bytesAllocated = 0;
+	size_t m_nextGC = GC_INITIAL_THRESHOLD;
+	// Objects marked but not scanned yet by the running collection.
+	std::vector<sObj*> m_grayStack;
+	GcStats m_gcStats;
+	GcPhase m_gcPhase = GcPhase::IDLE;
+	// The link to the next object to sweep, m_objects or the next of the last
+	// object kept.
+	sObj** m_sweepLink = nullptr;
+	double m_gcPauseTarget = GC_PAUSE_TARGET;
+	std::chrono::steady_clock::time_point m_lastGcPause;
+	// Young strings (see Memory::createYoungString) are placed one after the
+	// other from the start of m_nursery up to m_nurseryTop.
+	using NurserySlot = std::aligned_storage_t<sizeof(ObjString), alignof(ObjString)>;
+	std::unique_ptr<NurserySlot[]> m_nursery;
+	NurserySlot* m_nurseryTop = nullptr;
+	NurserySlot* m_nurseryEnd = nullptr;
+	// Bytes of the characters of the young strings.
+	size_t m_nurseryBytes = 0;
+	// Polled at back edges, which stop at a safepoint while it is set (see
+	// Memory::safepoint): while a cycle is running, and always under
+	// DEBUG_STRESS_GC.
+	uint8_t m_safepointRequested = 0;
+#ifndef LOX_AOT_RUNTIME
+	std::unique_ptr<llvm::LLVMContext> m_context;
+	// Created once, a named struct would be renamed (and leaked) on every
+	// create_value_type call in the long lived context.
+	llvm::Type* m_valueType = nullptr;
+	// Referred to by m_jit.
+	Diagnostics m_diagnostics;
 	std::unique_ptr<SimpleOrcJIT> m_jit;
+	OptimizationOptions m_optimization;
+	std::string m_sourceName;
+	// Modules holding the compiled code of each function, its entry and its
+	// OSR variants.
+	HashTable<ObjFunction*, std::vector<llvm::orc::VModuleKey>> m_jitModules;
+	// Modules no function refers to anymore. Native frames may still be
+	// running them, they are released when interpret returns.
+	std::vector<llvm::orc::VModuleKey> m_retiredModules;
+	// The objects the code of each module refers to (see CodeReferences).
+	// Code is not scanned, the collector marks them with the function owning
+	// the module, or as roots while the module is retired or runs the script.
+	HashTable<llvm::orc::VModuleKey, std::vector<sObj*>> m_moduleReferences;
+	llvm::orc::VModuleKey m_scriptModule = 0;
+#ifdef BACKGROUND_COMPILATION
+	// A function (or OSR variant) whose IR is generated, waiting for a
+	// compile thread to turn it into machine code.
+	struct CompileJob
+	{
+		uint32_t id;
+		ObjFunction* function;
+		uint32_t entry;
+		std::string name;
+		std::string key;
+		SimpleOrcJIT::LocalSymbols symbols;
+		OptimizationOptions optimization;
+		// The compile thread reports to these, m_diagnostics may change meanwhile.
+		Diagnostics diagnostics;
+		std::unique_ptr<llvm::LLVMContext> context;
+		std::unique_ptr<llvm::Module> module;
+		// Set by the compile thread that took the job.
+		JitFn code = nullptr;
+		llvm::orc::VModuleKey moduleKey = 0;
+	};
+	struct PendingCompile
+	{
+		uint32_t id;
+		ObjFunction* function;
+		uint32_t entry;
+		std::vector<sObj*> references;
+	};
+	// Jobs handed to the compile threads and not installed yet. Only the
+	// interpreting thread uses it, invalidate cancels jobs by removing them.
+	std::vector<PendingCompile> m_compiling;
+	uint32_t m_nextCompileId = 0;
+
+	std::vector<std::thread> m_compileThreads;
+	// SimpleOrcJIT is not thread safe, the compile threads take turns.
+	std::mutex m_jitMutex;
+	// Guards everything below.
+	std::mutex m_compileMutex;
+	std::condition_variable m_compileWake;
+	std::deque<std::unique_ptr<CompileJob>> m_compileQueue;
+	std::vector<std::unique_ptr<CompileJob>> m_compiledJobs;
+	std::vector<llvm::orc::VModuleKey> m_releaseQueue;
+	bool m_stopCompiling = false;
+	// Set while m_compiledJobs is not empty, polled without the lock.
+	std::atomic<bool> m_hasCompiled{false};
+#endif
+#endif
 
 
 	friend void callError(VM *vm, uint32_t pc);
@@ -99,8 +288,12 @@ private:
 	friend void variableError(VM *vm, uint32_t pos, uint32_t pc);
 	friend void arityError(VM *vm, uint32_t arity, uint32_t arg_count, uint32_t pc);
 	friend bool equal(Value *a, Value *b);
-	friend int concatenate(VM *vm, Value *out, Value *a, Value *b, uint32_t pc);
+	friend int concatenate(VM *vm, Value *out, Value *a, Value *b, Value *top, uint32_t pc);
+	friend void safepoint(VM *vm, Value *top);
+	friend uint8_t* safepointFlag(VM *vm);
 	friend void print(Value* val);
+	friend int callInterpreted(VM *vm, Value *globals, Value *slots, int32_t *stack_top);
+	friend int deoptimize(VM *vm, ObjFunction *function, Value *slots, int32_t depth, int32_t offset, int32_t *stack_top);
 
 };
 
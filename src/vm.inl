@@ -67,7 +67,7 @@ inline void VM::concatenate()
 		{
 			auto b = m_stack.pop().asObjString()->value;
 			auto a = m_stack.top().asObjString()->value;
-			m_stack.top() = Value::Object(Memory::createString(this, a + b));
+			m_stack.top() = Value::Object(Memory::createYoungString(this, a + b));
 		}
 		else if constexpr (std::is_same<double, _Val_b>::value)
 		{
@@ -75,7 +75,7 @@ inline void VM::concatenate()
 			auto a = m_stack.top().asObjString()->value;
 			char buff[1024];
 			std::sprintf(buff, "%g", b);
-			m_stack.top() = Value::Object(Memory::createString(this, a + std::string(buff)));
+			m_stack.top() = Value::Object(Memory::createYoungString(this, a + std::string(buff)));
 		}
 	}
 	else if constexpr (std::is_same<double, _Val_a>::value)
@@ -86,7 +86,7 @@ inline void VM::concatenate()
 			auto a = m_stack.top().asNumber();
 			char buff[1024];
 			std::sprintf(buff, "%g", a);
-			m_stack.top() = Value::Object(Memory::createString(this, std::string(buff) + b));
+			m_stack.top() = Value::Object(Memory::createYoungString(this, std::string(buff) + b));
 		}
 		else if constexpr (std::is_same<double, _Val_b>::value)
 		{